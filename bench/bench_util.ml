@@ -0,0 +1,56 @@
+(* Helpers shared by the benchmarks that read test files. *)
+
+(* O_DIRECT needs page-aligned memory, and registering a file-backed mapping as a
+   fixed buffer fails with EOPNOTSUPP on many kernels. A shared mapping of /dev/zero
+   is anonymous (shmem) memory, so it is both aligned and accepted. *)
+let aligned_buffer size =
+  let fd = Unix.openfile "/dev/zero" [O_RDWR; O_CLOEXEC] 0 in
+  Fun.protect ~finally:(fun () -> Unix.close fd) @@ fun () ->
+  Bigarray.array1_of_genarray (Unix.map_file fd Bigarray.char Bigarray.c_layout true [| size |])
+
+let create_test_file ~size path =
+  Printf.printf "Creating %d MB test file %S...\n%!" (size / 1024 / 1024) path;
+  let fd = Unix.openfile path [O_WRONLY; O_CREAT; O_EXCL] 0o644 in
+  let block = Bytes.init (1024 * 1024) (fun _ -> Char.chr (Random.int 256)) in
+  for _ = 1 to size / Bytes.length block do
+    assert (Unix.write fd block 0 (Bytes.length block) = Bytes.length block)
+  done;
+  Unix.fsync fd;
+  Unix.close fd
+
+(* Runs [fn] with an unlinked temporary file of [size] bytes, which will be in the page cache. *)
+let with_test_file ~size fn =
+  let path = Filename.temp_file "bench" ".dat" in
+  let fd = Unix.openfile path [O_RDWR; O_CLOEXEC] 0o600 in
+  Unix.unlink path;
+  Fun.protect ~finally:(fun () -> Unix.close fd) @@ fun () ->
+  let block = Bytes.make (1024 * 1024) 'x' in
+  for _ = 1 to size / Bytes.length block do
+    assert (Unix.write fd block 0 (Bytes.length block) = Bytes.length block)
+  done;
+  fn fd
+
+(* Works for block devices (e.g. a loop device) too, where [st_size] is 0. *)
+let file_size fd =
+  let size = Unix.LargeFile.lseek fd 0L SEEK_END in
+  ignore (Unix.LargeFile.lseek fd 0L SEEK_SET : int64);
+  Int64.to_int size
+
+(* The Unix module has no O_DIRECT flag, so open the file with io_uring instead. *)
+let open_direct path =
+  let t = Uring.create ~queue_depth:1 () in
+  let flags = Uring.Open_flags.(cloexec + direct) in
+  assert (Uring.openat2 t ~access:`R ~flags ~perm:0 ~resolve:Uring.Resolve.empty path () <> None);
+  let rec wait () =
+    match Uring.wait t with
+    | Some { result; data = () } -> result
+    | None -> wait ()
+  in
+  let result = wait () in
+  Uring.exit t;
+  if result >= 0 then (Obj.magic result : Unix.file_descr) (* The FD number *)
+  else (
+    Printf.printf "Warning: O_DIRECT not supported here (%s); results will mostly reflect the page cache\n%!"
+      (Unix.error_message (Uring.error_of_errno result));
+    Unix.openfile path [O_RDONLY; O_CLOEXEC] 0
+  )
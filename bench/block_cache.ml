@@ -0,0 +1,115 @@
+(* Compares random block reads with a Zipfian distribution, with and without a Block_cache.
+
+   Usage: block_cache.exe [FILE]
+
+   If FILE is not given, a 64 MB test file is created in the current directory.
+   The file is opened with O_DIRECT where possible, so that uncached reads go to the device. *)
+
+let block_size = 4096
+let cache_blocks = 2048
+let depth = 32
+let requests = 200_000
+let zipf_s = 0.99
+let default_file = "block-cache-bench.dat"
+let default_size = 64 * 1024 * 1024
+
+let ok = function
+  | Ok x -> x
+  | Error `ENOMEM -> failwith "Not enough memory for fixed buffer"
+
+(* Block numbers, with block [i] having weight 1/(i+1)^s, scattered over the file. *)
+let zipf_sampler ~blocks =
+  let cdf = Array.make blocks 0.0 in
+  let total = ref 0.0 in
+  for i = 0 to blocks - 1 do
+    total := !total +. 1.0 /. Float.pow (float (i + 1)) zipf_s;
+    cdf.(i) <- !total
+  done;
+  let scatter = Array.init blocks Fun.id in
+  for i = blocks - 1 downto 1 do
+    let j = Random.int (i + 1) in
+    let x = scatter.(i) in
+    scatter.(i) <- scatter.(j);
+    scatter.(j) <- x
+  done;
+  fun () ->
+    let x = Random.float !total in
+    let rec search lo hi =
+      if lo >= hi then lo
+      else (
+        let mid = (lo + hi) / 2 in
+        if cdf.(mid) < x then search (mid + 1) hi else search lo mid
+      )
+    in
+    scatter.(search 0 (blocks - 1))
+
+let rec wait_result t =
+  match Uring.wait t with
+  | Some { result; data } ->
+    if result < 0 then raise (Unix.Unix_error (Uring.error_of_errno result, "read", ""));
+    data
+  | None -> wait_result t
+
+let run ~cached fd =
+  let blocks = Bench_util.file_size fd / block_size in
+  if blocks = 0 then failwith "Test file is too small";
+  Random.init 42;
+  let next_block = zipf_sampler ~blocks in
+  let t = Uring.create ~queue_depth:depth () in
+  let slots = if cached then cache_blocks else depth in
+  let fbuf = Bench_util.aligned_buffer (slots * block_size) in
+  ok (Uring.set_fixed_buffer t fbuf);
+  let region = Uring.Region.init ~block_size fbuf slots in
+  let cache = Uring.Block_cache.create region in
+  let issued = ref 0 in
+  let t0 = Unix.gettimeofday () in
+  let rec loop () =
+    if !issued < requests then (
+      let block = next_block () in
+      let submitted =
+        if cached then (
+          match Uring.Block_cache.read cache t ~file:0 fd block `Cached with
+          | `Hit (chunk, _) -> Uring.Shared_chunk.release chunk; true
+          | `Wait chunk -> Uring.Shared_chunk.release chunk; true
+          | `Busy | `Full -> false
+        ) else (
+          match Uring.Region.alloc region with
+          | exception Uring.Region.No_space -> false
+          | chunk ->
+            let file_offset = Optint.Int63.of_int (block * block_size) in
+            Uring.read_chunk t fd chunk (`Direct chunk) ~file_offset <> None
+        )
+      in
+      if submitted then incr issued
+      else (
+        ignore (Uring.submit t : int);
+        match wait_result t with
+        | `Cached -> ()
+        | `Direct chunk -> Uring.Region.free chunk
+      );
+      loop ()
+    )
+  in
+  loop ();
+  ignore (Uring.submit t : int);
+  Uring.exit ~drain:true t;
+  let time = Unix.gettimeofday () -. t0 in
+  Printf.printf "%-8s %8.0f reads/s" (if cached then "cached" else "direct") (float requests /. time);
+  if cached then (
+    let { Uring.Block_cache.hits; coalesced; misses; evictions } = Uring.Block_cache.stats cache in
+    Printf.printf "  hit ratio %.1f%% (%d coalesced, %d misses, %d evictions)"
+      (100.0 *. float hits /. float (hits + coalesced + misses)) coalesced misses evictions
+  );
+  print_newline ()
+
+let () =
+  let path =
+    match Sys.argv with
+    | [| _ |] -> if not (Sys.file_exists default_file) then Bench_util.create_test_file ~size:default_size default_file; default_file
+    | [| _; path |] -> path
+    | _ -> prerr_endline "Usage: block_cache.exe [FILE]"; exit 1
+  in
+  let fd = Bench_util.open_direct path in
+  run ~cached:false fd;
+  run ~cached:true fd;
+  Unix.close fd
@@ -0,0 +1,120 @@
+(* Compares two ways of watching many idle sockets for readiness:
+
+   - poll:  a poll_add for each socket, re-armed each time it fires.
+   - epoll: one epoll set, populated using epoll_ctl through the ring,
+            with a single poll_add on the epoll FD.
+
+   Each round makes a random selection of sockets readable and measures how long it takes
+   to notice them all and get ready for the next round.
+
+   Usage: epoll.exe [SOCKETS]
+
+   SOCKETS defaults to 100,000. You will probably need to raise the open file limit
+   (ulimit -n) to twice that. The poll mode needs a ring slot for each socket,
+   so it is skipped if SOCKETS is more than the maximum queue depth. *)
+
+let rounds = 200
+let active = 100                (* Sockets made ready in each round *)
+let max_queue_depth = 32768
+let ctl_batch = 256
+
+let rec wait_result t =
+  match Uring.wait t with
+  | Some { result; data } ->
+    if result < 0 then raise (Unix.Unix_error (Uring.error_of_errno result, "epoll", ""));
+    data
+  | None -> wait_result t
+
+let byte = Bytes.make 1 '!'
+
+(* [active] distinct random indexes into [pairs]. *)
+let pick pairs =
+  let n = Array.length pairs in
+  let seen = Hashtbl.create active in
+  let rec next () =
+    let i = Random.int n in
+    if Hashtbl.mem seen i then next () else (Hashtbl.add seen i (); i)
+  in
+  Array.init (min active n) (fun _ -> next ())
+
+let trigger pairs =
+  let picks = pick pairs in
+  picks |> Array.iter (fun i -> assert (Unix.write (snd pairs.(i)) byte 0 1 = 1));
+  Array.length picks
+
+let drain fd = assert (Unix.read fd (Bytes.create 1) 0 1 = 1)
+
+let report name ~arm ~time =
+  Printf.printf "%-6s arm %6.0f ms  %8.1f us/round (%d ready of %d per round)\n%!"
+    name (arm *. 1000.) (time /. float rounds *. 1e6) active
+
+let run_poll pairs =
+  let n = Array.length pairs in
+  let t = Uring.create ~queue_depth:n () in
+  let t0 = Unix.gettimeofday () in
+  pairs |> Array.iteri (fun i (r, _) -> assert (Uring.poll_add t r Uring.Poll_mask.pollin i <> None));
+  ignore (Uring.submit t : int);
+  let arm = Unix.gettimeofday () -. t0 in
+  let t0 = Unix.gettimeofday () in
+  for _ = 1 to rounds do
+    for _ = 1 to trigger pairs do
+      let i = wait_result t in
+      let r = fst pairs.(i) in
+      drain r;
+      assert (Uring.poll_add t r Uring.Poll_mask.pollin i <> None)
+    done;
+    ignore (Uring.submit t : int)
+  done;
+  let time = Unix.gettimeofday () -. t0 in
+  Uring.exit ~drain:true t;
+  report "poll" ~arm ~time
+
+let run_epoll pairs =
+  let t = Uring.create ~queue_depth:ctl_batch () in
+  let epfd = Uring.Epoll.create () in
+  let t0 = Unix.gettimeofday () in
+  let queued = ref 0 in
+  let flush () =
+    ignore (Uring.submit t : int);
+    for _ = 1 to !queued do assert (wait_result t = `Ctl) done;
+    queued := 0
+  in
+  pairs |> Array.iter (fun (r, _) ->
+      if !queued = ctl_batch then flush ();
+      assert (Uring.epoll_ctl t epfd r Uring.Epoll.Add Uring.Epoll.Events.epollin `Ctl <> None);
+      incr queued
+    );
+  flush ();
+  let arm = Unix.gettimeofday () -. t0 in
+  let buf = Array.make active Unix.stdin in
+  let t0 = Unix.gettimeofday () in
+  for _ = 1 to rounds do
+    let remaining = ref (trigger pairs) in
+    while !remaining > 0 do
+      assert (Uring.poll_add t epfd Uring.Poll_mask.pollin `Ready <> None);
+      ignore (Uring.submit t : int);
+      assert (wait_result t = `Ready);
+      let n = Uring.Epoll.ready epfd buf in
+      for i = 0 to n - 1 do drain buf.(i) done;
+      remaining := !remaining - n
+    done
+  done;
+  let time = Unix.gettimeofday () -. t0 in
+  Unix.close epfd;
+  Uring.exit t;
+  report "epoll" ~arm ~time
+
+let () =
+  let n =
+    match Sys.argv with
+    | [| _ |] -> 100_000
+    | [| _; n |] -> int_of_string n
+    | _ -> prerr_endline "Usage: epoll.exe [SOCKETS]"; exit 1
+  in
+  Random.init 42;
+  Printf.printf "Creating %d socket pairs...\n%!" n;
+  let pairs = Array.init n (fun _ -> Unix.socketpair ~cloexec:true Unix.PF_UNIX Unix.SOCK_STREAM 0) in
+  if n <= max_queue_depth then run_poll pairs
+  else Printf.printf "poll   skipped (needs a queue depth of %d)\n%!" n;
+  run_epoll pairs;
+  pairs |> Array.iter (fun (a, b) -> Unix.close a; Unix.close b)
@@ -0,0 +1,76 @@
+(* Measures how quickly FDs can be handed from one process to another using SCM_RIGHTS,
+   as a daemon passing accepted connections to worker processes would. *)
+
+let messages = 20_000
+
+let rec wait_result t =
+  match Uring.wait t with
+  | Some { result; data = () } ->
+    if result < 0 then raise (Unix.Unix_error (Uring.error_of_errno result, "fd_pass", ""));
+    result
+  | None -> wait_result t
+
+(* Receive messages on [sock] until EOF, closing the FDs received. *)
+let receiver ~api ~batch sock =
+  let t = Uring.create ~queue_depth:1 () in
+  let msg = Uring.Msghdr.create ~n_fds:batch [Cstruct.create 1] in
+  let rec loop () =
+    assert (Uring.recv_msg t sock msg () <> None);
+    if wait_result t > 0 then (
+      begin match api with
+        | `List -> List.iter Unix.close (Uring.Msghdr.get_fds msg)
+        | `Array -> Array.iter Unix.close (Uring.Msghdr.get_fds_array msg)
+      end;
+      loop ()
+    )
+  in
+  loop ();
+  Uring.exit t
+
+let sender ~api ~batch sock fds =
+  let t = Uring.create ~queue_depth:1 () in
+  let buf = [Cstruct.of_string "!"] in
+  let msg = Uring.Msghdr.create ~n_fds:batch buf in
+  Uring.Msghdr.set_fds msg fds;
+  let fd_list = Array.to_list fds in
+  for _ = 1 to messages do
+    let job =
+      match api with
+      | `List -> Uring.send_msg t sock buf ~fds:fd_list ()
+      | `Array -> Uring.send_msghdr t sock msg ()
+    in
+    assert (job <> None);
+    ignore (wait_result t : int)
+  done;
+  Uring.exit t
+
+let run ~api ~batch =
+  let a, b = Unix.socketpair ~cloexec:true Unix.PF_UNIX Unix.SOCK_SEQPACKET 0 in
+  let fds = Array.init batch (fun _ -> Unix.openfile "/dev/null" [O_RDONLY; O_CLOEXEC] 0) in
+  let t0 = Unix.gettimeofday () in
+  match Unix.fork () with
+  | 0 ->
+    Unix.close a;
+    receiver ~api ~batch b;
+    Unix._exit 0
+  | pid ->
+    Unix.close b;
+    sender ~api ~batch a fds;
+    Unix.close a;
+    begin match Unix.waitpid [] pid with
+      | _, Unix.WEXITED 0 -> ()
+      | _ -> failwith "Receiver failed"
+    end;
+    let time = Unix.gettimeofday () -. t0 in
+    Array.iter Unix.close fds;
+    Printf.printf "%-5s batch %3d: %10.0f fds/s %8.0f msgs/s\n%!"
+      (match api with `List -> "list" | `Array -> "array")
+      batch
+      (float (messages * batch) /. time)
+      (float messages /. time)
+
+let () =
+  [1; 8; 64; 253] |> List.iter (fun batch ->
+      run ~api:`List ~batch;
+      run ~api:`Array ~batch
+    )
@@ -0,0 +1,90 @@
+(* Measures the cost of forking a process that has a large fixed buffer.
+
+   For each mode, this allocates and fills a buffer, forks a child that just reports its
+   memory use and waits, and then writes to every page of the buffer in the parent:
+
+   - plain:    the buffer is not registered with a ring (pages are shared copy-on-write,
+               so the parent's writes must copy them).
+   - fixed:    the buffer is registered (pinned), so the kernel copies it at fork time.
+   - dontfork: the buffer is registered with [~dontfork:true], so the child doesn't get it.
+
+   Usage: fork.exe [MiB]
+
+   The size defaults to 1024 MiB. Registering it may need a higher RLIMIT_MEMLOCK (ulimit -l). *)
+
+let page_size = 4096
+
+type mode = Plain | Fixed | Dontfork
+
+let mode_name = function Plain -> "plain" | Fixed -> "fixed" | Dontfork -> "dontfork"
+
+(* VmRSS of /proc/self/status, in bytes. *)
+let rss () =
+  let ch = open_in "/proc/self/status" in
+  Fun.protect ~finally:(fun () -> close_in ch) @@ fun () ->
+  let rec loop () =
+    match input_line ch with
+    | exception End_of_file -> 0
+    | line ->
+      match String.split_on_char ':' line with
+      | ["VmRSS"; v] -> Scanf.sscanf v " %d kB" (fun kb -> kb * 1024)
+      | _ -> loop ()
+  in
+  loop ()
+
+let mib x = float x /. 1048576.
+
+let touch buf c =
+  for i = 0 to Bigarray.Array1.dim buf / page_size - 1 do
+    Bigarray.Array1.unsafe_set buf (i * page_size) c
+  done
+
+let run mode size =
+  let buf = Bigarray.(Array1.create char c_layout size) in
+  Bigarray.Array1.fill buf 'x';
+  let t = Uring.create ~queue_depth:1 () in
+  let registered =
+    match mode with
+    | Plain -> Ok ()
+    | Fixed -> Uring.set_fixed_buffer t buf
+    | Dontfork -> Uring.set_fixed_buffer ~dontfork:true t buf
+  in
+  match registered with
+  | Error `ENOMEM -> Printf.printf "%-9s skipped (can't register buffer; try raising ulimit -l)\n%!" (mode_name mode); Uring.exit t
+  | Ok () ->
+    let parent_rss = rss () in
+    let report_r, report_w = Unix.pipe ~cloexec:true () in
+    let done_r, done_w = Unix.pipe ~cloexec:true () in
+    let t0 = Unix.gettimeofday () in
+    match Unix.fork () with
+    | 0 ->
+      (* Child: don't touch [buf], as it may not exist here. *)
+      let msg = Bytes.of_string (string_of_int (rss ())) in
+      ignore (Unix.write report_w msg 0 (Bytes.length msg) : int);
+      Unix.close report_w;
+      ignore (Unix.read done_r (Bytes.create 1) 0 1 : int);
+      Unix._exit 0
+    | pid ->
+      let fork_time = Unix.gettimeofday () -. t0 in
+      Unix.close report_w;
+      let reply = Bytes.create 32 in
+      let child_rss = int_of_string (Bytes.sub_string reply 0 (Unix.read report_r reply 0 32)) in
+      let t0 = Unix.gettimeofday () in
+      touch buf 'y';
+      let write_time = Unix.gettimeofday () -. t0 in
+      Unix.close done_w;
+      ignore (Unix.waitpid [] pid);
+      List.iter Unix.close [report_r; done_r];
+      Printf.printf "%-9s fork %8.2f ms  parent writes %8.2f ms  RSS parent %7.1f MiB, child %7.1f MiB\n%!"
+        (mode_name mode) (fork_time *. 1000.) (write_time *. 1000.) (mib parent_rss) (mib child_rss);
+      ignore (Uring.set_fixed_buffer t Cstruct.empty.buffer);
+      Uring.exit t
+
+let () =
+  let size =
+    match Sys.argv with
+    | [| _ |] -> 1024
+    | [| _; n |] -> int_of_string n
+    | _ -> prerr_endline "Usage: fork.exe [MiB]"; exit 1
+  in
+  List.iter (fun mode -> run mode (size * 1024 * 1024); Gc.full_major ()) [Plain; Fixed; Dontfork]
@@ -0,0 +1,116 @@
+(* Measures the latency of small foreground reads while a background scan keeps the
+   device busy, first with no I/O priorities and then with the scan in the idle class.
+
+   Usage: ioprio.exe [FILE | --smoke]
+
+   FILE should be on the block device to be tested (and not on tmpfs, which
+   ignores priorities), or be the block device itself, e.g. a loop device set up
+   with [losetup --find --show IMAGE]. If not given, a 256 MB test file is created
+   in the current directory. The file is opened with O_DIRECT where possible, so
+   that the reads are not served from the page cache. Note that only some I/O
+   schedulers (e.g. BFQ) take priorities into account.
+
+   --smoke runs briefly against a small file in /dev/shm instead. Priorities have no
+   effect there, so this only checks that the benchmark works. *)
+
+let bg_block = 1024 * 1024
+let bg_depth = 16
+let fg_block = 4096
+let fg_interval = 0.002
+let duration = 3.0
+let default_file = "ioprio-bench.dat"
+let default_size = 256 * 1024 * 1024
+let smoke_size = 16 * 1024 * 1024
+let smoke_duration = 0.2
+
+let ok = function
+  | Ok x -> x
+  | Error `ENOMEM -> failwith "Not enough memory for fixed buffer"
+
+let percentile sorted p =
+  let n = Array.length sorted in
+  sorted.(min (n - 1) (n * p / 100))
+
+type job = Scan of int | Probe of float
+
+let run ~duration ~prioritise fd =
+  let size = Bench_util.file_size fd in
+  let blocks = size / bg_block in
+  if blocks = 0 then failwith "Test file is too small";
+  let bg_prio, fg_prio =
+    if prioritise then Uring.Ioprio.(make `Idle 7, make `Be 0)
+    else Uring.Ioprio.(none, none)
+  in
+  (* The scan uses the ring's default priority; the probes override it. *)
+  let t = Uring.create ~ioprio:bg_prio ~queue_depth:(bg_depth + 1) () in
+  ok (Uring.set_fixed_buffer t (Bench_util.aligned_buffer (bg_depth * bg_block + fg_block)));
+  Random.init 42;
+  let next_block = ref 0 in
+  let scanned = ref 0 in
+  let scan slot =
+    let file_offset = Optint.Int63.of_int (!next_block * bg_block) in
+    next_block := (!next_block + 1) mod blocks;
+    assert (Uring.read_fixed t fd ~file_offset ~off:(slot * bg_block) ~len:bg_block (Scan slot) <> None)
+  in
+  for slot = 0 to bg_depth - 1 do scan slot done;
+  let latencies = ref [] in
+  let probing = ref false in
+  let t0 = Unix.gettimeofday () in
+  let next_probe = ref t0 in
+  let rec loop () =
+    let now = Unix.gettimeofday () in
+    if now < t0 +. duration then (
+      if not !probing && now >= !next_probe then (
+        let file_offset = Optint.Int63.of_int (Random.int (size / fg_block) * fg_block) in
+        let off = bg_depth * bg_block in
+        assert (Uring.read_fixed t fd ~ioprio:fg_prio ~file_offset ~off ~len:fg_block (Probe now) <> None);
+        probing := true;
+        next_probe := now +. fg_interval
+      );
+      begin match Uring.wait ~timeout:fg_interval t with
+        | None -> ()
+        | Some { result; data } ->
+          if result < 0 then raise (Unix.Unix_error (Uring.error_of_errno result, "read", ""));
+          match data with
+          | Scan slot -> scanned := !scanned + result; scan slot
+          | Probe start ->
+            latencies := (Unix.gettimeofday () -. start) :: !latencies;
+            probing := false
+      end;
+      loop ()
+    )
+  in
+  loop ();
+  Uring.exit ~drain:true t;
+  let sorted = Array.of_list !latencies in
+  Array.sort compare sorted;
+  let ms x = x *. 1000. in
+  Printf.printf "%-12s probes %5d: p50 %7.3f ms  p99 %7.3f ms  max %7.3f ms; scan %7.1f MB/s\n%!"
+    (if prioritise then "ioprio" else "no ioprio")
+    (Array.length sorted)
+    (ms (percentile sorted 50))
+    (ms (percentile sorted 99))
+    (ms sorted.(Array.length sorted - 1))
+    (float !scanned /. duration /. 1024. /. 1024.)
+
+let bench ~duration path =
+  let fd = Bench_util.open_direct path in
+  run ~duration ~prioritise:false fd;
+  run ~duration ~prioritise:true fd;
+  Unix.close fd
+
+let smoke () =
+  let dir = if Sys.file_exists "/dev/shm" then "/dev/shm" else Filename.get_temp_dir_name () in
+  let path = Filename.concat dir (Printf.sprintf "ioprio-smoke-%d.dat" (Unix.getpid ())) in
+  Bench_util.create_test_file ~size:smoke_size path;
+  Fun.protect ~finally:(fun () -> Unix.unlink path) @@ fun () ->
+  bench ~duration:smoke_duration path
+
+let () =
+  match Sys.argv with
+  | [| _; "--smoke" |] -> smoke ()
+  | [| _ |] ->
+    if not (Sys.file_exists default_file) then Bench_util.create_test_file ~size:default_size default_file;
+    bench ~duration default_file
+  | [| _; path |] -> bench ~duration path
+  | _ -> prerr_endline "Usage: ioprio.exe [FILE | --smoke]"; exit 1
@@ -0,0 +1,61 @@
+(* Compares dispatching completions with Uring.Loop against a hand-written loop.
+
+   Both keep [in_flight] noops going: each completion queues a replacement
+   until [total] have completed. Reports the throughput and the minor heap
+   allocation per completion. *)
+
+let queue_depth = 64
+let in_flight = 32
+let total = 2_000_000
+
+let report name ~t0 ~minor0 =
+  let time = Unix.gettimeofday () -. t0 in
+  let minor = Gc.minor_words () -. minor0 in
+  Printf.printf "%-6s %9.0f ops/s  %5.1f minor words/op\n%!"
+    name (float total /. time) (minor /. float total)
+
+let run_manual () =
+  let t = Uring.create ~queue_depth () in
+  let started = ref 0 and finished = ref 0 in
+  let start () = incr started; assert (Uring.noop t `Noop <> None) in
+  let minor0 = Gc.minor_words () in
+  let t0 = Unix.gettimeofday () in
+  for _ = 1 to in_flight do start () done;
+  while !finished < total do
+    ignore (Uring.submit t : int);
+    let rec drain () =
+      match Uring.peek t with
+      | Some { data = `Noop; _ } ->
+        incr finished;
+        if !started < total then start ();
+        drain ()
+      | None -> ()
+    in
+    begin match Uring.wait t with
+      | Some { data = `Noop; _ } ->
+        incr finished;
+        if !started < total then start ()
+      | None -> ()
+    end;
+    drain ()
+  done;
+  report "manual" ~t0 ~minor0;
+  Uring.exit t
+
+let run_loop () =
+  let loop = Uring.Loop.create (Uring.create ~queue_depth ()) in
+  let ring = Uring.Loop.ring loop in
+  let started = ref 0 in
+  (* A single closure, shared by all the requests. *)
+  let rec on_noop (_ : int) = if !started < total then start ()
+  and start () = incr started; assert (Uring.noop ring on_noop <> None) in
+  let minor0 = Gc.minor_words () in
+  let t0 = Unix.gettimeofday () in
+  for _ = 1 to in_flight do start () done;
+  Uring.Loop.run loop;
+  report "loop" ~t0 ~minor0;
+  Uring.exit ring
+
+let () =
+  run_manual ();
+  run_loop ()
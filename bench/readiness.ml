@@ -0,0 +1,159 @@
+(* Measures readiness notification for a large number of idle FDs.
+
+   Opens FDS pipes and arms a poll on the read end of each, using either a poll_add
+   that is re-armed after each event or (if the kernel supports it) a multishot poll.
+   Each round then writes to a random selection of the pipes and measures the time
+   taken to be notified about all of them and re-arm.
+
+   Each ring can have at most 32768 operations in progress (one Heap slot each),
+   so the FDs are spread over several rings, which are served together using wait_any.
+
+   Usage: readiness.exe [FDS]
+
+   FDS defaults to 100,000. You will probably need to raise the open file limit
+   (ulimit -n) to twice that. *)
+
+let rounds = 500
+let active = 100                (* Pipes made ready in each round *)
+let ring_size = 32768
+
+type mode = Oneshot | Multishot
+
+let mode_name = function Oneshot -> "poll_add" | Multishot -> "multishot"
+
+let arm mode t r i =
+  let job =
+    match mode with
+    | Oneshot -> Uring.poll_add t r Uring.Poll_mask.pollin i
+    | Multishot -> Uring.poll_multishot t r Uring.Poll_mask.pollin i
+  in
+  Option.get job
+
+let multishot_supported () =
+  let t = Uring.create ~queue_depth:1 () in
+  let r, w = Unix.pipe ~cloexec:true () in
+  let job = Option.get (Uring.poll_multishot t r Uring.Poll_mask.pollin ()) in
+  ignore (Uring.submit t : int);
+  assert (Unix.write_substring w "!" 0 1 = 1);
+  let rec wait () = match Uring.wait t with Some { result; _ } -> result | None -> wait () in
+  let ok = wait () >= 0 && Uring.active job in
+  if Uring.active job then Uring.exit ~drain:true t else Uring.exit t;
+  Unix.close r;
+  Unix.close w;
+  ok
+
+(* Size of a field in the "Name: N kB" format of /proc/self/status or /proc/meminfo, in bytes. *)
+let proc_kb path field =
+  let ch = open_in path in
+  Fun.protect ~finally:(fun () -> close_in ch) @@ fun () ->
+  let rec loop () =
+    match input_line ch with
+    | exception End_of_file -> 0
+    | line ->
+      match String.split_on_char ':' line with
+      | [name; v] when name = field -> Scanf.sscanf v " %d kB" (fun kb -> kb * 1024)
+      | _ -> loop ()
+  in
+  loop ()
+
+type memory = { rss : int; slab : int; ocaml : int }
+
+let memory () =
+  Gc.full_major ();
+  { rss = proc_kb "/proc/self/status" "VmRSS";
+    slab = proc_kb "/proc/meminfo" "Slab";     (* System-wide, so only approximate *)
+    ocaml = (Gc.quick_stat ()).heap_words * (Sys.word_size / 8);
+  }
+
+(* [active] distinct random pipe indexes. *)
+let pick n =
+  let seen = Hashtbl.create active in
+  let rec next () =
+    let i = Random.int n in
+    if Hashtbl.mem seen i then next () else (Hashtbl.add seen i (); i)
+  in
+  Array.init (min active n) (fun _ -> next ())
+
+let run mode pipes =
+  let n = Array.length pipes in
+  let rings = Array.init ((n + ring_size - 1) / ring_size) (fun _ -> Uring.create ~queue_depth:ring_size ()) in
+  let ring_of i = rings.(i / ring_size) in
+  let m0 = memory () in
+  let t0 = Unix.gettimeofday () in
+  let jobs = Array.mapi (fun i (r, _) -> arm mode (ring_of i) r i) pipes in
+  Array.iter (fun t -> ignore (Uring.submit t : int)) rings;
+  let arm_time = Unix.gettimeofday () -. t0 in
+  let m1 = memory () in
+  let slots = Array.fold_left (fun acc t -> acc + Uring.active_ops t) 0 rings in
+  let any = Array.to_list rings |> List.map (fun t -> Uring.Ring t) in
+  let latency = Uring.Histogram.create () in
+  let pending = Array.make n false in
+  let buf = Bytes.create 16 in
+  let rearms = ref 0 in
+  for _ = 1 to rounds do
+    let picks = pick n in
+    let t0 = Unix.gettimeofday () in
+    picks |> Array.iter (fun i -> pending.(i) <- true; assert (Unix.write (snd pipes.(i)) buf 0 1 = 1));
+    let remaining = ref (Array.length picks) in
+    while !remaining > 0 do
+      (* Only a few rings, so it's simplest to check them all. *)
+      ignore (Uring.wait_any any : Uring.ring list);
+      rings |> Array.iter (fun t ->
+          let rec collect () =
+            match Uring.peek t with
+            | None -> ()
+            | Some { result; data = i } ->
+              if result < 0 then raise (Unix.Unix_error (Uring.error_of_errno result, "poll", ""));
+              let r = fst pipes.(i) in
+              if pending.(i) then (
+                pending.(i) <- false;
+                decr remaining;
+                assert (Unix.read r buf 0 (Bytes.length buf) = 1)
+              );
+              (* A multishot poll stays armed unless the kernel stopped it. *)
+              if not (Uring.active jobs.(i)) then (
+                incr rearms;
+                jobs.(i) <- arm mode t r i
+              );
+              collect ()
+          in
+          collect ();
+          ignore (Uring.submit t : int)
+        )
+    done;
+    Uring.Histogram.add latency (Unix.gettimeofday () -. t0)
+  done;
+  let stats = Array.fold_left (fun acc t ->
+      let { Uring.overflows; lost } = Uring.cq_stats t in
+      acc + overflows + lost) 0 rings in
+  let t0 = Unix.gettimeofday () in
+  Array.iter (fun t -> Uring.exit ~drain:true t) rings;
+  let teardown = Unix.gettimeofday () -. t0 in
+  let per_fd x = float x /. float n in
+  Printf.printf "%s: %d FDs on %d ring(s), %d ring slots in use\n" (mode_name mode) n (Array.length rings) slots;
+  Printf.printf "  arm        %8.1f ms (%.2f us/FD)\n" (arm_time *. 1000.) (arm_time /. float n *. 1e6);
+  Printf.printf "  round      mean %.1f us, p99 %.1f us, max %.1f us (%d ready per round, %d re-arms in total)\n"
+    (Uring.Histogram.mean latency *. 1e6)
+    (Uring.Histogram.percentile latency 99.0 *. 1e6)
+    (Uring.Histogram.max latency *. 1e6)
+    active !rearms;
+  Printf.printf "  memory/FD  %.0f bytes RSS, %.0f bytes OCaml heap, ~%.0f bytes kernel slab\n"
+    (per_fd (m1.rss - m0.rss)) (per_fd (m1.ocaml - m0.ocaml)) (per_fd (m1.slab - m0.slab));
+  Printf.printf "  teardown   %8.1f ms (cancelling every poll)\n" (teardown *. 1000.);
+  if stats > 0 then Printf.printf "  CQ overflowed!\n";
+  flush stdout
+
+let () =
+  let n =
+    match Sys.argv with
+    | [| _ |] -> 100_000
+    | [| _; n |] -> int_of_string n
+    | _ -> prerr_endline "Usage: readiness.exe [FDS]"; exit 1
+  in
+  Random.init 42;
+  Printf.printf "Creating %d pipes...\n%!" n;
+  let pipes = Array.init n (fun _ -> Unix.pipe ~cloexec:true ()) in
+  run Oneshot pipes;
+  if multishot_supported () then run Multishot pipes
+  else print_endline "multishot: not supported by this kernel";
+  pipes |> Array.iter (fun (r, w) -> Unix.close r; Unix.close w)
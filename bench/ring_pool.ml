@@ -0,0 +1,55 @@
+(* Compares running many short-lived tasks, each needing its own ring, using
+   Uring.create/exit for every task against acquiring and releasing rings from a Ring_pool.
+
+   Each task submits a few noops and waits for them. The pooled version is run both
+   with and without a registered fixed buffer, since registration is also per ring. *)
+
+let tasks = 20_000
+let queue_depth = 64
+let ops_per_task = 4
+let fixed_buffer_size = 64 * 1024
+
+let rec wait_result t =
+  match Uring.wait t with
+  | Some { result; data = () } -> assert (result = 0)
+  | None -> wait_result t
+
+let task t =
+  for _ = 1 to ops_per_task do assert (Uring.noop t () <> None) done;
+  ignore (Uring.submit t : int);
+  for _ = 1 to ops_per_task do wait_result t done
+
+let report name time =
+  Printf.printf "%-16s %8.2f us/task (%.0f tasks/s)\n%!" name (time /. float tasks *. 1e6) (float tasks /. time)
+
+let time fn =
+  let t0 = Unix.gettimeofday () in
+  for _ = 1 to tasks do fn () done;
+  Unix.gettimeofday () -. t0
+
+let run_create ?fixed_buffer_size () =
+  let time = time (fun () ->
+      let t = Uring.create ~queue_depth () in
+      Option.iter (fun size ->
+          assert (Uring.set_fixed_buffer t (Bigarray.(Array1.create char c_layout size)) = Ok ())
+        ) fixed_buffer_size;
+      task t;
+      Uring.exit t
+    ) in
+  report (if fixed_buffer_size = None then "create/exit" else "create/exit+buf") time
+
+let run_pool ?fixed_buffer_size () =
+  let pool = Uring.Ring_pool.create ?fixed_buffer_size ~queue_depth () in
+  let time = time (fun () ->
+      let t = Uring.Ring_pool.acquire pool in
+      task t;
+      Uring.Ring_pool.release pool t
+    ) in
+  Uring.Ring_pool.close pool;
+  report (if fixed_buffer_size = None then "pool" else "pool+buf") time
+
+let () =
+  run_create ();
+  run_pool ();
+  run_create ~fixed_buffer_size ();
+  run_pool ~fixed_buffer_size ()
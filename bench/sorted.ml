@@ -0,0 +1,57 @@
+(* Compares submitting random 4 KB reads in arrival order with submitting them
+   sorted by offset using Uring.Batch.
+
+   Usage: sorted.exe [FILE]
+
+   FILE should be large and on the device to be tested (the benefit is mostly for
+   rotational disks and network block devices). If not given, a 1 GB test file
+   is created in the current directory. The file is opened with O_DIRECT where possible. *)
+
+let block_size = 4096
+let batch_size = 256
+let batches = 40
+let default_file = "sorted-bench.dat"
+let default_size = 1024 * 1024 * 1024
+
+let rec wait_result t =
+  match Uring.wait t with
+  | Some { result; data = () } ->
+    if result < 0 then raise (Unix.Unix_error (Uring.error_of_errno result, "read", ""))
+  | None -> wait_result t
+
+let run ~sorted fd =
+  let blocks = Bench_util.file_size fd / block_size in
+  if blocks = 0 then failwith "Test file is too small";
+  Random.init 42;
+  let t = Uring.create ~queue_depth:batch_size () in
+  let mem = Bench_util.aligned_buffer (batch_size * block_size) in
+  let buffers = Array.init batch_size (fun i -> Cstruct.of_bigarray mem ~off:(i * block_size) ~len:block_size) in
+  let batch = Uring.Batch.create t in
+  let t0 = Unix.gettimeofday () in
+  for _ = 1 to batches do
+    buffers |> Array.iter (fun buf ->
+        let file_offset = Optint.Int63.of_int (Random.int blocks * block_size) in
+        if sorted then Uring.Batch.readv batch fd [buf] () ~file_offset
+        else assert (Uring.readv t fd [buf] () ~file_offset <> None)
+      );
+    if sorted then assert (Uring.Batch.flush batch = batch_size);
+    assert (Uring.submit t = batch_size);
+    for _ = 1 to batch_size do wait_result t done
+  done;
+  let time = Unix.gettimeofday () -. t0 in
+  Uring.exit t;
+  Printf.printf "%-8s %8.0f reads/s\n%!"
+    (if sorted then "sorted" else "arrival")
+    (float (batches * batch_size) /. time)
+
+let () =
+  let path =
+    match Sys.argv with
+    | [| _ |] -> if not (Sys.file_exists default_file) then Bench_util.create_test_file ~size:default_size default_file; default_file
+    | [| _; path |] -> path
+    | _ -> prerr_endline "Usage: sorted.exe [FILE]"; exit 1
+  in
+  let fd = Bench_util.open_direct path in
+  run ~sorted:false fd;
+  run ~sorted:true fd;
+  Unix.close fd
@@ -0,0 +1,55 @@
+(* Compares submitting 4 KB reads of a file in the page cache using read_chunk
+   with submitting the same reads from a prepared Template.
+
+   Each round queues one read per chunk, submits them together and waits for them all.
+   Reports the throughput and the minor heap allocation per read. *)
+
+let block_size = 4096
+let file_size = 16 * 1024 * 1024
+let queue_depth = 64
+let rounds = 20_000
+
+let rec wait_result t =
+  match Uring.wait t with
+  | Some { result; data = _ } -> assert (result = block_size)
+  | None -> wait_result t
+
+let run ~api fd =
+  let t = Uring.create ~queue_depth () in
+  let fbuf = Bigarray.(Array1.create char c_layout (queue_depth * block_size)) in
+  assert (Uring.set_fixed_buffer t fbuf = Ok ());
+  let region = Uring.Region.init ~block_size fbuf queue_depth in
+  let chunks = Array.init queue_depth (fun _ -> Uring.Region.alloc region) in
+  let templates = Array.map (Uring.Template.read_chunk t fd) chunks in
+  let blocks = file_size / block_size in
+  let offsets = Array.init 4096 (fun _ -> Optint.Int63.of_int (Random.int blocks * block_size)) in
+  let next = ref 0 in
+  let minor0 = Gc.minor_words () in
+  let t0 = Unix.gettimeofday () in
+  for _ = 1 to rounds do
+    for i = 0 to queue_depth - 1 do
+      let file_offset = offsets.(!next land 4095) in
+      incr next;
+      let job =
+        match api with
+        | `Read_chunk -> Uring.read_chunk t fd chunks.(i) i ~file_offset
+        | `Template -> Uring.Template.submit templates.(i) ~file_offset i
+      in
+      assert (job <> None)
+    done;
+    ignore (Uring.submit t : int);
+    for _ = 1 to queue_depth do wait_result t done
+  done;
+  let time = Unix.gettimeofday () -. t0 in
+  let minor = Gc.minor_words () -. minor0 in
+  let reads = float (rounds * queue_depth) in
+  Printf.printf "%-10s %9.0f reads/s  %5.1f minor words/read\n%!"
+    (match api with `Read_chunk -> "read_chunk" | `Template -> "template")
+    (reads /. time) (minor /. reads);
+  Uring.exit t
+
+let () =
+  Random.init 42;
+  Bench_util.with_test_file ~size:file_size @@ fun fd ->
+  run ~api:`Read_chunk fd;
+  run ~api:`Template fd
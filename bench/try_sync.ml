@@ -0,0 +1,44 @@
+(* Compares 4 KB reads of a file in the page cache using readv (submit and wait)
+   with try_readv (which reads inline with RWF_NOWAIT when it can). *)
+
+let block_size = 4096
+let file_size = 16 * 1024 * 1024
+let reads = 200_000
+
+let rec wait_result t =
+  match Uring.wait t with
+  | Some { result; data = () } ->
+    if result < 0 then raise (Unix.Unix_error (Uring.error_of_errno result, "read", ""))
+  | None -> wait_result t
+
+let run ~api fd =
+  let t = Uring.create ~queue_depth:1 () in
+  let buf = Cstruct.create block_size in
+  Random.init 42;
+  let t0 = Unix.gettimeofday () in
+  for _ = 1 to reads do
+    let file_offset = Optint.Int63.of_int (Random.int (file_size / block_size) * block_size) in
+    match api with
+    | `Readv ->
+      assert (Uring.readv t fd [buf] () ~file_offset <> None);
+      ignore (Uring.submit t : int);
+      wait_result t
+    | `Try ->
+      match Uring.try_readv t fd [buf] () ~file_offset with
+      | `Done _ -> ()
+      | `Submitted _ -> ignore (Uring.submit t : int); wait_result t
+      | `Full -> assert false
+  done;
+  let time = Unix.gettimeofday () -. t0 in
+  Printf.printf "%-9s %9.0f reads/s" (match api with `Readv -> "readv" | `Try -> "try_readv") (float reads /. time);
+  if api = `Try then (
+    let { Uring.inline; fallback } = Uring.try_stats t in
+    Printf.printf "  (%.1f%% inline)" (100.0 *. float inline /. float (inline + fallback))
+  );
+  print_newline ();
+  Uring.exit t
+
+let () =
+  Bench_util.with_test_file ~size:file_size @@ fun fd ->
+  run ~api:`Readv fd;
+  run ~api:`Try fd
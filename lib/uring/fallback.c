@@ -0,0 +1,525 @@
+/*
+ * A thread-pool implementation of io_uring, for when the kernel won't provide one.
+ * See fallback.h.
+ */
+
+#include <endian.h>	/* liburing.h needs this for __BYTE_ORDER */
+#include <liburing.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+
+#include "fallback.h"
+
+#undef URING_DEBUG
+#ifdef URING_DEBUG
+#define dprintf(fmt, ...) fprintf(stderr, fmt, ##__VA_ARGS__)
+#else
+#define dprintf(fmt, ...) ((void)0)
+#endif
+
+// Must match IGNORED_USER_DATA in uring_stubs.c.
+#define IGNORED_USER_DATA ((__u64) -1)
+
+// A chain of linked SQEs, run in order by a single thread.
+struct job {
+  struct job *next;
+  unsigned n;
+  struct io_uring_sqe sqes[];
+};
+
+struct completion {
+  struct completion *next;
+  struct io_uring_cqe cqe;
+};
+
+struct fallback;
+
+struct worker {
+  struct fallback *fb;
+  pthread_t thread;
+  int wake_fd;                  // Written to interrupt the current job, for cancellation
+  struct job *job;              // The job being run, if any
+  int cancelled;                // [job] has been cancelled
+  int waiting;                  // In [wait_ready], so cancelling will interrupt it
+};
+
+struct fallback {
+  struct io_uring ring;         // Must be first
+  pthread_mutex_t lock;         // Protects everything below
+  pthread_cond_t work_ready;
+  pthread_cond_t cqe_ready;
+  struct job *jobs_head, *jobs_tail;
+  struct completion *cq_head, *cq_tail;
+  int shutdown;
+  int n_workers;
+  struct worker *workers;
+  // What would normally be the kernel's side of the ring
+  unsigned sq_khead, sq_ktail, sq_mask, sq_entries, sq_flags, sq_dropped;
+  unsigned cq_khead, cq_ktail, cq_mask, cq_entries, cq_flags, cq_overflow;
+};
+
+#define Fallback_val(ring) ((struct fallback *) (ring))
+
+// Lock must be held.
+static void post_locked(struct fallback *fb, __u64 user_data, int res) {
+  struct completion *c;
+  uint64_t one = 1;
+  if (user_data == IGNORED_USER_DATA) return;
+  c = malloc(sizeof(struct completion));
+  if (!c) {
+    // Nowhere to put it; report it the way the kernel reports a dropped CQE.
+    fb->cq_overflow++;
+    return;
+  }
+  c->next = NULL;
+  c->cqe.user_data = user_data;
+  c->cqe.res = res;
+  c->cqe.flags = 0;
+  if (fb->cq_tail) fb->cq_tail->next = c; else fb->cq_head = c;
+  fb->cq_tail = c;
+  __atomic_store_n(&fb->cq_ktail, fb->cq_ktail + 1, __ATOMIC_RELEASE);
+  if (write(fb->ring.ring_fd, &one, sizeof(one)) < 0) { /* Already readable */ }
+  pthread_cond_signal(&fb->cqe_ready);
+}
+
+static void post(struct fallback *fb, __u64 user_data, int res) {
+  pthread_mutex_lock(&fb->lock);
+  post_locked(fb, user_data, res);
+  pthread_mutex_unlock(&fb->lock);
+}
+
+static int is_cancelled(struct worker *w) {
+  int cancelled;
+  pthread_mutex_lock(&w->fb->lock);
+  cancelled = w->cancelled;
+  pthread_mutex_unlock(&w->fb->lock);
+  return cancelled;
+}
+
+// Set [w->waiting], unless the job has already been cancelled.
+static int start_waiting(struct worker *w) {
+  int cancelled;
+  pthread_mutex_lock(&w->fb->lock);
+  cancelled = w->cancelled;
+  w->waiting = !cancelled;
+  pthread_mutex_unlock(&w->fb->lock);
+  return cancelled ? -ECANCELED : 0;
+}
+
+static void stop_waiting(struct worker *w) {
+  pthread_mutex_lock(&w->fb->lock);
+  w->waiting = 0;
+  pthread_mutex_unlock(&w->fb->lock);
+}
+
+// Poll until [fd] has one of [events] (stored in [*revents]), the job is cancelled (-ECANCELED),
+// or [timeout_ms] passes (-ETIME). If [fd] is -1, just wait for the timeout or cancellation.
+static int poll_ready(struct worker *w, int fd, short events, int timeout_ms, short *revents) {
+  struct pollfd fds[2];
+  uint64_t count;
+  fds[0].fd = w->wake_fd;
+  fds[0].events = POLLIN;
+  fds[1].fd = fd;
+  fds[1].events = events;
+  for (;;) {
+    fds[0].revents = 0;
+    fds[1].revents = 0;
+    int r = poll(fds, fd >= 0 ? 2 : 1, timeout_ms);
+    if (r < 0) {
+      if (errno == EINTR) continue;
+      return -errno;
+    }
+    if (r == 0) return -ETIME;
+    if (fds[0].revents) {
+      if (read(w->wake_fd, &count, sizeof(count)) < 0) { /* Already reset */ }
+      if (is_cancelled(w)) return -ECANCELED;
+      continue;
+    }
+    if (revents) *revents = fds[1].revents;
+    return 0;
+  }
+}
+
+// Like [poll_ready], but marks the worker as waiting so that [cancel_locked] knows it can
+// interrupt it. This lets operations that may block forever (such as reading from a socket)
+// be cancelled. Fails at once if the job was cancelled earlier.
+static int wait_ready(struct worker *w, int fd, short events, int timeout_ms, short *revents) {
+  int r = start_waiting(w);
+  if (r == 0) {
+    r = poll_ready(w, fd, events, timeout_ms, revents);
+    stop_waiting(w);
+  }
+  return r;
+}
+
+#define Check(x) do { int _r = (x); if (_r < 0) return _r; } while (0)
+
+static int sys(long r) {
+  return r < 0 ? -errno : (int) r;
+}
+
+static int timespec_ms(__u64 addr) {
+  struct __kernel_timespec *ts = (struct __kernel_timespec *) (uintptr_t) addr;
+  return ts->tv_sec * 1000 + (ts->tv_nsec + 999999) / 1000000;
+}
+
+static loff_t *opt_offset(__u64 *off) {
+  return (int64_t) *off == -1 ? NULL : (loff_t *) off;
+}
+
+// Perform the operation described by [sqe] with ordinary system calls.
+static int run_sqe(struct worker *w, struct io_uring_sqe *sqe, int timeout_ms) {
+  int fd = sqe->fd;
+  void *addr = (void *) (uintptr_t) sqe->addr;
+  off_t off = (off_t) sqe->off;
+  short revents;
+  switch (sqe->opcode) {
+    case IORING_OP_NOP:
+      return 0;
+    case IORING_OP_READV:
+      Check(wait_ready(w, fd, POLLIN, timeout_ms, NULL));
+      return sys(preadv2(fd, addr, sqe->len, off, sqe->rw_flags));
+    case IORING_OP_WRITEV:
+      Check(wait_ready(w, fd, POLLOUT, timeout_ms, NULL));
+      return sys(pwritev2(fd, addr, sqe->len, off, sqe->rw_flags));
+    case IORING_OP_READ_FIXED:
+      Check(wait_ready(w, fd, POLLIN, timeout_ms, NULL));
+      return sys(off == -1 ? read(fd, addr, sqe->len) : pread(fd, addr, sqe->len, off));
+    case IORING_OP_WRITE_FIXED:
+      Check(wait_ready(w, fd, POLLOUT, timeout_ms, NULL));
+      return sys(off == -1 ? write(fd, addr, sqe->len) : pwrite(fd, addr, sqe->len, off));
+    case IORING_OP_FSYNC:
+      return sys((sqe->fsync_flags & IORING_FSYNC_DATASYNC) ? fdatasync(fd) : fsync(fd));
+    case IORING_OP_POLL_ADD:
+      // Multishot polls are treated as single-shot, which the API allows for.
+      Check(wait_ready(w, fd, sqe->poll32_events, timeout_ms, &revents));
+      return revents;
+    case IORING_OP_SENDMSG:
+      Check(wait_ready(w, fd, POLLOUT, timeout_ms, NULL));
+      return sys(sendmsg(fd, addr, sqe->msg_flags));
+    case IORING_OP_RECVMSG:
+      Check(wait_ready(w, fd, POLLIN, timeout_ms, NULL));
+      return sys(recvmsg(fd, addr, sqe->msg_flags));
+    case IORING_OP_RECV:
+      Check(wait_ready(w, fd, POLLIN, timeout_ms, NULL));
+      return sys(recv(fd, addr, sqe->len, sqe->msg_flags));
+    case IORING_OP_ACCEPT:
+      Check(wait_ready(w, fd, POLLIN, timeout_ms, NULL));
+      return sys(accept4(fd, addr, (socklen_t *) (uintptr_t) sqe->addr2, sqe->accept_flags));
+    case IORING_OP_CONNECT:
+      return sys(connect(fd, addr, sqe->off));
+    case IORING_OP_CLOSE:
+      return sys(close(fd));
+    case IORING_OP_SHUTDOWN:
+      return sys(shutdown(fd, sqe->len));
+    case IORING_OP_OPENAT2:
+#ifdef SYS_openat2
+      return sys(syscall(SYS_openat2, fd, addr, (void *) (uintptr_t) sqe->off, (size_t) sqe->len));
+#else
+      return -ENOSYS;
+#endif
+    case IORING_OP_EPOLL_CTL:
+      return sys(epoll_ctl(fd, sqe->len, sqe->off, addr));
+    case IORING_OP_SPLICE:
+      Check(wait_ready(w, sqe->splice_fd_in, POLLIN, timeout_ms, NULL));
+      return sys(splice(sqe->splice_fd_in, opt_offset(&sqe->splice_off_in),
+                        fd, opt_offset(&sqe->off), sqe->len, sqe->splice_flags));
+    case IORING_OP_TIMEOUT:
+      return wait_ready(w, -1, 0, timespec_ms(sqe->addr), NULL);
+    default:
+      return -EINVAL;
+  }
+}
+
+// Run each SQE in the chain in turn, as the kernel would.
+static void run_job(struct worker *w, struct job *job) {
+  struct fallback *fb = w->fb;
+  int broken = 0;               // A soft link failed, so cancel the rest of the chain
+  for (unsigned i = 0; i < job->n; i++) {
+    struct io_uring_sqe *sqe = &job->sqes[i];
+    struct io_uring_sqe *link_timeout = NULL;
+    int timeout_ms = -1;
+    int res;
+    if (sqe->opcode == IORING_OP_LINK_TIMEOUT) continue;        // Handled with the SQE before it
+    if (i + 1 < job->n && job->sqes[i + 1].opcode == IORING_OP_LINK_TIMEOUT) {
+      link_timeout = &job->sqes[i + 1];
+      timeout_ms = timespec_ms(link_timeout->addr);
+    }
+    res = broken ? -ECANCELED : run_sqe(w, sqe, timeout_ms);
+    if (link_timeout) {
+      if (res == -ETIME) {
+        res = -ECANCELED;
+        post(fb, link_timeout->user_data, -ETIME);
+      } else {
+        post(fb, link_timeout->user_data, -ECANCELED);
+      }
+    }
+    dprintf("fallback: op %d -> %d\n", sqe->opcode, res);
+    post(fb, sqe->user_data, res);
+    if (res < 0 && !(sqe->flags & IOSQE_IO_HARDLINK)) broken = 1;
+  }
+}
+
+static void *worker_main(void *v_worker) {
+  struct worker *w = v_worker;
+  struct fallback *fb = w->fb;
+  pthread_mutex_lock(&fb->lock);
+  for (;;) {
+    while (!fb->jobs_head && !fb->shutdown)
+      pthread_cond_wait(&fb->work_ready, &fb->lock);
+    if (fb->shutdown) break;    // Any remaining jobs are internal ones, freed by [free_fallback]
+    struct job *job = fb->jobs_head;
+    fb->jobs_head = job->next;
+    if (!fb->jobs_head) fb->jobs_tail = NULL;
+    w->job = job;
+    w->cancelled = 0;
+    pthread_mutex_unlock(&fb->lock);
+    run_job(w, job);
+    pthread_mutex_lock(&fb->lock);
+    w->job = NULL;
+    free(job);
+  }
+  pthread_mutex_unlock(&fb->lock);
+  return NULL;
+}
+
+static int job_has(struct job *job, __u64 user_data) {
+  for (unsigned i = 0; i < job->n; i++)
+    if (job->sqes[i].user_data == user_data) return 1;
+  return 0;
+}
+
+// Cancel the job with [user_data]. Jobs still queued are removed (returning 0).
+// A running job is interrupted if it is waiting for an FD to become ready (returning 0).
+// Otherwise, it may be in a call that can't be interrupted (e.g. connect or fsync), so we return
+// -EALREADY, as the kernel does; the job still fails if it later reaches [wait_ready].
+// Lock must be held.
+static int cancel_locked(struct fallback *fb, __u64 user_data) {
+  struct job **p = &fb->jobs_head;
+  struct job *prev = NULL;
+  uint64_t one = 1;
+  for (struct job *job = fb->jobs_head; job; prev = job, job = job->next) {
+    if (job_has(job, user_data)) {
+      *p = job->next;
+      if (fb->jobs_tail == job) fb->jobs_tail = prev;
+      for (unsigned i = 0; i < job->n; i++) post_locked(fb, job->sqes[i].user_data, -ECANCELED);
+      free(job);
+      return 0;
+    }
+    p = &job->next;
+  }
+  for (int i = 0; i < fb->n_workers; i++) {
+    struct worker *w = &fb->workers[i];
+    if (w->job && job_has(w->job, user_data)) {
+      if (w->cancelled) return -EALREADY;
+      w->cancelled = 1;
+      if (!w->waiting) return -EALREADY;
+      if (write(w->wake_fd, &one, sizeof(one)) < 0) { /* Already signalled */ }
+      return 0;
+    }
+  }
+  return -ENOENT;
+}
+
+int fallback_submit(struct io_uring *ring) {
+  struct fallback *fb = Fallback_val(ring);
+  unsigned head = fb->sq_khead;
+  // The SQEs queued since [head]. liburing's own tail field is private, so ask it.
+  unsigned tail = head + io_uring_sq_ready(ring);
+  unsigned mask = fb->sq_mask;
+  int submitted = tail - head;
+  pthread_mutex_lock(&fb->lock);
+  while (head != tail) {
+    struct io_uring_sqe *sqe = &ring->sq.sqes[head & mask];
+    unsigned n = 1;
+    if (sqe->opcode == IORING_OP_ASYNC_CANCEL) {
+      // Handled at once, as it may be needed to free up a worker.
+      post_locked(fb, sqe->user_data, cancel_locked(fb, sqe->addr));
+      head++;
+      continue;
+    }
+    while (head + n != tail && (ring->sq.sqes[(head + n - 1) & mask].flags & (IOSQE_IO_LINK | IOSQE_IO_HARDLINK)))
+      n++;
+    struct job *job = malloc(sizeof(struct job) + n * sizeof(struct io_uring_sqe));
+    if (!job) {
+      for (unsigned i = 0; i < n; i++) post_locked(fb, ring->sq.sqes[(head + i) & mask].user_data, -ENOMEM);
+    } else {
+      job->next = NULL;
+      job->n = n;
+      for (unsigned i = 0; i < n; i++) job->sqes[i] = ring->sq.sqes[(head + i) & mask];
+      if (fb->jobs_tail) fb->jobs_tail->next = job; else fb->jobs_head = job;
+      fb->jobs_tail = job;
+      pthread_cond_signal(&fb->work_ready);
+    }
+    head += n;
+  }
+  __atomic_store_n(&fb->sq_khead, head, __ATOMIC_RELEASE);
+  pthread_mutex_unlock(&fb->lock);
+  dprintf("fallback: submitted %d\n", submitted);
+  return submitted;
+}
+
+int fallback_get_cqe(struct io_uring *ring, int wait, const struct timespec *timeout, struct io_uring_cqe *cqe) {
+  struct fallback *fb = Fallback_val(ring);
+  struct completion *c;
+  uint64_t count;
+  pthread_mutex_lock(&fb->lock);
+  while (!fb->cq_head) {
+    if (!wait) {
+      pthread_mutex_unlock(&fb->lock);
+      return -EAGAIN;
+    }
+    if (timeout) {
+      if (pthread_cond_timedwait(&fb->cqe_ready, &fb->lock, timeout) == ETIMEDOUT && !fb->cq_head) {
+        pthread_mutex_unlock(&fb->lock);
+        return -ETIME;
+      }
+    } else {
+      pthread_cond_wait(&fb->cqe_ready, &fb->lock);
+    }
+  }
+  c = fb->cq_head;
+  fb->cq_head = c->next;
+  if (!fb->cq_head) {
+    fb->cq_tail = NULL;
+    // Nothing left, so make [ring_fd] unreadable again.
+    if (read(ring->ring_fd, &count, sizeof(count)) < 0) { /* Already reset */ }
+  }
+  __atomic_store_n(&fb->cq_khead, fb->cq_khead + 1, __ATOMIC_RELEASE);
+  pthread_mutex_unlock(&fb->lock);
+  *cqe = c->cqe;
+  free(c);
+  return 0;
+}
+
+static void free_fallback(struct fallback *fb) {
+  if (fb->workers) {
+    for (int i = 0; i < fb->n_workers; i++)
+      close(fb->workers[i].wake_fd);
+    free(fb->workers);
+  }
+  while (fb->jobs_head) {
+    struct job *job = fb->jobs_head;
+    fb->jobs_head = job->next;
+    free(job);
+  }
+  while (fb->cq_head) {
+    struct completion *c = fb->cq_head;
+    fb->cq_head = c->next;
+    free(c);
+  }
+  if (fb->ring.ring_fd >= 0) close(fb->ring.ring_fd);
+  pthread_cond_destroy(&fb->work_ready);
+  pthread_cond_destroy(&fb->cqe_ready);
+  pthread_mutex_destroy(&fb->lock);
+  free(fb->ring.sq.sqes);
+  free(fb);
+}
+
+struct io_uring *fallback_init(unsigned entries, int threads) {
+  struct fallback *fb;
+  struct io_uring *ring;
+  pthread_condattr_t attr;
+  sigset_t all, old;
+  unsigned size = 1;
+  int err;
+  if (entries == 0 || threads < 1) {
+    errno = EINVAL;
+    return NULL;
+  }
+  while (size < entries) size <<= 1;
+  fb = calloc(1, sizeof(struct fallback));
+  if (!fb) return NULL;
+  ring = &fb->ring;
+  pthread_mutex_init(&fb->lock, NULL);
+  pthread_cond_init(&fb->work_ready, NULL);
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&fb->cqe_ready, &attr);
+  pthread_condattr_destroy(&attr);
+  ring->flags = FALLBACK_RING;
+  ring->ring_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  fb->sq_mask = size - 1;
+  fb->sq_entries = size;
+  fb->cq_mask = 2 * size - 1;
+  fb->cq_entries = 2 * size;
+  ring->sq.khead = &fb->sq_khead;
+  ring->sq.ktail = &fb->sq_ktail;
+  ring->sq.kring_mask = &fb->sq_mask;
+  ring->sq.kring_entries = &fb->sq_entries;
+  ring->sq.kflags = &fb->sq_flags;
+  ring->sq.kdropped = &fb->sq_dropped;
+  ring->sq.sqes = calloc(size, sizeof(struct io_uring_sqe));
+  ring->cq.khead = &fb->cq_khead;
+  ring->cq.ktail = &fb->cq_ktail;
+  ring->cq.kring_mask = &fb->cq_mask;
+  ring->cq.kring_entries = &fb->cq_entries;
+  ring->cq.kflags = &fb->cq_flags;
+  ring->cq.koverflow = &fb->cq_overflow;
+  fb->workers = calloc(threads, sizeof(struct worker));
+  if (ring->ring_fd < 0 || !ring->sq.sqes || !fb->workers) goto fail;
+  // The workers shouldn't receive any signals meant for the OCaml program.
+  sigfillset(&all);
+  pthread_sigmask(SIG_SETMASK, &all, &old);
+  for (int i = 0; i < threads; i++) {
+    struct worker *w = &fb->workers[i];
+    w->fb = fb;
+    w->wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (w->wake_fd < 0) break;
+    err = pthread_create(&w->thread, NULL, worker_main, w);
+    if (err) {
+      close(w->wake_fd);
+      errno = err;
+      break;
+    }
+    fb->n_workers++;
+  }
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+  if (fb->n_workers < threads) {
+    err = errno;
+    fallback_exit(ring);
+    errno = err;
+    return NULL;
+  }
+  dprintf("fallback %p: started %d threads\n", fb, threads);
+  return ring;
+
+fail:
+  err = errno;
+  free_fallback(fb);
+  errno = err;
+  return NULL;
+}
+
+void fallback_exit(struct io_uring *ring) {
+  struct fallback *fb = Fallback_val(ring);
+  uint64_t one = 1;
+  pthread_mutex_lock(&fb->lock);
+  fb->shutdown = 1;
+  pthread_cond_broadcast(&fb->work_ready);
+  // The ring is idle, but workers may still be running internal steps (such as the drain
+  // in a teardown), which could wait forever. Cancel them so the threads can be joined.
+  for (int i = 0; i < fb->n_workers; i++) {
+    struct worker *w = &fb->workers[i];
+    if (w->job) {
+      w->cancelled = 1;
+      if (write(w->wake_fd, &one, sizeof(one)) < 0) { /* Already signalled */ }
+    }
+  }
+  pthread_mutex_unlock(&fb->lock);
+  for (int i = 0; i < fb->n_workers; i++)
+    pthread_join(fb->workers[i].thread, NULL);
+  free_fallback(fb);
+}
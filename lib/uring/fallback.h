@@ -0,0 +1,34 @@
+/*
+ * A stand-in for io_uring, for systems where io_uring_setup is unavailable
+ * (old kernels, or blocked by a seccomp profile).
+ *
+ * The ring is an ordinary [struct io_uring] whose queues live in normal memory,
+ * so the liburing helpers for getting and preparing SQEs work unchanged.
+ * Submitted requests are run by a pool of threads using the equivalent system calls,
+ * and their completions are collected with [fallback_get_cqe].
+ * [ring->ring_fd] is an eventfd that is readable while completions are waiting,
+ * so the ring can still be used with poll(2).
+ */
+
+#include <time.h>
+
+// Set in [ring->flags] for fallback rings. Not used by any real IORING_SETUP_* flag.
+#define FALLBACK_RING (1U << 31)
+
+#define Is_fallback(ring) ((ring)->flags & FALLBACK_RING)
+
+// Returns a new ring with [entries] SQ slots and [threads] worker threads,
+// or NULL (with errno set) on error.
+struct io_uring *fallback_init(unsigned entries, int threads);
+
+// Stops the threads and frees the ring, which must be idle.
+void fallback_exit(struct io_uring *ring);
+
+// Hands all queued SQEs to the worker threads. Returns the number submitted.
+int fallback_submit(struct io_uring *ring);
+
+// Removes the oldest completion and stores it in [cqe].
+// If there are none and [wait] is non-zero, waits for one until [timeout]
+// (an absolute CLOCK_MONOTONIC time), or forever if [timeout] is NULL.
+// Returns 0 on success, -EAGAIN if [wait] is 0 and there is no completion, or -ETIME.
+int fallback_get_cqe(struct io_uring *ring, int wait, const struct timespec *timeout, struct io_uring_cqe *cqe);
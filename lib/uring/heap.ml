@@ -109,4 +109,21 @@ let free t ptr =
 
   datum
 
+let get t ptr =
+  if ptr < 0 || ptr >= Array.length t.data || t.free_tail_relation.(ptr) <> slot_taken then
+    Fmt.invalid_arg "Heap.get: invalid pointer %d" ptr;
+  match t.data.(ptr) with
+  | Empty -> assert false
+  | Entry p -> p.data
+
+let is_freed = function
+  | Entry { ptr = -1; _ } -> true
+  | Entry _ -> false
+  | Empty -> assert false
+
 let in_use t = t.in_use
+
+let iter t f =
+  for ptr = 0 to Array.length t.data - 1 do
+    if t.free_tail_relation.(ptr) = slot_taken then f ptr
+  done
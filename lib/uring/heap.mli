@@ -41,5 +41,15 @@ val free : 'a t -> ptr -> 'a
 (** [free t p] returns the element referenced by [p] and removes it from the
     heap. Has undefined behaviour if [p] has already been freed. *)
 
+val get : 'a t -> ptr -> 'a
+(** [get t p] returns the element referenced by [p] without freeing it.
+    @raise Invalid_arg if [p] is not allocated. *)
+
+val is_freed : 'a entry -> bool
+(** [is_freed e] is [true] once [e] has been freed. *)
+
 val in_use : 'a t -> int
 (** [in_use t] is the number of entries currently allocated. *)
+
+val iter : 'a t -> (ptr -> unit) -> unit
+(** [iter t f] calls [f p] for each pointer [p] that is currently allocated. *)
@@ -0,0 +1,58 @@
+(* Log-linear buckets: each power of two is split into [sub_buckets] buckets,
+   starting from [min_value]. *)
+
+let sub_buckets = 4
+let min_value = 1e-6
+let n_buckets = 40 * sub_buckets        (* Up to about 12 days *)
+
+type t = {
+  counts : int array;
+  mutable count : int;
+  mutable sum : float;
+  mutable max : float;
+}
+
+let create () = { counts = Array.make n_buckets 0; count = 0; sum = 0.0; max = 0.0 }
+
+let bucket x =
+  if x <= min_value then 0
+  else min (n_buckets - 1) (int_of_float (Float.ceil (Float.log2 (x /. min_value) *. float sub_buckets)))
+
+let upper_bound i = min_value *. Float.pow 2.0 (float i /. float sub_buckets)
+
+let add t x =
+  let i = bucket x in
+  t.counts.(i) <- t.counts.(i) + 1;
+  t.count <- t.count + 1;
+  t.sum <- t.sum +. x;
+  if x > t.max then t.max <- x
+
+let count t = t.count
+
+let mean t = if t.count = 0 then 0.0 else t.sum /. float t.count
+
+let max t = t.max
+
+let percentile t p =
+  if p < 0.0 || p > 100.0 then Fmt.invalid_arg "Histogram.percentile: %f not in range 0-100" p;
+  if t.count = 0 then 0.0
+  else (
+    let target = Stdlib.max 1 (int_of_float (Float.ceil (p /. 100.0 *. float t.count))) in
+    let rec aux i seen =
+      let seen = seen + t.counts.(i) in
+      if seen >= target then Float.min (upper_bound i) t.max
+      else aux (i + 1) seen
+    in
+    aux 0 0
+  )
+
+let reset t =
+  Array.fill t.counts 0 n_buckets 0;
+  t.count <- 0;
+  t.sum <- 0.0;
+  t.max <- 0.0
+
+let pp f t =
+  let ms x = x *. 1000.0 in
+  Fmt.pf f "n=%d mean=%.3fms p50=%.3fms p99=%.3fms max=%.3fms"
+    t.count (ms (mean t)) (ms (percentile t 50.0)) (ms (percentile t 99.0)) (ms t.max)
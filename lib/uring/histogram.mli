@@ -0,0 +1,28 @@
+(** [Histogram] records a distribution of durations (in seconds) in constant space.
+
+    Values are grouped into logarithmic buckets (four per power of two, from 1 microsecond),
+    so percentiles are accurate to within about 19%. *)
+
+type t
+
+val create : unit -> t
+
+val add : t -> float -> unit
+(** [add t x] records a duration of [x] seconds. *)
+
+val count : t -> int
+(** [count t] is the number of values added. *)
+
+val mean : t -> float
+
+val max : t -> float
+(** [max t] is the largest value added (exactly). *)
+
+val percentile : t -> float -> float
+(** [percentile t p] is (an upper bound on) the [p]th percentile of the values added, or 0.0 if none have been.
+    @raise Invalid_argument if [p] is not in the range 0 to 100. *)
+
+val reset : t -> unit
+(** [reset t] removes all values from [t]. *)
+
+val pp : t Fmt.t
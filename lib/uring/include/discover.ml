@@ -2,7 +2,7 @@ module C = Configurator.V1
 
 let () =
   C.main ~name:"discover" (fun c ->
-      C.C_define.import c ~c_flags:["-D_GNU_SOURCE"] ~includes:["fcntl.h"; "poll.h"] C.C_define.Type.[
+      C.C_define.import c ~c_flags:["-D_GNU_SOURCE"] ~includes:["fcntl.h"; "poll.h"; "errno.h"] C.C_define.Type.[
           "POLLIN", Int;
           "POLLOUT", Int;
           "POLLERR", Int;
@@ -29,6 +29,11 @@ let () =
           "O_TMPFILE", Int;
 
           "AT_FDCWD", Int;
+
+          "ETIME", Int;
+          "ECANCELED", Int;
+          "EAGAIN", Int;
+          "EOPNOTSUPP", Int;
         ]
       |> List.map (function
           | name, C.C_define.Value.Int v ->
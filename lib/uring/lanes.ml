@@ -0,0 +1,80 @@
+(* Strict-priority submission lanes. Lane 0 is the express lane. *)
+
+type 'j request = {
+  submit : unit -> 'j option;
+  queued_at : float;
+}
+
+type 'j t = {
+  clock : unit -> float;
+  lanes : 'j request Queue.t array;
+  delays : Histogram.t array;
+  latencies : Histogram.t array;
+  on_complete : ('j -> (unit -> unit) -> unit) option;
+  in_flight : unit -> int;
+  shared : int;         (* Lower lanes can only use this many slots *)
+}
+
+let create ?(clock=Unix.gettimeofday) ?(reserve=0.0) ?on_complete ~queue_depth ~in_flight n =
+  if n < 1 then Fmt.invalid_arg "Lanes.create: need at least one lane (got %d)" n;
+  if reserve < 0.0 || reserve >= 1.0 then Fmt.invalid_arg "Lanes.create: reserve %f not in range [0, 1)" reserve;
+  let reserved = int_of_float (Float.ceil (reserve *. float queue_depth)) in
+  {
+    clock;
+    lanes = Array.init n (fun _ -> Queue.create ());
+    delays = Array.init n (fun _ -> Histogram.create ());
+    latencies = Array.init n (fun _ -> Histogram.create ());
+    on_complete;
+    in_flight;
+    shared = queue_depth - reserved;
+  }
+
+let lanes t = Array.length t.lanes
+
+let check_lane t lane =
+  if lane < 0 || lane >= Array.length t.lanes then Fmt.invalid_arg "Lanes: no lane %d" lane
+
+let enqueue t lane submit =
+  check_lane t lane;
+  Queue.push { submit; queued_at = t.clock () } t.lanes.(lane)
+
+let dispatch t =
+  let now = t.clock () in
+  let n_lanes = Array.length t.lanes in
+  (* Returns [false] if the ring is full or the reserve has been reached. *)
+  let rec drain_lane lane n =
+    let q = t.lanes.(lane) in
+    match Queue.peek_opt q with
+    | None -> true, n
+    | Some _ when lane > 0 && t.in_flight () >= t.shared -> false, n
+    | Some r ->
+      match r.submit () with
+      | None -> false, n
+      | Some job ->
+        ignore (Queue.pop q : _ request);
+        Histogram.add t.delays.(lane) (now -. r.queued_at);
+        t.on_complete |> Option.iter (fun on_complete ->
+            on_complete job (fun () -> Histogram.add t.latencies.(lane) (t.clock () -. r.queued_at))
+          );
+        drain_lane lane (n + 1)
+  in
+  let rec aux lane n =
+    if lane = n_lanes then n
+    else (
+      let continue, n = drain_lane lane n in
+      if continue then aux (lane + 1) n else n
+    )
+  in
+  aux 0 0
+
+let pending t lane =
+  check_lane t lane;
+  Queue.length t.lanes.(lane)
+
+let delays t lane =
+  check_lane t lane;
+  t.delays.(lane)
+
+let latencies t lane =
+  check_lane t lane;
+  t.latencies.(lane)
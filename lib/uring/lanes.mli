@@ -0,0 +1,51 @@
+(** [Lanes] gives some requests priority over others when refilling a ring's submission queue.
+
+    Requests are added to numbered lanes, and {!dispatch} always submits everything it can
+    from lane 0 before moving on to lane 1, and so on. This lets small or urgent requests
+    (e.g. metadata reads) overtake bulk transfers that are waiting for space in the ring.
+
+    Like {!Sched}, a request is a function that submits an operation, returning [None] if the
+    ring is full. *)
+
+type 'j t
+
+val create :
+  ?clock:(unit -> float) ->
+  ?reserve:float ->
+  ?on_complete:('j -> (unit -> unit) -> unit) ->
+  queue_depth:int ->
+  in_flight:(unit -> int) ->
+  int -> 'j t
+(** [create ~queue_depth ~in_flight n] creates [n] lanes, numbered from 0 (highest priority).
+    @param queue_depth The size of the ring being fed (see {!Uring.queue_depth}).
+    @param in_flight Returns the number of operations currently using slots in the ring (see {!Uring.active_ops}).
+    @param reserve The fraction of the [queue_depth] that only lane 0 may use (default 0.0).
+                   This ensures that express requests can be submitted immediately,
+                   even if the ring is busy with bulk requests.
+    @param on_complete [on_complete job fn] must arrange for [fn ()] to be called when [job] completes,
+                       e.g. [fun job fn -> Uring.on_complete ring job (fun _ -> fn ())].
+                       If given, {!latencies} records each request's total latency.
+    @param clock Used to measure queueing delays and latencies (default: [Unix.gettimeofday]). *)
+
+val lanes : _ t -> int
+(** [lanes t] is the number of lanes. *)
+
+val enqueue : 'j t -> int -> (unit -> 'j option) -> unit
+(** [enqueue t lane submit] adds a request to the end of [lane]. *)
+
+val dispatch : _ t -> int
+(** [dispatch t] submits requests in priority order until they are all submitted or a
+    request cannot be (because the ring is full, or the remaining space is reserved).
+    Requests in a lower-priority lane are never submitted while a higher one has requests waiting.
+    It returns the number of requests submitted. You still need to call {!Uring.submit}. *)
+
+val pending : _ t -> int -> int
+(** [pending t lane] is the number of requests waiting in [lane]. *)
+
+val delays : _ t -> int -> Histogram.t
+(** [delays t lane] records how long each request in [lane] waited between {!enqueue} and {!dispatch}.
+    This is only the time spent queued in the lane; see {!latencies} for the total. *)
+
+val latencies : _ t -> int -> Histogram.t
+(** [latencies t lane] records the time from {!enqueue} to completion of each request in [lane].
+    This is empty unless [t] was created with [on_complete]. *)
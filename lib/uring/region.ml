@@ -30,6 +30,8 @@ let free ({freelist; _}, v) =
 
 let length ({block_size;_}, _) = block_size
 
+let block_size t = t.block_size
+
 let length_option t = function
   | None -> t.block_size
   | Some len ->
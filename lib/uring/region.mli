@@ -32,6 +32,9 @@ type t
   val length : chunk -> int
   (** [length chunk] is the block size. *)
 
+  val block_size : t -> int
+  (** [block_size t] is the size of each chunk in [t]. *)
+
   val to_offset : chunk -> int
   (** [to_offset chunk] will convert the [chunk] into an integer
       offset in its associated region.  This can be used in IO calls
@@ -0,0 +1,160 @@
+(* Weighted fair queueing of submissions between tenants.
+ *
+ * Each request gets a virtual finish tag when it is queued, computed from its
+ * cost and its tenant's weight (self-clocked fair queueing). Dispatching always
+ * takes the request with the lowest finish tag among tenants that are not
+ * throttled by their token buckets. *)
+
+type bucket = {
+  rate : float;                 (* Tokens added per second *)
+  burst : float;                (* Maximum number of tokens *)
+  mutable tokens : float;       (* May go negative if a request costs more than we had *)
+  mutable last : float;         (* When [tokens] was last updated *)
+}
+
+type stats = {
+  ops : int;
+  bytes : int;
+  queued : int;
+  throttled : int;
+}
+
+type 'j request = {
+  submit : unit -> 'j option;
+  size : int;
+  finish : float;
+  mutable throttled : bool;     (* Already counted in its tenant's [throttled] *)
+}
+
+type 'j tenant = {
+  name : string;
+  weight : float;
+  requests : 'j request Queue.t;
+  bytes_limit : bucket option;
+  ops_limit : bucket option;
+  mutable last_finish : float;
+  mutable ops_done : int;
+  mutable bytes_done : int;
+  mutable throttled : int;
+}
+
+type 'j t = {
+  clock : unit -> float;
+  op_cost : int;
+  mutable vtime : float;
+  mutable tenants : 'j tenant list;    (* In order of creation, for tie-breaking *)
+  mutable pending : int;
+}
+
+let create ?(clock=Unix.gettimeofday) ?(op_cost=4096) () =
+  if op_cost < 0 then Fmt.invalid_arg "Sched.create: negative op_cost %d" op_cost;
+  { clock; op_cost; vtime = 0.0; tenants = []; pending = 0 }
+
+let bucket ~now ~burst rate =
+  if rate <= 0.0 then Fmt.invalid_arg "Sched.tenant: rate %f must be positive" rate;
+  let burst = Option.value burst ~default:rate in
+  { rate; burst; tokens = burst; last = now }
+
+let tenant ?(weight=1) ?bytes_per_sec ?bytes_burst ?ops_per_sec ?ops_burst t name =
+  if weight < 1 then Fmt.invalid_arg "Sched.tenant: weight %d must be positive" weight;
+  let now = t.clock () in
+  let burst = Option.map float_of_int in
+  let bytes_limit = Option.map (bucket ~now ~burst:(burst bytes_burst)) bytes_per_sec in
+  let ops_limit = Option.map (bucket ~now ~burst:(burst ops_burst)) ops_per_sec in
+  let tenant = {
+    name; weight = float weight; requests = Queue.create ();
+    bytes_limit; ops_limit;
+    last_finish = 0.0; ops_done = 0; bytes_done = 0; throttled = 0;
+  } in
+  t.tenants <- t.tenants @ [tenant];
+  tenant
+
+let name tenant = tenant.name
+
+let enqueue t tenant ~bytes submit =
+  if bytes < 0 then Fmt.invalid_arg "Sched.enqueue: negative bytes %d" bytes;
+  let start = Float.max t.vtime tenant.last_finish in
+  let finish = start +. float (bytes + t.op_cost) /. tenant.weight in
+  tenant.last_finish <- finish;
+  Queue.push { submit; size = bytes; finish; throttled = false } tenant.requests;
+  t.pending <- t.pending + 1
+
+let refill ~now b =
+  b.tokens <- Float.min b.burst (b.tokens +. b.rate *. (now -. b.last));
+  b.last <- now
+
+(* A request costing more than [burst] only needs a full bucket, leaving it in debt afterwards. *)
+let needed b cost = Float.min cost b.burst
+
+let has_tokens ~now ~cost = function
+  | None -> true
+  | Some b -> refill ~now b; b.tokens >= needed b cost
+
+let charge cost = function
+  | None -> ()
+  | Some b -> b.tokens <- b.tokens -. cost
+
+(* The unthrottled tenant whose next request has the lowest finish tag. *)
+let pick t ~now =
+  List.fold_left (fun best tenant ->
+      match Queue.peek_opt tenant.requests with
+      | None -> best
+      | Some r ->
+        if not (has_tokens ~now ~cost:(float r.size) tenant.bytes_limit &&
+                has_tokens ~now ~cost:1.0 tenant.ops_limit) then (
+          if not r.throttled then (
+            r.throttled <- true;
+            tenant.throttled <- tenant.throttled + 1
+          );
+          best
+        ) else match best with
+          | Some (_, best_r) when best_r.finish <= r.finish -> best
+          | _ -> Some (tenant, r)
+    ) None t.tenants
+
+let dispatch t =
+  let now = t.clock () in
+  let rec aux n =
+    match pick t ~now with
+    | None -> n
+    | Some (tenant, r) ->
+      match r.submit () with
+      | None -> n       (* The ring is full; leave it at the head of its queue *)
+      | Some _ ->
+        ignore (Queue.pop tenant.requests : _ request);
+        t.pending <- t.pending - 1;
+        t.vtime <- r.finish;
+        charge (float r.size) tenant.bytes_limit;
+        charge 1.0 tenant.ops_limit;
+        tenant.ops_done <- tenant.ops_done + 1;
+        tenant.bytes_done <- tenant.bytes_done + r.size;
+        aux (n + 1)
+  in
+  aux 0
+
+let pending t = t.pending
+
+let ready_in ~now ~cost = function
+  | Some b when b.tokens < needed b cost -> (b.last -. now) +. (needed b cost -. b.tokens) /. b.rate
+  | _ -> 0.0
+
+let next_ready t =
+  let now = t.clock () in
+  List.fold_left (fun acc tenant ->
+      match Queue.peek_opt tenant.requests with
+      | None -> acc
+      | Some r ->
+        let delay = Float.max
+            (ready_in ~now ~cost:(float r.size) tenant.bytes_limit)
+            (ready_in ~now ~cost:1.0 tenant.ops_limit)
+        in
+        match acc with
+        | Some d when d <= delay -> acc
+        | _ -> Some (Float.max 0.0 delay)
+    ) None t.tenants
+
+let stats tenant =
+  { ops = tenant.ops_done; bytes = tenant.bytes_done; queued = Queue.length tenant.requests; throttled = tenant.throttled }
+
+let pp_stats f { ops; bytes; queued; throttled } =
+  Fmt.pf f "ops=%d bytes=%d queued=%d throttled=%d" ops bytes queued throttled
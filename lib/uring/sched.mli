@@ -0,0 +1,72 @@
+(** [Sched] shares a ring between several tenants using weighted fair queueing.
+
+    Instead of submitting operations directly, each tenant adds them to its own queue
+    with {!enqueue}. {!dispatch} then moves them into the ring's submission queue,
+    choosing between tenants in proportion to their weights. A request's cost is its
+    size in bytes plus a fixed per-operation cost, so that a tenant doing many small
+    operations is not favoured over one doing a few large ones.
+
+    Each tenant can also be limited by token buckets, on bytes per second and on
+    operations per second.
+
+    An operation is queued by giving a function that submits it, such as
+    [fun () -> Uring.writev t fd bufs d ~file_offset]. If this returns [None]
+    (because the ring is full) then dispatching stops and the request is retried on
+    the next call to {!dispatch}, normally after {!Uring.submit} and reaping some completions. *)
+
+type 'j t
+(** A scheduler for submitting operations that return ['j option]. *)
+
+type 'j tenant
+(** A source of requests with its own queue. *)
+
+val create : ?clock:(unit -> float) -> ?op_cost:int -> unit -> 'j t
+(** [create ()] is a scheduler with no tenants.
+    @param clock Used for the token buckets (default: [Unix.gettimeofday]).
+    @param op_cost Charged for each request in addition to its size in bytes (default: 4096). *)
+
+val tenant :
+  ?weight:int ->
+  ?bytes_per_sec:float -> ?bytes_burst:int ->
+  ?ops_per_sec:float -> ?ops_burst:int ->
+  'j t -> string -> 'j tenant
+(** [tenant t name] adds a new tenant to [t].
+    When several tenants have requests waiting, each gets a share of the submissions
+    in proportion to its [weight] (default 1).
+    @param bytes_per_sec Limit this tenant's throughput.
+    @param bytes_burst How many bytes can be submitted at once after the tenant has been idle
+                       (default: [bytes_per_sec]).
+    @param ops_per_sec Limit the number of operations per second.
+    @param ops_burst As [bytes_burst], but for [ops_per_sec]. *)
+
+val name : _ tenant -> string
+
+val enqueue : 'j t -> 'j tenant -> bytes:int -> (unit -> 'j option) -> unit
+(** [enqueue t tenant ~bytes submit] adds a request to [tenant]'s queue.
+    [submit ()] will be called by {!dispatch} when the request is chosen.
+    @param bytes The size of the request, for accounting. Use 0 for operations that don't transfer data. *)
+
+val dispatch : _ t -> int
+(** [dispatch t] submits queued requests until there are none left that are
+    allowed to run now, or until a request's [submit] function returns [None].
+    It returns the number of requests submitted. You still need to call {!Uring.submit}. *)
+
+val pending : _ t -> int
+(** [pending t] is the number of requests queued (but not yet dispatched) across all tenants. *)
+
+val next_ready : _ t -> float option
+(** [next_ready t] is the number of seconds until some tenant that currently
+    has requests queued will be allowed to run by its token buckets
+    (0.0 if one can run now), or [None] if nothing is queued.
+    This is useful as a timeout for {!Uring.wait}. *)
+
+type stats = {
+  ops : int;                    (** Requests dispatched *)
+  bytes : int;                  (** Bytes dispatched *)
+  queued : int;                 (** Requests still waiting *)
+  throttled : int;              (** Number of requests that had to wait for the tenant's rate limits *)
+}
+
+val stats : _ tenant -> stats
+
+val pp_stats : stats Fmt.t
@@ -19,6 +19,9 @@ module Private = struct
 end
 
 module Region = Region
+module Sched = Sched
+module Histogram = Histogram
+module Lanes = Lanes
 module Int63 = Optint.Int63
 
 module type FLAGS = sig
@@ -86,6 +89,37 @@ module Poll_mask = struct
   let pollhup = Config.pollhup
 end
 
+module Sqe_flags = struct
+  include Flags
+
+  let io_drain    = 0x02
+  let io_link     = 0x04
+  let io_hardlink = 0x08
+  let async       = 0x10
+end
+
+module Rw_flags = struct
+  include Flags
+
+  let hipri  = 0x01
+  let dsync  = 0x02
+  let sync   = 0x04
+  let nowait = 0x08
+  let append = 0x10
+end
+
+module Ioprio = struct
+  type t = int
+
+  let none = 0
+
+  (* See IOPRIO_PRIO_VALUE in linux/ioprio.h *)
+  let make cls level =
+    if level < 0 || level > 7 then Fmt.invalid_arg "Ioprio.make: level %d not in range 0-7" level;
+    let cls = match cls with `Rt -> 1 | `Be -> 2 | `Idle -> 3 in
+    (cls lsl 13) lor level
+end
+
 module Sockaddr = struct
   type t
 
@@ -105,6 +139,34 @@ module Open_how = struct
   let v ~open_flags ~perm ~resolve path = make open_flags perm resolve path
 end
 
+module Epoll = struct
+  type op = Add | Modify | Delete
+
+  module Events = struct
+    include Flags
+
+    let epollin = Config.pollin
+    let epollout = Config.pollout
+    let epollerr = Config.pollerr
+    let epollhup = Config.pollhup
+    let epollrdhup = 0x2000
+    let epolloneshot = 1 lsl 30
+    let epollet = 1 lsl 31
+  end
+
+  type event
+
+  external make_event : Events.t -> Unix.file_descr -> event = "ocaml_uring_make_epoll_event"
+  external create : unit -> Unix.file_descr = "ocaml_uring_epoll_create"
+  external ready : Unix.file_descr -> Unix.file_descr array -> int = "ocaml_uring_epoll_ready"
+end
+
+module Timespec = struct
+  type t
+
+  external make : float -> t = "ocaml_uring_make_timespec"
+end
+
 module Iovec = struct
   (* The C stubs rely on the layout of Cstruct.t, so we just check here that it hasn't changed. *)
   module Check : sig
@@ -136,9 +198,15 @@ module Msghdr = struct
   type t = msghdr * Sockaddr.t option * Iovec.t
   external make_msghdr : int -> Unix.file_descr list -> Sockaddr.t option -> Iovec.t-> msghdr = "ocaml_uring_make_msghdr"
   external get_msghdr_fds : msghdr -> Unix.file_descr list = "ocaml_uring_get_msghdr_fds"
+  external get_msghdr_fds_array : msghdr -> Unix.file_descr array = "ocaml_uring_get_msghdr_fds_array"
+  external set_msghdr_fds : msghdr -> Unix.file_descr array -> unit = "ocaml_uring_set_msghdr_fds"
 
   let get_fds (hdr, _, _) = get_msghdr_fds hdr
 
+  let get_fds_array (hdr, _, _) = get_msghdr_fds_array hdr
+
+  let set_fds (hdr, _, _) fds = set_msghdr_fds hdr fds
+
   (* Create a value with space for [n_fds] file descriptors.
      When sending, [fds] is used to fill those slots. When receiving, they can be left blank. *)
   let create_with_addr ~n_fds ~fds ?addr buffs =
@@ -151,14 +219,43 @@ end
 
 type 'a job = 'a Heap.entry
 
+module Shared_chunk = struct
+  type t = {
+    chunk : Region.chunk;
+    mutable refs : int;
+  }
+
+  let chunk t = t.chunk
+
+  let to_cstruct ?len t = Region.to_cstruct ?len t.chunk
+
+  let retain t =
+    if t.refs <= 0 then invalid_arg "Shared_chunk.retain: chunk already released";
+    t.refs <- t.refs + 1
+
+  let release t =
+    if t.refs <= 0 then invalid_arg "Shared_chunk.release: chunk already released";
+    t.refs <- t.refs - 1;
+    if t.refs = 0 then Region.free t.chunk
+end
+
+(* Identifies a read for {!read_shared}. *)
+type read_key = {
+  key_fd : Unix.file_descr;
+  key_offset : Optint.Int63.t;
+  key_len : int;
+}
+
 module Uring = struct
   type t
 
   external create : int -> int option -> t = "ocaml_uring_setup"
+  external create_threads : int -> int -> t = "ocaml_uring_setup_threads"
   external exit : t -> unit = "ocaml_uring_exit"
 
   external unregister_buffers : t -> unit = "ocaml_uring_unregister_buffers"
   external register_bigarray : t ->  Cstruct.buffer -> unit = "ocaml_uring_register_ba"
+  external bigarray_dontfork : Cstruct.buffer -> bool -> unit = "ocaml_uring_ba_dontfork"
   external submit : t -> int = "ocaml_uring_submit"
 
   type id = Heap.ptr
@@ -166,22 +263,46 @@ module Uring = struct
   type offset = Optint.Int63.t
   external submit_nop : t -> id -> bool = "ocaml_uring_submit_nop" [@@noalloc]
   external submit_poll_add : t -> Unix.file_descr -> id -> Poll_mask.t -> bool = "ocaml_uring_submit_poll_add" [@@noalloc]
+  external submit_poll_multishot : t -> Unix.file_descr -> id -> Poll_mask.t -> bool = "ocaml_uring_submit_poll_multishot" [@@noalloc]
   external submit_readv : t -> Unix.file_descr -> id -> Iovec.t -> offset -> bool = "ocaml_uring_submit_readv" [@@noalloc]
   external submit_writev : t -> Unix.file_descr -> id -> Iovec.t -> offset -> bool = "ocaml_uring_submit_writev" [@@noalloc]
   external submit_readv_fixed : t -> Unix.file_descr -> id -> Cstruct.buffer -> int -> int -> offset -> bool = "ocaml_uring_submit_readv_fixed_byte" "ocaml_uring_submit_readv_fixed_native" [@@noalloc]
   external submit_writev_fixed : t -> Unix.file_descr -> id -> Cstruct.buffer -> int -> int -> offset -> bool = "ocaml_uring_submit_writev_fixed_byte" "ocaml_uring_submit_writev_fixed_native" [@@noalloc]
   external submit_close : t -> Unix.file_descr -> id -> bool = "ocaml_uring_submit_close" [@@noalloc]
+
+  type sqe_template
+  external make_rw_template : bool -> Unix.file_descr -> Cstruct.buffer -> int -> int -> Sqe_flags.t -> Rw_flags.t -> Ioprio.t -> sqe_template = "ocaml_uring_make_rw_template_byte" "ocaml_uring_make_rw_template_native"
+  external submit_template : t -> id -> sqe_template -> offset -> bool = "ocaml_uring_submit_template" [@@noalloc]
+
   external submit_splice : t -> id -> Unix.file_descr -> Unix.file_descr -> int -> bool = "ocaml_uring_submit_splice" [@@noalloc]
   external submit_connect : t -> id -> Unix.file_descr -> Sockaddr.t -> bool = "ocaml_uring_submit_connect" [@@noalloc]
   external submit_accept : t -> id -> Unix.file_descr -> Sockaddr.t -> bool = "ocaml_uring_submit_accept" [@@noalloc]
   external submit_cancel : t -> id -> id -> bool = "ocaml_uring_submit_cancel" [@@noalloc]
+  external set_sqe_flags : t -> Sqe_flags.t -> unit = "ocaml_uring_set_sqe_flags" [@@noalloc]
+  external set_rw_flags : t -> Rw_flags.t -> unit = "ocaml_uring_set_rw_flags" [@@noalloc]
+  external set_ioprio : t -> Ioprio.t -> unit = "ocaml_uring_set_ioprio" [@@noalloc]
+  external submit_fsync : t -> id -> Unix.file_descr -> bool -> bool = "ocaml_uring_submit_fsync" [@@noalloc]
+  external sq_space_left : t -> int = "ocaml_uring_sq_space_left" [@@noalloc]
+  external sq_ready : t -> int = "ocaml_uring_sq_ready" [@@noalloc]
+  external cq_overflow : t -> bool = "ocaml_uring_cq_overflow" [@@noalloc]
+  external cq_dropped : t -> int = "ocaml_uring_cq_dropped" [@@noalloc]
+  external cq_space_left : t -> int = "ocaml_uring_cq_space_left" [@@noalloc]
+  external flush_cq : t -> int = "ocaml_uring_flush_cq" [@@noalloc]
+  external cq_ready : t -> int = "ocaml_uring_cq_ready" [@@noalloc]
+  external poll_rings : t array -> int -> unit = "ocaml_uring_poll_rings"
+  external submit_shutdown : t -> id -> Unix.file_descr -> Unix.shutdown_command -> bool = "ocaml_uring_submit_shutdown" [@@noalloc]
+  external submit_timeout : t -> id -> Timespec.t -> bool = "ocaml_uring_submit_timeout" [@@noalloc]
+  external submit_teardown : t -> id -> Unix.file_descr -> Cstruct.t option -> Timespec.t option -> bool = "ocaml_uring_submit_teardown" [@@noalloc]
   external submit_openat2 : t -> id -> Unix.file_descr -> Open_how.t -> bool = "ocaml_uring_submit_openat2" [@@noalloc]
+  external submit_epoll_ctl : t -> id -> Unix.file_descr -> Unix.file_descr -> Epoll.op -> Epoll.event -> bool = "ocaml_uring_submit_epoll_ctl_byte" "ocaml_uring_submit_epoll_ctl_native" [@@noalloc]
   external submit_send_msg : t -> id -> Unix.file_descr -> Msghdr.t -> bool = "ocaml_uring_submit_send_msg" [@@noalloc]
   external submit_recv_msg : t -> id -> Unix.file_descr -> Msghdr.t -> bool = "ocaml_uring_submit_recv_msg" [@@noalloc]
+  external preadv_nowait : Unix.file_descr -> Iovec.t -> offset -> Rw_flags.t -> int = "ocaml_uring_preadv_nowait" [@@noalloc]
+  external recvmsg_nowait : Unix.file_descr -> Msghdr.t -> int = "ocaml_uring_recvmsg_nowait" [@@noalloc]
 
   type cqe_option = private
     | Cqe_none
-    | Cqe_some of { user_data_id : id; res: int }
+    | Cqe_some of { user_data_id : id; res: int; more: bool }
   [@@ocaml.warning "-37" (* Avoids "Unused constructor" warning on OCaml <= 4.09. *)]
 
   external wait_cqe : t -> cqe_option = "ocaml_uring_wait_cqe"
@@ -191,23 +312,70 @@ module Uring = struct
   external error_of_errno : int -> Unix.error = "ocaml_uring_error_of_errno"
 end
 
+type backend = Io_uring | Threads of int
+
 type 'a t = {
   id : < >;
   uring: Uring.t;
+  backend : backend;
   mutable fixed_iobuf: Cstruct.buffer;
+  mutable fixed_dontfork: bool; (* [fixed_iobuf] is excluded from child processes *)
+  mutable pool_iobuf: Cstruct.buffer; (* The fixed buffer [Ring_pool] gave this ring, restored on release *)
   data : 'a Heap.t;
   queue_depth: int;
+  ioprio: Ioprio.t; (* The default priority for reads and writes *)
   mutable dirty: bool; (* has outstanding requests that need to be submitted *)
+  job_fds: Unix.file_descr array; (* The FD each active job is using, or [no_fd] *)
+  barriers: 'a barrier list array; (* The barriers waiting for each active job *)
+  ready: ('a * int) Queue.t;  (* Completions generated by the library, to be returned first *)
+  job_bytes: int array; (* The size of each active read or write, or -1 for other jobs *)
+  mutable bytes_in_flight: int; (* The sum of [job_bytes] *)
+  mutable io_in_flight: int; (* The number of active reads and writes *)
+  mutable limits: limits;
+  mutable backpressure: bool; (* Over the soft limit, or a job was refused; call [on_capacity] when clear *)
+  followers: 'a list array; (* Extra completions, in reverse order, to be returned with each job's result *)
+  shared_reads: (read_key, Heap.ptr * Shared_chunk.t) Hashtbl.t; (* Reads started by [read_shared] *)
+  job_read_keys: read_key option array; (* The [shared_reads] entry of each active job *)
+  job_hooks: (int -> int) array; (* Called with the result when each job completes; returns the result to report *)
+  mutable try_inline: int; (* Operations completed by [try_*] without using the ring *)
+  mutable try_fallback: int; (* Operations where [try_*] had to use the ring *)
+  no_nowait: (Unix.file_descr, unit) Hashtbl.t; (* FDs whose filesystem rejects [RWF_NOWAIT] *)
+  mutable auto_flush: auto_flush option;
+  mutable first_pending: float; (* When [dirty] last became [true], if [auto_flush] has a delay *)
+  mutable linking: bool; (* The last SQE queued is linked to the next one *)
+  mutable deferred_cancels: Heap.ptr list; (* Quiet cancels that didn't fit in the SQ, to queue on the next submit *)
+  mutable cq_overflows: int; (* Reaps that found the kernel holding overflowed completions *)
+  mutable cq_lost: int; (* Completions the kernel discarded, as of the last reap *)
+}
+and auto_flush = {
+  max_pending : int;
+  fill : int;           (* [max_pending], but derived from the fill fraction *)
+  delay : float;
+}
+and limits = {
+  soft_bytes : int;
+  hard_bytes : int;
+  max_io : int;
+  cq_headroom : int;
+  on_capacity : unit -> unit;
+}
+(* A [barrier] is returned as a completion once all the jobs it is waiting for have finished. *)
+and 'a barrier = {
+  mutable remaining : int;
+  barrier_data : 'a;
+  barrier_result : int;
 }
 
 module Generic_ring = struct
-  type ring = T : 'a t -> ring
+  type ring = Ring : 'a t -> ring
   type t = ring
-  let compare (T a) (T b) = compare a.id b.id
+  let compare (Ring a) (Ring b) = compare a.id b.id
 end
 
 module Ring_set = Set.Make(Generic_ring)
 
+type ring = Generic_ring.ring = Ring : 'a t -> ring
+
 (* Garbage collection and buffers shared with the Linux kernel.
 
    Many uring operations involve passing Linux the address of a buffer to which it
@@ -230,153 +398,1285 @@ let rec update_gc_roots fn =
     update_gc_roots fn
 
 let register_gc_root t =
-  update_gc_roots (Ring_set.add (Generic_ring.T t))
+  update_gc_roots (Ring_set.add (Generic_ring.Ring t))
 
 let unregister_gc_root t =
-  update_gc_roots (Ring_set.remove (Generic_ring.T t))
+  update_gc_roots (Ring_set.remove (Generic_ring.Ring t))
+
+let no_fd : Unix.file_descr = Obj.magic (-1)
+
+type try_stats = {
+  inline : int;
+  fallback : int;
+}
+
+let no_hook : int -> int = Fun.id
+
+(* A hook can return this to say that the job's completion should not be reported. *)
+let dropped = min_int
+
+let no_limits = { soft_bytes = max_int; hard_bytes = max_int; max_io = max_int; cq_headroom = 0; on_capacity = ignore }
+
+let default_threads = 8
+
+(* Use io_uring if we can, or threads if the kernel doesn't support it or won't let us use it. *)
+let setup ?polling_timeout ?backend queue_depth =
+  match backend with
+  | Some Io_uring -> Uring.create queue_depth polling_timeout, Io_uring
+  | Some (Threads n) ->
+    if n < 1 then Fmt.invalid_arg "Non-positive thread count: %d" n;
+    Uring.create_threads queue_depth n, Threads n
+  | None ->
+    match Uring.create queue_depth polling_timeout with
+    | uring -> uring, Io_uring
+    | exception Unix.Unix_error ((Unix.ENOSYS | Unix.EPERM | Unix.EACCES), "io_uring_queue_init", _) ->
+      Uring.create_threads queue_depth default_threads, Threads default_threads
 
-let create ?polling_timeout ~queue_depth () =
+let create ?polling_timeout ?(ioprio=Ioprio.none) ?backend ~queue_depth () =
   if queue_depth < 1 then Fmt.invalid_arg "Non-positive queue depth: %d" queue_depth;
-  let uring = Uring.create queue_depth polling_timeout in
+  let uring, backend = setup ?polling_timeout ?backend queue_depth in
   let data = Heap.create queue_depth in
   let id = object end in
   let fixed_iobuf = Cstruct.empty.buffer in
-  let t = { id; uring; fixed_iobuf; data; dirty=false; queue_depth } in
+  let job_fds = Array.make queue_depth no_fd in
+  let barriers = Array.make queue_depth [] in
+  let ready = Queue.create () in
+  let job_bytes = Array.make queue_depth (-1) in
+  let t = { id; uring; backend; fixed_iobuf; fixed_dontfork = false; pool_iobuf = fixed_iobuf; data; dirty=false; queue_depth; ioprio; job_fds; barriers; ready;
+            job_bytes; bytes_in_flight = 0; io_in_flight = 0; limits = no_limits; backpressure = false;
+            followers = Array.make queue_depth [];
+            shared_reads = Hashtbl.create 16;
+            job_read_keys = Array.make queue_depth None;
+            job_hooks = Array.make queue_depth no_hook;
+            try_inline = 0; try_fallback = 0; no_nowait = Hashtbl.create 4;
+            auto_flush = None; first_pending = 0.0; linking = false; deferred_cancels = [];
+            cq_overflows = 0; cq_lost = 0;
+          } in
   register_gc_root t;
   t
 
-let ensure_idle t op =
-  match Heap.in_use t.data with
-  | 0 -> ()
+(* [lost] jobs are known to be finished even though they are still in [t.data]. *)
+let ensure_idle ?(lost=0) t op =
+  match Heap.in_use t.data - lost with
+  | n when n <= 0 -> ()
   | n -> Fmt.invalid_arg "%s: %d request(s) still active!" op n
 
-let set_fixed_buffer t iobuf =
-  ensure_idle t "set_fixed_buffer";
-  if Bigarray.Array1.dim t.fixed_iobuf > 0 then
+(* The old buffer may still be used by the application, so make it inheritable again. *)
+let release_fixed_buffer t =
+  if Bigarray.Array1.dim t.fixed_iobuf > 0 then (
     Uring.unregister_buffers t.uring;
+    if t.fixed_dontfork then Uring.bigarray_dontfork t.fixed_iobuf false
+  );
+  t.fixed_iobuf <- Cstruct.empty.buffer;
+  t.fixed_dontfork <- false
+
+let set_fixed_buffer ?(dontfork=false) t iobuf =
+  ensure_idle t "set_fixed_buffer";
+  release_fixed_buffer t;
   t.fixed_iobuf <- iobuf;
   if Bigarray.Array1.dim iobuf > 0 then (
     match Uring.register_bigarray t.uring iobuf with
-    | () -> Ok ()
+    | () ->
+      if dontfork then (
+        Uring.bigarray_dontfork iobuf true;
+        t.fixed_dontfork <- true
+      );
+      Ok ()
     | exception Unix.Unix_error(Unix.ENOMEM, "io_uring_register_buffers", "") -> Error `ENOMEM
   ) else Ok ()
 
-let exit t =
-  ensure_idle t "exit";
-  Uring.exit t.uring;
-  unregister_gc_root t
+let set_limits ?(soft_bytes=max_int) ?(hard_bytes=max_int) ?(max_io=max_int) ?(cq_headroom=0) ?(on_capacity=ignore) t =
+  if soft_bytes < 0 || hard_bytes < 0 || max_io < 1 || cq_headroom < 0 then invalid_arg "set_limits: limits must be positive";
+  t.limits <- { soft_bytes; hard_bytes; max_io; cq_headroom; on_capacity }
+
+let bytes_in_flight t = t.bytes_in_flight
 
-let with_id_full : type a. a t -> (Heap.ptr -> bool) -> a -> extra_data:'b -> a job option =
- fun t fn datum ~extra_data ->
+let backpressure t = t.backpressure
+
+(* A read or write of [bytes] may start if it fits within the hard limits,
+   or if nothing else is in flight (so that large requests can always make progress). *)
+let has_capacity t bytes =
+  let ok =
+    t.io_in_flight = 0 ||
+    (t.io_in_flight < t.limits.max_io && t.bytes_in_flight + bytes <= t.limits.hard_bytes)
+  in
+  if not ok then t.backpressure <- true;
+  ok
+
+(* Don't queue more work while the kernel has nowhere to put the results. *)
+let cq_has_room t =
+  t.limits.cq_headroom = 0 ||
+  (not (Uring.cq_overflow t.uring) && Uring.cq_space_left t.uring >= t.limits.cq_headroom)
+
+let add_in_flight t i bytes =
+  t.job_bytes.(i) <- bytes;
+  t.bytes_in_flight <- t.bytes_in_flight + bytes;
+  t.io_in_flight <- t.io_in_flight + 1;
+  if t.bytes_in_flight >= t.limits.soft_bytes then t.backpressure <- true
+
+let remove_in_flight t i =
+  let bytes = t.job_bytes.(i) in
+  if bytes >= 0 then (
+    t.job_bytes.(i) <- -1;
+    t.bytes_in_flight <- t.bytes_in_flight - bytes;
+    t.io_in_flight <- t.io_in_flight - 1;
+    if t.backpressure && t.bytes_in_flight < t.limits.soft_bytes then (
+      t.backpressure <- false;
+      t.limits.on_capacity ()
+    )
+  )
+
+(* Matches IGNORED_USER_DATA in the C stubs. The kernel's response to these is not reported. *)
+let ignored_id : Uring.id = Obj.magic (-1)
+
+(* Queue as many of [t.deferred_cancels] as will fit, unless that would add them to a chain. *)
+let flush_cancels t =
+  let rec aux = function
+    | ptr :: rest when Uring.submit_cancel t.uring ignored_id ptr -> t.dirty <- true; aux rest
+    | rest -> rest
+  in
+  if t.deferred_cancels <> [] && not t.linking then
+    t.deferred_cancels <- aux t.deferred_cancels
+
+let rec submit t =
+  flush_cancels t;
+  if t.dirty then begin
+    t.dirty <- false;
+    t.linking <- false;
+    let n = Uring.submit t.uring in
+    (* Submitting made room for any cancels that didn't fit. *)
+    if n > 0 && t.deferred_cancels <> [] then n + submit t else n
+  end else
+    0
+
+let set_auto_flush ?(max_pending=max_int) ?(fill=1.0) ?(delay=infinity) t =
+  if max_pending < 1 then Fmt.invalid_arg "set_auto_flush: max_pending %d must be positive" max_pending;
+  if fill <= 0.0 || fill > 1.0 then Fmt.invalid_arg "set_auto_flush: fill %f not in range (0, 1]" fill;
+  if delay < 0.0 then Fmt.invalid_arg "set_auto_flush: negative delay %f" delay;
+  let fill = max 1 (int_of_float (Float.ceil (fill *. float t.queue_depth))) in
+  t.first_pending <- Unix.gettimeofday ();
+  t.auto_flush <- Some { max_pending; fill; delay }
+
+let clear_auto_flush t = t.auto_flush <- None
+
+(* Submit if the auto-flush policy says to. We never split a chain of linked requests. *)
+let maybe_flush t =
+  match t.auto_flush with
+  | Some p when t.dirty && not t.linking ->
+    let pending = Uring.sq_ready t.uring in
+    if pending >= p.max_pending || pending >= p.fill ||
+       (p.delay < infinity && Unix.gettimeofday () -. t.first_pending >= p.delay) then
+      ignore (submit t : int)
+  | _ -> ()
+
+(* [fd] is the FD the job operates on, used by {!cancel_fd}.
+   [bytes] is the size of a read or write, which is subject to the limits in [t.limits]. *)
+let with_id_full : type a. ?bytes:int -> a t -> (Heap.ptr -> bool) -> a -> extra_data:'b -> fd:Unix.file_descr -> a job option =
+ fun ?bytes t fn datum ~extra_data ~fd ->
+  match bytes with
+  | Some bytes when not (has_capacity t bytes) -> None
+  | _ when not (cq_has_room t) -> None
+  | _ ->
   match Heap.alloc t.data datum ~extra_data with
   | exception Heap.No_space -> None
   | entry ->
     let ptr = Heap.ptr entry in
+    (* [with_flags] sets this again if the new SQE is linked to the next one. *)
+    let linking = t.linking in
+    t.linking <- false;
     let has_space = fn ptr in
     if has_space then (
-      t.dirty <- true;
+      if not t.dirty then (
+        t.dirty <- true;
+        match t.auto_flush with
+        | Some { delay; _ } when delay < infinity -> t.first_pending <- Unix.gettimeofday ()
+        | _ -> ()
+      );
+      t.job_fds.((ptr :> int)) <- fd;
+      Option.iter (add_in_flight t (ptr :> int)) bytes;
+      maybe_flush t;
       Some entry
     ) else (
+      t.linking <- linking;
       ignore (Heap.free t.data ptr : a);
       None
     )
 
-let with_id t fn a = with_id_full t fn a ~extra_data:()
+let with_id ?bytes t fn a ~fd = with_id_full ?bytes t fn a ~extra_data:() ~fd
 
-let noop t user_data =
-  with_id t (fun id -> Uring.submit_nop t.uring id) user_data
+(* Apply optional flags to the SQE just queued by a [submit_*] call, if it succeeded.
+   The kernel doesn't see the SQE until the next submit, so it's safe to modify it here. *)
+let with_flags t ~sqe_flags queued =
+  if queued then (
+    if sqe_flags <> Sqe_flags.empty then Uring.set_sqe_flags t.uring sqe_flags;
+    t.linking <- sqe_flags land (Sqe_flags.io_link lor Sqe_flags.io_hardlink) <> 0
+  );
+  queued
+
+let with_rw_flags t ~sqe_flags ~rw_flags ~ioprio queued =
+  if queued then (
+    if rw_flags <> Rw_flags.empty then Uring.set_rw_flags t.uring rw_flags;
+    let ioprio = Option.value ioprio ~default:t.ioprio in
+    if ioprio <> Ioprio.none then Uring.set_ioprio t.uring ioprio
+  );
+  with_flags t ~sqe_flags queued
+
+let noop ?(sqe_flags=Sqe_flags.empty) t user_data =
+  with_id t (fun id -> with_flags t ~sqe_flags @@ Uring.submit_nop t.uring id) user_data ~fd:no_fd
 
 let at_fdcwd : Unix.file_descr = Obj.magic Config.at_fdcwd
 
-let openat2 t ~access ~flags ~perm ~resolve ?(fd=at_fdcwd) path user_data =
+let openat2 ?(sqe_flags=Sqe_flags.empty) t ~access ~flags ~perm ~resolve ?(fd=at_fdcwd) path user_data =
   let open_flags = flags lor match access with
     | `R  -> Open_flags.rdonly
     | `W  -> Open_flags.wronly
     | `RW -> Open_flags.rdwr
   in
   let open_how = Open_how.v ~open_flags ~perm ~resolve path in
-  with_id_full t (fun id -> Uring.submit_openat2 t.uring id fd open_how) user_data ~extra_data:open_how
+  with_id_full t (fun id -> with_flags t ~sqe_flags @@ Uring.submit_openat2 t.uring id fd open_how) user_data ~extra_data:open_how ~fd:no_fd
 
-let readv t ~file_offset fd buffers user_data =
-  let iovec = Iovec.make buffers in
-  with_id_full t (fun id -> Uring.submit_readv t.uring fd id iovec file_offset) user_data ~extra_data:iovec
+let readv_iovec ~sqe_flags ~rw_flags ~ioprio t ~file_offset fd iovec ~len user_data =
+  with_id_full ~bytes:len t (fun id -> with_rw_flags t ~sqe_flags ~rw_flags ~ioprio @@ Uring.submit_readv t.uring fd id iovec file_offset) user_data ~extra_data:iovec ~fd
+
+let readv ?(sqe_flags=Sqe_flags.empty) ?(rw_flags=Rw_flags.empty) ?ioprio t ~file_offset fd buffers user_data =
+  readv_iovec ~sqe_flags ~rw_flags ~ioprio t ~file_offset fd (Iovec.make buffers) ~len:(Cstruct.lenv buffers) user_data
 
-let read_fixed t ~file_offset fd ~off ~len user_data =
-  with_id t (fun id -> Uring.submit_readv_fixed t.uring fd id t.fixed_iobuf off len file_offset) user_data
+let read_fixed ?(sqe_flags=Sqe_flags.empty) ?(rw_flags=Rw_flags.empty) ?ioprio t ~file_offset fd ~off ~len user_data =
+  with_id ~bytes:len t (fun id -> with_rw_flags t ~sqe_flags ~rw_flags ~ioprio @@ Uring.submit_readv_fixed t.uring fd id t.fixed_iobuf off len file_offset) user_data ~fd
 
-let read_chunk ?len t ~file_offset fd chunk user_data =
+let read_chunk ?(sqe_flags=Sqe_flags.empty) ?(rw_flags=Rw_flags.empty) ?ioprio ?len t ~file_offset fd chunk user_data =
   let { Cstruct.buffer; off; len } = Region.to_cstruct ?len chunk in
   if buffer != t.fixed_iobuf then invalid_arg "Chunk does not belong to ring!";
-  with_id t (fun id -> Uring.submit_readv_fixed t.uring fd id t.fixed_iobuf off len file_offset) user_data
+  with_id ~bytes:len t (fun id -> with_rw_flags t ~sqe_flags ~rw_flags ~ioprio @@ Uring.submit_readv_fixed t.uring fd id t.fixed_iobuf off len file_offset) user_data ~fd
 
-let write_fixed t ~file_offset fd ~off ~len user_data =
-  with_id t (fun id -> Uring.submit_writev_fixed t.uring fd id t.fixed_iobuf off len file_offset) user_data
+let write_fixed ?(sqe_flags=Sqe_flags.empty) ?(rw_flags=Rw_flags.empty) ?ioprio t ~file_offset fd ~off ~len user_data =
+  with_id ~bytes:len t (fun id -> with_rw_flags t ~sqe_flags ~rw_flags ~ioprio @@ Uring.submit_writev_fixed t.uring fd id t.fixed_iobuf off len file_offset) user_data ~fd
 
-let write_chunk ?len t ~file_offset fd chunk user_data =
+let write_chunk ?(sqe_flags=Sqe_flags.empty) ?(rw_flags=Rw_flags.empty) ?ioprio ?len t ~file_offset fd chunk user_data =
   let { Cstruct.buffer; off; len } = Region.to_cstruct ?len chunk in
   if buffer != t.fixed_iobuf then invalid_arg "Chunk does not belong to ring!";
-  with_id t (fun id -> Uring.submit_writev_fixed t.uring fd id t.fixed_iobuf off len file_offset) user_data
+  with_id ~bytes:len t (fun id -> with_rw_flags t ~sqe_flags ~rw_flags ~ioprio @@ Uring.submit_writev_fixed t.uring fd id t.fixed_iobuf off len file_offset) user_data ~fd
+
+module Template = struct
+  type 'a ring = 'a t
+
+  type 'a t = {
+    ring : 'a ring;
+    sqe : Uring.sqe_template;
+    buffer : Cstruct.buffer;    (* The fixed buffer when the template was made *)
+    fd : Unix.file_descr;
+    len : int;
+    links : bool;
+  }
+
+  let make ~write ?(sqe_flags=Sqe_flags.empty) ?(rw_flags=Rw_flags.empty) ?ioprio ?len ring fd chunk =
+    let { Cstruct.buffer; off; len } = Region.to_cstruct ?len chunk in
+    if buffer != ring.fixed_iobuf then invalid_arg "Chunk does not belong to ring!";
+    let ioprio = Option.value ioprio ~default:ring.ioprio in
+    let sqe = Uring.make_rw_template write fd buffer off len sqe_flags rw_flags ioprio in
+    let links = sqe_flags land (Sqe_flags.io_link lor Sqe_flags.io_hardlink) <> 0 in
+    { ring; sqe; buffer; fd; len; links }
+
+  let read_chunk ?sqe_flags ?rw_flags ?ioprio ?len ring fd chunk =
+    make ~write:false ?sqe_flags ?rw_flags ?ioprio ?len ring fd chunk
+
+  let write_chunk ?sqe_flags ?rw_flags ?ioprio ?len ring fd chunk =
+    make ~write:true ?sqe_flags ?rw_flags ?ioprio ?len ring fd chunk
+
+  let submit tmpl ~file_offset user_data =
+    let t = tmpl.ring in
+    (* A single pointer comparison, in case the template's address is no longer registered. *)
+    if tmpl.buffer != t.fixed_iobuf then invalid_arg "Template.submit: the ring's fixed buffer has changed";
+    with_id ~bytes:tmpl.len t (fun id ->
+        let queued = Uring.submit_template t.uring id tmpl.sqe file_offset in
+        if queued then t.linking <- tmpl.links;
+        queued
+      ) user_data ~fd:tmpl.fd
+end
 
-let writev t ~file_offset fd buffers user_data =
+let writev ?(sqe_flags=Sqe_flags.empty) ?(rw_flags=Rw_flags.empty) ?ioprio t ~file_offset fd buffers user_data =
   let iovec = Iovec.make buffers in
-  with_id_full t (fun id -> Uring.submit_writev t.uring fd id iovec file_offset) user_data ~extra_data:iovec
+  with_id_full ~bytes:(Cstruct.lenv buffers) t (fun id -> with_rw_flags t ~sqe_flags ~rw_flags ~ioprio @@ Uring.submit_writev t.uring fd id iovec file_offset) user_data ~extra_data:iovec ~fd
+
+let fsync ?(sqe_flags=Sqe_flags.empty) ?(datasync=false) t fd user_data =
+  with_id t (fun id -> with_flags t ~sqe_flags @@ Uring.submit_fsync t.uring id fd datasync) user_data ~fd
+
+let poll_add ?(sqe_flags=Sqe_flags.empty) t fd poll_mask user_data =
+  with_id t (fun id -> with_flags t ~sqe_flags @@ Uring.submit_poll_add t.uring fd id poll_mask) user_data ~fd
+
+let epoll_ctl ?(sqe_flags=Sqe_flags.empty) t epfd fd op events user_data =
+  let event = Epoll.make_event events fd in
+  with_id_full t (fun id -> with_flags t ~sqe_flags @@ Uring.submit_epoll_ctl t.uring id epfd fd op event) user_data ~extra_data:event ~fd
 
-let poll_add t fd poll_mask user_data =
-  with_id t (fun id -> Uring.submit_poll_add t.uring fd id poll_mask) user_data
+let poll_multishot ?(sqe_flags=Sqe_flags.empty) t fd poll_mask user_data =
+  with_id t (fun id -> with_flags t ~sqe_flags @@ Uring.submit_poll_multishot t.uring fd id poll_mask) user_data ~fd
 
-let close t fd user_data =
-  with_id t (fun id -> Uring.submit_close t.uring fd id) user_data
+let active job = not (Heap.is_freed job)
 
-let splice t ~src ~dst ~len user_data =
-  with_id t (fun id -> Uring.submit_splice t.uring id src dst len) user_data
+let close ?(sqe_flags=Sqe_flags.empty) t fd user_data =
+  with_id t (fun id -> with_flags t ~sqe_flags @@ Uring.submit_close t.uring fd id) user_data ~fd:no_fd
 
-let connect t fd addr user_data =
+let splice ?(sqe_flags=Sqe_flags.empty) t ~src ~dst ~len user_data =
+  with_id t (fun id -> with_flags t ~sqe_flags @@ Uring.submit_splice t.uring id src dst len) user_data ~fd:src
+
+let connect ?(sqe_flags=Sqe_flags.empty) t fd addr user_data =
   let addr = Sockaddr.of_unix addr in
-  with_id_full t (fun id -> Uring.submit_connect t.uring id fd addr) user_data ~extra_data:addr
+  with_id_full t (fun id -> with_flags t ~sqe_flags @@ Uring.submit_connect t.uring id fd addr) user_data ~extra_data:addr ~fd
+
+let accept ?(sqe_flags=Sqe_flags.empty) t fd addr user_data =
+  with_id_full t (fun id -> with_flags t ~sqe_flags @@ Uring.submit_accept t.uring id fd addr) user_data ~extra_data:addr ~fd
+
+let shutdown ?(sqe_flags=Sqe_flags.empty) t fd cmd user_data =
+  with_id t (fun id -> with_flags t ~sqe_flags @@ Uring.submit_shutdown t.uring id fd cmd) user_data ~fd
+
+let teardown ?drain ?(timeout=5.0) t fd user_data =
+  let timeout = if timeout = infinity then Stdlib.None else Stdlib.Some (Timespec.make timeout) in
+  with_id_full t (fun id -> Uring.submit_teardown t.uring id fd drain timeout) user_data ~extra_data:(drain, timeout) ~fd
 
-let accept t fd addr user_data =
-  with_id_full t (fun id -> Uring.submit_accept t.uring id fd addr) user_data ~extra_data:addr
+let timeout t delay user_data =
+  let ts = Timespec.make delay in
+  with_id_full t (fun id -> Uring.submit_timeout t.uring id ts) user_data ~extra_data:ts ~fd:no_fd
 
-let send_msg ?(fds=[]) ?dst t fd buffers user_data =
+let send_msg ?(sqe_flags=Sqe_flags.empty) ?(fds=[]) ?dst t fd buffers user_data =
   let addr = Option.map Sockaddr.of_unix dst in
   let n_fds = List.length fds in
   let msghdr = Msghdr.create_with_addr ~n_fds ~fds ?addr buffers in
-  with_id_full t (fun id -> Uring.submit_send_msg t.uring id fd msghdr) user_data ~extra_data:msghdr
+  with_id_full t (fun id -> with_flags t ~sqe_flags @@ Uring.submit_send_msg t.uring id fd msghdr) user_data ~extra_data:msghdr ~fd
+
+let send_msghdr ?(sqe_flags=Sqe_flags.empty) t fd msghdr user_data =
+  with_id_full t (fun id -> with_flags t ~sqe_flags @@ Uring.submit_send_msg t.uring id fd msghdr) user_data ~extra_data:msghdr ~fd
+
+let recv_msg ?(sqe_flags=Sqe_flags.empty) t fd msghdr user_data =
+  with_id_full t (fun id -> with_flags t ~sqe_flags @@ Uring.submit_recv_msg t.uring id fd msghdr) user_data ~extra_data:msghdr ~fd
+
+let try_done t r =
+  t.try_inline <- t.try_inline + 1;
+  `Done r
+
+let try_submit t = function
+  | Some job -> t.try_fallback <- t.try_fallback + 1; `Submitted job
+  | None -> `Full
+
+let try_readv ?(sqe_flags=Sqe_flags.empty) ?(rw_flags=Rw_flags.empty) ?ioprio t ~file_offset fd buffers user_data =
+  let iovec = Iovec.make buffers in
+  let len = Cstruct.lenv buffers in
+  let submit () = try_submit t (readv_iovec ~sqe_flags ~rw_flags ~ioprio t ~file_offset fd iovec ~len user_data) in
+  if Hashtbl.mem t.no_nowait fd then submit ()
+  else (
+    let r = Uring.preadv_nowait fd iovec file_offset rw_flags in
+    (* Only EAGAIN means the ring could do better. A short read is returned as it is,
+       as [read(2)] would, and other errors would just happen again. *)
+    if r = - Config.eagain then submit ()
+    else if r = - Config.eopnotsupp then (
+      (* The filesystem doesn't support RWF_NOWAIT, so don't try again for this FD. *)
+      Hashtbl.replace t.no_nowait fd ();
+      submit ()
+    ) else try_done t r
+  )
+
+let try_recv_msg ?sqe_flags t fd msghdr user_data =
+  let r = Uring.recvmsg_nowait fd msghdr in
+  if r = - Config.eagain then try_submit t (recv_msg ?sqe_flags t fd msghdr user_data)
+  else try_done t r
+
+let try_stats t = { inline = t.try_inline; fallback = t.try_fallback }
+
+let read_shared ?(sqe_flags=Sqe_flags.empty) ?ioprio t region ~file_offset fd ~len user_data =
+  let key = { key_fd = fd; key_offset = file_offset; key_len = len } in
+  (* Reads at the current position each get different data, so they can't be shared. *)
+  let shareable = not (Int63.equal file_offset Int63.minus_one) in
+  match if shareable then Hashtbl.find_opt t.shared_reads key else Stdlib.None with
+  | Some (ptr, shared) ->
+    let i = (ptr :> int) in
+    t.followers.(i) <- user_data :: t.followers.(i);
+    Shared_chunk.retain shared;
+    Some shared
+  | None ->
+    match Region.alloc region with
+    | exception Region.No_space -> None
+    | chunk ->
+      match read_chunk ~sqe_flags ?ioprio t ~len ~file_offset fd chunk user_data with
+      | exception ex -> Region.free chunk; raise ex
+      | None -> Region.free chunk; None
+      | Some job ->
+        (* One reference for the caller, and one for the ring until the read completes. *)
+        let shared = { Shared_chunk.chunk; refs = 2 } in
+        let ptr = Heap.ptr job in
+        if shareable then (
+          Hashtbl.add t.shared_reads key (ptr, shared);
+          t.job_read_keys.((ptr :> int)) <- Some key
+        );
+        Some shared
+
+module Block_cache = struct
+  type key = {
+    file : int;
+    block : int;
+  }
+
+  type state =
+    | Loading of < > * Heap.ptr (* The [id] of the ring doing the read, and its job *)
+    | Ready of int              (* The number of valid bytes *)
+    | Failed                    (* Already removed from [table]; skip when found in a queue *)
+
+  type entry = {
+    key : key;
+    shared : Shared_chunk.t;    (* The cache holds one reference *)
+    mutable freq : int;         (* Saturates at 3 *)
+    mutable state : state;
+  }
+
+  type stats = {
+    hits : int;
+    coalesced : int;
+    misses : int;
+    evictions : int;
+  }
+
+  (* S3-FIFO: new entries go in [small]. Those accessed again before reaching the
+     end of it are promoted to [main], and the rest are evicted quickly, their keys
+     being remembered in [ghost] so that they go straight into [main] if they return. *)
+  type t = {
+    region : Region.t;
+    block_size : int;
+    table : (key, entry) Hashtbl.t;
+    small : entry Queue.t;
+    main : entry Queue.t;
+    small_target : int;
+    ghost : key Queue.t;
+    ghost_count : (key, int) Hashtbl.t;
+    ghost_capacity : int;
+    mutable hits : int;
+    mutable coalesced : int;
+    mutable misses : int;
+    mutable evictions : int;
+  }
+
+  let create region =
+    let capacity = Region.avail region in
+    if capacity < 1 then invalid_arg "Block_cache.create: region has no free chunks";
+    let block_size = Region.block_size region in
+    let small_target = max 1 (capacity / 10) in
+    {
+      region; block_size;
+      table = Hashtbl.create capacity;
+      small = Queue.create ();
+      main = Queue.create ();
+      small_target;
+      ghost = Queue.create ();
+      ghost_count = Hashtbl.create capacity;
+      ghost_capacity = capacity - small_target;
+      hits = 0; coalesced = 0; misses = 0; evictions = 0;
+    }
+
+  let block_size t = t.block_size
+
+  let in_ghost t key = Hashtbl.mem t.ghost_count key
+
+  let add_ghost t key =
+    let count k = Option.value (Hashtbl.find_opt t.ghost_count k) ~default:0 in
+    Queue.push key t.ghost;
+    Hashtbl.replace t.ghost_count key (count key + 1);
+    if Queue.length t.ghost > t.ghost_capacity then (
+      let old = Queue.pop t.ghost in
+      match count old with
+      | 1 -> Hashtbl.remove t.ghost_count old
+      | n -> Hashtbl.replace t.ghost_count old (n - 1)
+    )
+
+  let evictable e =
+    match e.state with
+    | Ready _ -> e.shared.Shared_chunk.refs = 1
+    | Loading _ | Failed -> false
+
+  let drop t e =
+    Hashtbl.remove t.table e.key;
+    e.state <- Failed;
+    Shared_chunk.release e.shared;
+    t.evictions <- t.evictions + 1
+
+  (* Free one chunk, if possible. Entries that are in use are moved to the back of [main].
+     [budget] limits the number of entries we look at, in case everything is in use. *)
+  let rec evict t ~budget =
+    if budget = 0 then false
+    else if Queue.length t.small >= t.small_target || Queue.is_empty t.main then (
+      match Queue.take_opt t.small with
+      | None -> false
+      | Some { state = Failed; _ } -> evict t ~budget
+      | Some e when e.freq > 0 || not (evictable e) ->
+        e.freq <- 0;
+        Queue.push e t.main;
+        evict t ~budget:(budget - 1)
+      | Some e ->
+        drop t e;
+        add_ghost t e.key;
+        true
+    ) else (
+      match Queue.pop t.main with
+      | { state = Failed; _ } -> evict t ~budget
+      | e when e.freq > 0 || not (evictable e) ->
+        e.freq <- max 0 (e.freq - 1);
+        Queue.push e t.main;
+        evict t ~budget:(budget - 1)
+      | e ->
+        drop t e;
+        true
+    )
+
+  let alloc_chunk t =
+    match Region.alloc t.region with
+    | chunk -> Some chunk
+    | exception Region.No_space ->
+      let budget = 4 * (Queue.length t.small + Queue.length t.main) + 1 in
+      if evict t ~budget then Some (Region.alloc t.region) else None
+
+  let read ?ioprio t ring ~file fd block user_data =
+    let key = { file; block } in
+    match Hashtbl.find_opt t.table key with
+    | Some { state = Loading (id, _); _ } when id != ring.id ->
+      (* The completion would come from the other ring. *)
+      `Busy
+    | Some e ->
+      e.freq <- min 3 (e.freq + 1);
+      Shared_chunk.retain e.shared;
+      begin match e.state with
+        | Ready len ->
+          t.hits <- t.hits + 1;
+          `Hit (e.shared, len)
+        | Loading (_, ptr) ->
+          t.coalesced <- t.coalesced + 1;
+          let i = (ptr :> int) in
+          ring.followers.(i) <- user_data :: ring.followers.(i);
+          `Wait e.shared
+        | Failed -> assert false
+      end
+    | None ->
+      match alloc_chunk t with
+      | None -> `Full
+      | Some chunk ->
+        let file_offset = Optint.Int63.of_int (block * t.block_size) in
+        match read_chunk ?ioprio ring ~file_offset fd chunk user_data with
+        | None -> Region.free chunk; `Full
+        | Some job ->
+          t.misses <- t.misses + 1;
+          (* One reference for the cache, and one for the caller. *)
+          let shared = { Shared_chunk.chunk; refs = 2 } in
+          let ptr = Heap.ptr job in
+          let e = { key; shared; freq = 0; state = Loading (ring.id, ptr) } in
+          Hashtbl.add t.table key e;
+          Queue.push e (if in_ghost t key then t.main else t.small);
+          ring.job_hooks.((ptr :> int)) <- (fun result ->
+              if result >= 0 then e.state <- Ready result
+              else (
+                (* Don't cache errors. *)
+                Hashtbl.remove t.table key;
+                e.state <- Failed;
+                Shared_chunk.release shared
+              );
+              result
+            );
+          `Wait shared
+
+  let stats t : stats = { hits = t.hits; coalesced = t.coalesced; misses = t.misses; evictions = t.evictions }
+end
 
-let recv_msg t fd msghdr user_data =
-  with_id_full t (fun id -> Uring.submit_recv_msg t.uring id fd msghdr) user_data ~extra_data:msghdr
+module Batch = struct
+  type 'a request = {
+    write : bool;
+    fd : Unix.file_descr;
+    file_offset : Optint.Int63.t;
+    buffers : Cstruct.t list;
+    data : 'a;
+  }
+
+  type 'a ring = 'a t
+
+  type 'a t = {
+    ring : 'a ring;
+    clock : unit -> float;
+    max_pending : int;
+    window : float;
+    max_merge : int;                        (* 0 to disable merging *)
+    mutable sqes_saved : int;
+    mutable requests : 'a request list;     (* Sorted once [flush] has been called *)
+    mutable pending : int;
+    mutable deadline : float;               (* When the oldest pending request's window expires *)
+  }
+
+  let create ?(clock=Unix.gettimeofday) ?(max_pending=max_int) ?(window=infinity) ?(max_merge=0) ring =
+    if max_pending < 1 then Fmt.invalid_arg "Batch.create: max_pending %d must be positive" max_pending;
+    { ring; clock; max_pending; window; max_merge; sqes_saved = 0;
+      requests = []; pending = 0; deadline = infinity }
+
+  let compare_requests a b =
+    match compare a.fd b.fd with
+    | 0 -> Optint.Int63.compare a.file_offset b.file_offset
+    | x -> x
+
+  let submit t r =
+    if r.write then writev t.ring r.fd r.buffers r.data ~file_offset:r.file_offset
+    else readv t.ring r.fd r.buffers r.data ~file_offset:r.file_offset
+
+  let iov_max = 1024
+
+  (* Split [rs] into the longest run of reads that directly follow [r] in the file,
+     and the remaining requests. The run's total size is at most [t.max_merge]. *)
+  let merge_group t r rs =
+    let rec aux ~next ~size ~n acc = function
+      | r' :: rs when not r'.write && r'.fd = r.fd && Optint.Int63.equal r'.file_offset next ->
+        let len = Cstruct.lenv r'.buffers in
+        let size = size + len in
+        let n = n + List.length r'.buffers in
+        if size > t.max_merge || n > iov_max then List.rev acc, r' :: rs
+        else aux ~next:(Optint.Int63.add next (Optint.Int63.of_int len)) ~size ~n (r' :: acc) rs
+      | rs -> List.rev acc, rs
+    in
+    let len = Cstruct.lenv r.buffers in
+    aux [r] rs
+      ~next:(Optint.Int63.add r.file_offset (Optint.Int63.of_int len))
+      ~size:len
+      ~n:(List.length r.buffers)
+
+  (* Submit a single read into all the group's buffers.
+     When it completes, each request gets its share of the result. *)
+  let submit_merged t group =
+    let first = List.hd group in
+    let buffers = List.concat_map (fun r -> r.buffers) group in
+    match readv t.ring first.fd buffers first.data ~file_offset:first.file_offset with
+    | None -> false
+    | Some job ->
+      t.sqes_saved <- t.sqes_saved + List.length group - 1;
+      let ring = t.ring in
+      ring.job_hooks.((Heap.ptr job :> int)) <- (fun result ->
+          let share ~start r =
+            if result < 0 then result
+            else max 0 (min (Cstruct.lenv r.buffers) (result - start))
+          in
+          let start = ref (Cstruct.lenv first.buffers) in
+          List.tl group |> List.iter (fun r ->
+              Queue.push (r.data, share ~start:!start r) ring.ready;
+              start := !start + Cstruct.lenv r.buffers
+            );
+          share ~start:0 first
+        );
+      true
+
+  let flush t =
+    let rec aux n = function
+      | [] -> [], n
+      | r :: rs as all when t.max_merge > 0 && not r.write ->
+        begin match merge_group t r rs with
+          | [_], _ ->
+            begin match submit t r with
+              | None -> all, n
+              | Some _ -> aux (n + 1) rs
+            end
+          | group, rest ->
+            if submit_merged t group then aux (n + List.length group) rest
+            else all, n
+        end
+      | r :: rs as all ->
+        match submit t r with
+        | None -> all, n
+        | Some _ -> aux (n + 1) rs
+    in
+    let rest, n = aux 0 (List.stable_sort compare_requests t.requests) in
+    t.requests <- rest;
+    t.pending <- t.pending - n;
+    (* Anything left over didn't fit in the ring, and should be retried as soon as possible. *)
+    t.deadline <- if t.pending = 0 then infinity else t.clock ();
+    n
+
+  let add t r =
+    if t.pending = 0 then t.deadline <- t.clock () +. t.window;
+    t.requests <- r :: t.requests;
+    t.pending <- t.pending + 1;
+    if t.pending >= t.max_pending then ignore (flush t : int)
+
+  let readv t ~file_offset fd buffers data =
+    add t { write = false; fd; file_offset; buffers; data }
+
+  let writev t ~file_offset fd buffers data =
+    add t { write = true; fd; file_offset; buffers; data }
+
+  let pending t = t.pending
+
+  let deadline t = if t.pending = 0 then None else Some t.deadline
+
+  let flush_if_due t =
+    if t.pending > 0 && t.clock () >= t.deadline then flush t else 0
+
+  let sqes_saved t = t.sqes_saved
+end
 
 let cancel t job user_data =
   ignore (Heap.ptr job : Uring.id);  (* Check it's still valid *)
-  with_id t (fun id -> Uring.submit_cancel t.uring id (Heap.ptr job)) user_data
-
-let submit t =
-  if t.dirty then begin
-    t.dirty <- false;
-    Uring.submit t.uring
-  end else
-    0
+  with_id t (fun id -> Uring.submit_cancel t.uring id (Heap.ptr job)) user_data ~fd:no_fd
+
+let on_complete t job fn =
+  let i = (Heap.ptr job :> int) in
+  let hook = t.job_hooks.(i) in
+  t.job_hooks.(i) <- (fun res -> fn res; hook res)
+
+(* Cancel each job in [targets] and arrange for [user_data] to be returned once they've all finished.
+   Either all the cancellations are queued, or none are. *)
+let cancel_jobs t targets user_data =
+  let n = List.length targets in
+  if Uring.sq_space_left t.uring < n then ignore (Uring.submit t.uring : int);
+  if Uring.sq_space_left t.uring < n then None
+  else (
+    if n = 0 then Queue.push (user_data, 0) t.ready
+    else (
+      let barrier = { remaining = n; barrier_data = user_data; barrier_result = n } in
+      targets |> List.iter (fun ptr ->
+          let i = (ptr : Heap.ptr :> int) in
+          t.barriers.(i) <- barrier :: t.barriers.(i);
+          let queued = Uring.submit_cancel t.uring ignored_id ptr in
+          assert queued
+        );
+      t.dirty <- true;
+      t.linking <- false
+    );
+    Some n
+  )
+
+let cancel_fd t fd user_data =
+  let targets = ref [] in
+  Heap.iter t.data (fun ptr -> if t.job_fds.((ptr :> int)) = fd then targets := ptr :: !targets);
+  cancel_jobs t !targets user_data
+
+let cancel_all t user_data =
+  let targets = ref [] in
+  Heap.iter t.data (fun ptr -> targets := ptr :: !targets);
+  cancel_jobs t !targets user_data
+
+(* Like [cancel_all], but doesn't report when it's done. If there isn't room for everything,
+   we submit what fits (see [submit]), and any cancels still left over are queued by [wait]
+   as the SQ drains. Returns the number of cancels queued now. *)
+let cancel_everything t =
+  let targets = ref [] in
+  Heap.iter t.data (fun ptr -> targets := ptr :: !targets);
+  (* This covers any cancels already deferred, as they're for active jobs. *)
+  t.deferred_cancels <- !targets;
+  t.linking <- false;
+  flush_cancels t;
+  if t.deferred_cancels <> [] then ignore (submit t : int);
+  List.length !targets - List.length t.deferred_cancels
+
+module Hedge = struct
+  type t = {
+    clock : unit -> float;
+    latency : Histogram.t;
+    percentile : float;
+    min_delay : float;
+    max_delay : float;
+    min_samples : int;
+    mutable n_reads : int;
+    mutable n_hedged : int;
+    mutable n_secondary_wins : int;
+  }
+
+  type which = [`Primary | `Secondary]
+
+  type read = {
+    mutable chunk : Region.chunk;
+    mutable winner : [`Pending | which];
+  }
+
+  type stats = {
+    reads : int;
+    hedged : int;
+    secondary_wins : int;
+  }
+
+  let create ?(clock=Unix.gettimeofday) ?(percentile=95.0) ?(min_delay=0.0) ?(max_delay=1.0) ?(min_samples=20) () =
+    if percentile < 0.0 || percentile > 100.0 then Fmt.invalid_arg "Hedge.create: bad percentile %g" percentile;
+    if min_delay < 0.0 || max_delay < min_delay then invalid_arg "Hedge.create: bad delay limits";
+    { clock; latency = Histogram.create (); percentile; min_delay; max_delay; min_samples;
+      n_reads = 0; n_hedged = 0; n_secondary_wins = 0 }
+
+  let delay t =
+    if Histogram.count t.latency < t.min_samples then t.max_delay
+    else Float.min t.max_delay (Float.max t.min_delay (Histogram.percentile t.latency t.percentile))
+
+  let latency t = t.latency
+
+  let stats t = { reads = t.n_reads; hedged = t.n_hedged; secondary_wins = t.n_secondary_wins }
+
+  let chunk r =
+    if r.winner = `Pending then invalid_arg "Hedge.chunk: read still in progress";
+    r.chunk
+
+  let winner r = r.winner
+
+  (* Cancel [ptr] without reporting the result of the cancellation.
+     This is called from completion hooks, in the middle of a reap, so it mustn't submit.
+     If the SQ is full (or a chain is being built), the cancel is queued by the next {!submit}. *)
+  let cancel_quietly ring ptr =
+    if not ring.linking && Uring.submit_cancel ring.uring ignored_id ptr then ring.dirty <- true
+    else ring.deferred_cancels <- ptr :: ring.deferred_cancels
+
+  let read ?ioprio t ring region ~len ~primary:(fd1, off1) ~secondary:(fd2, off2) user_data =
+    match Region.alloc region with
+    | exception Region.No_space -> None
+    | chunk1 ->
+      let r = { chunk = chunk1; winner = `Pending } in
+      let in_flight = ref [] in         (* The reads still running *)
+      let timer = ref None in           (* The hedge timer, if still running *)
+      let secondary_started = ref false in
+      let finish (which : which) chunk res =
+        r.chunk <- chunk;
+        r.winner <- (which :> [`Pending | which]);
+        if which = `Secondary then t.n_secondary_wins <- t.n_secondary_wins + 1;
+        Option.iter (cancel_quietly ring) !timer;
+        List.iter (fun (_, ptr) -> cancel_quietly ring ptr) !in_flight;
+        res
+      in
+      let rec submit_read which ~fd ~file_offset chunk =
+        match read_chunk ?ioprio ~len ring ~file_offset fd chunk user_data with
+        | None -> false
+        | Some job ->
+          let ptr = Heap.ptr job in
+          let started = t.clock () in
+          in_flight := (which, ptr) :: !in_flight;
+          ring.job_hooks.((ptr :> int)) <- (fun res -> on_read which chunk ptr ~started res);
+          true
+      and start_secondary () =
+        secondary_started := true;
+        Option.iter (cancel_quietly ring) !timer;
+        match Region.alloc region with
+        | exception Region.No_space -> false
+        | chunk2 ->
+          if submit_read `Secondary ~fd:fd2 ~file_offset:off2 chunk2 then (
+            t.n_hedged <- t.n_hedged + 1;
+            true
+          ) else (
+            Region.free chunk2;
+            false
+          )
+      and on_read which chunk ptr ~started res =
+        in_flight := List.filter (fun (_, p) -> p <> ptr) !in_flight;
+        if res >= 0 then Histogram.add t.latency (t.clock () -. started);
+        if r.winner <> `Pending then (
+          (* We lost the race, or were cancelled after it was decided. *)
+          Region.free chunk;
+          dropped
+        ) else if res >= 0 || !in_flight = [] && (res = - Config.ecanceled || !secondary_started || not (start_secondary ())) then
+          (* Succeeded, or nothing else to try. If we were cancelled (e.g. by [exit ~drain]),
+             don't start the secondary now. *)
+          finish which chunk res
+        else (
+          (* Failed, but the other read might still succeed. *)
+          Region.free chunk;
+          dropped
+        )
+      in
+      if not (submit_read `Primary ~fd:fd1 ~file_offset:off1 chunk1) then (
+        Region.free chunk1;
+        None
+      ) else (
+        t.n_reads <- t.n_reads + 1;
+        begin match timeout ring (delay t) user_data with
+          | None -> ()       (* No room for the timer, so don't hedge this one *)
+          | Some job ->
+            let ptr = Heap.ptr job in
+            timer := Some ptr;
+            ring.job_hooks.((ptr :> int)) <- (fun res ->
+                timer := None;
+                (* Only hedge if the timer expired, not if it was cancelled. *)
+                if res = - Config.etime && r.winner = `Pending && not !secondary_started then
+                  ignore (start_secondary () : bool);
+                dropped
+              )
+        end;
+        Some r
+      )
+end
 
 type 'a completion_option =
   | None
   | Some of { result: int; data: 'a }
 
-let fn_on_ring fn t =
-  match fn t.uring with
+let release_barriers t i =
+  match t.barriers.(i) with
+  | [] -> ()
+  | barriers ->
+    t.barriers.(i) <- [];
+    barriers |> List.iter (fun b ->
+        b.remaining <- b.remaining - 1;
+        if b.remaining = 0 then Queue.push (b.barrier_data, b.barrier_result) t.ready
+      )
+
+let release_followers t i result =
+  match t.followers.(i) with
+  | [] -> ()
+  | followers ->
+    t.followers.(i) <- [];
+    List.iter (fun d -> Queue.push (d, result) t.ready) (List.rev followers)
+
+let release_shared_read t i =
+  match t.job_read_keys.(i) with
+  | None -> ()
+  | Some key ->
+    t.job_read_keys.(i) <- None;
+    let _, shared = Hashtbl.find t.shared_reads key in
+    Hashtbl.remove t.shared_reads key;
+    Shared_chunk.release shared
+
+(* If the application fell behind, the kernel may have completions that didn't fit in the CQ.
+   Newer kernels keep them and we ask for them to be moved into the CQ as it drains
+   (they also refuse new submissions until that's done). Older ones just discard them and
+   count them in [koverflow]; the jobs they were for will never complete. *)
+let check_cq t =
+  if Uring.cq_overflow t.uring then (
+    t.cq_overflows <- t.cq_overflows + 1;
+    (* If this fails (e.g. EINTR), we'll try again on the next reap. *)
+    ignore (Uring.flush_cq t.uring : int)
+  );
+  t.cq_lost <- Uring.cq_dropped t.uring
+
+type cq_stats = {
+  overflows : int;
+  lost : int;
+}
+
+let cq_stats t = { overflows = t.cq_overflows; lost = t.cq_lost }
+
+(* Clean up after job [i], whose slot has just been freed, and run its hook.
+   Returns the result to report (or [dropped]). *)
+let finish_job t i res =
+  t.job_fds.(i) <- no_fd;
+  (* The slot may be reused, so don't cancel whatever gets it next. *)
+  if t.deferred_cancels <> [] then
+    t.deferred_cancels <- List.filter (fun p -> (p : Heap.ptr :> int) <> i) t.deferred_cancels;
+  let hook = t.job_hooks.(i) in
+  t.job_hooks.(i) <- no_hook;
+  let res = hook res in
+  release_shared_read t i;
+  release_followers t i res;
+  release_barriers t i;
+  remove_in_flight t i;
+  res
+
+let rec fn_on_ring fn t =
+  if not (Queue.is_empty t.ready) then (
+    let data, result = Queue.pop t.ready in
+    Some { result; data }
+  ) else
+  match check_cq t; fn t.uring with
   | Uring.Cqe_none -> None
-  | Uring.Cqe_some { user_data_id; res } ->
+  | Uring.Cqe_some { user_data_id; res; more = true } ->
+    (* A multishot job, which stays active until a completion without [more]. *)
+    Some { result = res; data = Heap.get t.data user_data_id }
+  | Uring.Cqe_some { user_data_id; res; more = false } ->
+    let data = Heap.free t.data user_data_id in
+    let res = finish_job t (user_data_id :> int) res in
+    if res <> dropped then Some { result = res; data }
+    else if Uring.cq_ready t.uring > 0 || not (Queue.is_empty t.ready) then fn_on_ring fn t
+    else None
+
+(* Like [fn_on_ring], but passes the completion to [k] instead of allocating a [completion_option].
+   Returns [false] if there was nothing to reap. *)
+let rec reap_with fn t k =
+  if not (Queue.is_empty t.ready) then (
+    let data, result = Queue.pop t.ready in
+    k data result;
+    true
+  ) else
+  match check_cq t; fn t.uring with
+  | Uring.Cqe_none -> false
+  | Uring.Cqe_some { user_data_id; res; more = true } ->
+    k (Heap.get t.data user_data_id) res;
+    true
+  | Uring.Cqe_some { user_data_id; res; more = false } ->
     let data = Heap.free t.data user_data_id in
-    Some { result = res; data }
+    let res = finish_job t (user_data_id :> int) res in
+    if res <> dropped then (k data res; true)
+    else if Uring.cq_ready t.uring > 0 || not (Queue.is_empty t.ready) then reap_with fn t k
+    else false
 
-let peek t = fn_on_ring Uring.peek_cqe t
+let peek t =
+  flush_cancels t;
+  maybe_flush t;
+  fn_on_ring Uring.peek_cqe t
 
 let wait ?timeout t =
+  (* Don't block waiting for requests that haven't been submitted. *)
+  if Option.is_some t.auto_flush && not t.linking then ignore (submit t : int);
+  (* The stubs submit anything still queued before blocking, even an unfinished chain. *)
+  t.linking <- false;
+  flush_cancels t;
   match timeout with
   | None -> fn_on_ring Uring.wait_cqe t
   | Some timeout -> fn_on_ring (Uring.wait_cqe_timeout timeout) t
 
+let has_completions (Ring t) =
+  not (Queue.is_empty t.ready) || Uring.cq_ready t.uring > 0 || Uring.cq_overflow t.uring
+
+let wait_any ?timeout rings =
+  List.iter (fun (Ring t) -> ignore (submit t : int)) rings;
+  match List.filter has_completions rings with
+  | _ :: _ as ready -> ready
+  | [] ->
+    let timeout_ms =
+      match timeout with
+      | None -> -1
+      | Some s -> int_of_float (Float.ceil (s *. 1000.0))
+    in
+    Uring.poll_rings (Array.of_list (List.map (fun (Ring t) -> t.uring) rings)) timeout_ms;
+    List.filter has_completions rings
+
+module Loop = struct
+  type callback = int -> unit
+
+  type ring = callback t
+
+  type timer = {
+    deadline : float;
+    fn : unit -> unit;
+    mutable live : bool;        (* Not yet run or cancelled *)
+  }
+
+  type t = {
+    ring : ring;
+    clock : unit -> float;
+    max_batch : int;
+    mutable timers : timer array;   (* A binary min-heap on [deadline], of size [n_timers] *)
+    mutable n_timers : int;         (* Including cancelled timers not yet removed *)
+    mutable live_timers : int;
+    mutable stopped : bool;
+  }
+
+  let no_timer = { deadline = infinity; fn = ignore; live = false }
+
+  let create ?(clock=Unix.gettimeofday) ?(max_batch=64) ring =
+    if max_batch < 1 then Fmt.invalid_arg "Loop.create: max_batch %d must be positive" max_batch;
+    { ring; clock; max_batch; timers = Array.make 16 no_timer; n_timers = 0; live_timers = 0; stopped = false }
+
+  let ring t = t.ring
+
+  let swap a i j =
+    let x = a.(i) in
+    a.(i) <- a.(j);
+    a.(j) <- x
+
+  let rec sift_up a i =
+    if i > 0 then (
+      let parent = (i - 1) / 2 in
+      if a.(i).deadline < a.(parent).deadline then (swap a i parent; sift_up a parent)
+    )
+
+  let rec sift_down a n i =
+    let l = 2 * i + 1 in
+    if l < n then (
+      let c = if l + 1 < n && a.(l + 1).deadline < a.(l).deadline then l + 1 else l in
+      if a.(c).deadline < a.(i).deadline then (swap a i c; sift_down a n c)
+    )
+
+  let pop_timer t =
+    let a = t.timers in
+    let top = a.(0) in
+    t.n_timers <- t.n_timers - 1;
+    a.(0) <- a.(t.n_timers);
+    a.(t.n_timers) <- no_timer;
+    sift_down a t.n_timers 0;
+    top
+
+  let after t delay fn =
+    let timer = { deadline = t.clock () +. delay; fn; live = true } in
+    if t.n_timers = Array.length t.timers then (
+      let bigger = Array.make (2 * t.n_timers) no_timer in
+      Array.blit t.timers 0 bigger 0 t.n_timers;
+      t.timers <- bigger
+    );
+    t.timers.(t.n_timers) <- timer;
+    sift_up t.timers t.n_timers;
+    t.n_timers <- t.n_timers + 1;
+    t.live_timers <- t.live_timers + 1;
+    timer
+
+  let cancel_timer t timer =
+    if timer.live then (
+      timer.live <- false;
+      t.live_timers <- t.live_timers - 1
+    )
+
+  (* Run the timers due at [now]. Returns the number run. *)
+  let run_timers t now =
+    let rec aux n =
+      if t.n_timers > 0 && t.timers.(0).deadline <= now then (
+        let timer = pop_timer t in
+        if timer.live then (
+          cancel_timer t timer;
+          timer.fn ();
+          aux (n + 1)
+        ) else aux n
+      ) else n
+    in
+    aux 0
+
+  (* When the next live timer is due, or [infinity] if there isn't one. *)
+  let rec next_deadline t =
+    if t.n_timers = 0 then infinity
+    else if t.timers.(0).live then t.timers.(0).deadline
+    else (ignore (pop_timer t : timer); next_deadline t)
+
+  let dispatch (fn : callback) result = fn result
+
+  (* Run the callbacks for up to [max_batch] completions that are already available. *)
+  let drain t =
+    let rec aux n =
+      if n < t.max_batch && reap_with Uring.peek_cqe t.ring dispatch then aux (n + 1) else n
+    in
+    aux 0
+
+  let is_idle t =
+    t.live_timers = 0 && Heap.in_use t.ring.data = 0 && Queue.is_empty t.ring.ready
+
+  let run_once ?(block=true) t =
+    let ring = t.ring in
+    (* [stopped] only stops this call from blocking, and [run] from continuing. *)
+    t.stopped <- false;
+    let n = run_timers t (t.clock ()) in
+    maybe_flush ring;
+    let n = n + drain t in
+    if not block then (
+      (* The caller may not come back for a while, so don't leave requests unsubmitted. *)
+      ignore (submit ring : int);
+      n
+    ) else if n > 0 || t.stopped || is_idle t then n
+    else (
+      (* Nothing to do yet, so submit everything and sleep until a completion or timer is due. *)
+      ignore (submit ring : int);
+      let deadline = next_deadline t in
+      let reaped =
+        if deadline = infinity then reap_with Uring.wait_cqe ring dispatch
+        else reap_with (Uring.wait_cqe_timeout (Float.max 0.0 (deadline -. t.clock ()))) ring dispatch
+      in
+      let n = if reaped then 1 + drain t else 0 in
+      n + run_timers t (t.clock ())
+    )
+
+  let run t =
+    t.stopped <- false;
+    while not t.stopped && not (is_idle t) do
+      ignore (run_once t : int)
+    done
+
+  let stop t = t.stopped <- true
+end
+
+(* Jobs whose completions the kernel discarded will never finish, so stop once only they remain.
+   [cq_lost] counts completions rather than jobs, so this is exact only without multishot jobs,
+   but those need a kernel that doesn't discard completions anyway. *)
+let rec drain_completions t ~release =
+  check_cq t;
+  if Heap.in_use t.data > t.cq_lost || not (Queue.is_empty t.ready) then (
+    begin match wait t with
+      | None -> ()
+      | Some { result; data } -> release data result
+    end;
+    drain_completions t ~release
+  )
+
+let exit ?(drain=false) ?(release=fun _ _ -> ()) t =
+  if drain then (
+    ignore (cancel_everything t : int);
+    drain_completions t ~release
+  );
+  ensure_idle ~lost:t.cq_lost t "exit";
+  if t.fixed_dontfork then Uring.bigarray_dontfork t.fixed_iobuf false;
+  Uring.exit t.uring;
+  unregister_gc_root t
+
 let queue_depth {queue_depth;_} = queue_depth
+let backend {backend;_} = backend
+let active_ops t = Heap.in_use t.data
 let buf {fixed_iobuf;_} = fixed_iobuf
 
+module Ring_pool = struct
+  type nonrec 'a t = {
+    make : unit -> 'a t;
+    clock : unit -> float;
+    max_idle : int;
+    idle_timeout : float;
+    mutable idle : ('a t * float) list;  (* Most recently released first *)
+    mutable closed : bool;
+  }
+
+  let make_ring ?polling_timeout ?ioprio ?backend ?fixed_buffer_size ~queue_depth () =
+    let t = create ?polling_timeout ?ioprio ?backend ~queue_depth () in
+    Option.iter (fun size ->
+        let iobuf = Bigarray.(Array1.create char c_layout size) in
+        t.pool_iobuf <- iobuf;
+        match set_fixed_buffer t iobuf with
+        | Ok () -> ()
+        | Error `ENOMEM ->
+          exit t;
+          raise (Unix.Unix_error (Unix.ENOMEM, "io_uring_register_buffers", ""))
+      ) fixed_buffer_size;
+    t
+
+  let create ?(clock=Unix.gettimeofday) ?(max_idle=16) ?(idle_timeout=infinity)
+      ?polling_timeout ?ioprio ?backend ?fixed_buffer_size ~queue_depth () =
+    if max_idle < 0 then Fmt.invalid_arg "Negative max_idle: %d" max_idle;
+    if queue_depth < 1 then Fmt.invalid_arg "Non-positive queue depth: %d" queue_depth;
+    let make = make_ring ?polling_timeout ?ioprio ?backend ?fixed_buffer_size ~queue_depth in
+    { make; clock; max_idle; idle_timeout; idle = []; closed = false }
+
+  let trim t =
+    let cutoff = t.clock () -. t.idle_timeout in
+    let keep, expired = List.partition (fun (_, released) -> released >= cutoff) t.idle in
+    t.idle <- keep;
+    List.iter (fun (ring, _) -> exit ring) expired
+
+  let acquire t =
+    if t.closed then invalid_arg "Ring_pool.acquire: pool is closed";
+    trim t;
+    match t.idle with
+    | (ring, _) :: rest -> t.idle <- rest; ring
+    | [] -> t.make ()
+
+  (* Undo any per-user settings, so the next user gets a ring that looks new.
+     Returns [false] if the ring can't be reused because its fixed buffer couldn't be restored. *)
+  let reset ring =
+    ring.limits <- no_limits;
+    ring.backpressure <- false;
+    ring.auto_flush <- None;
+    ring.first_pending <- 0.0;
+    ring.linking <- false;
+    ring.dirty <- false;
+    ring.try_inline <- 0;
+    ring.try_fallback <- 0;
+    Hashtbl.reset ring.no_nowait;
+    ring.deferred_cancels <- [];
+    ring.cq_overflows <- 0;
+    (* The previous user may still be using a buffer they registered themselves. *)
+    ring.fixed_iobuf == ring.pool_iobuf && not ring.fixed_dontfork ||
+    set_fixed_buffer ring ring.pool_iobuf = Ok ()
+
+  let release ?(drain=false) ?(release=fun _ _ -> ()) t ring =
+    if drain then (
+      ignore (cancel_everything ring : int);
+      drain_completions ring ~release
+    );
+    ensure_idle ~lost:ring.cq_lost ring "Ring_pool.release";
+    if not (Queue.is_empty ring.ready) then
+      invalid_arg "Ring_pool.release: ring has uncollected completions";
+    (* A ring that lost completions has leaked job slots, so don't reuse it. *)
+    if t.closed || ring.cq_lost > 0 || List.length t.idle >= t.max_idle || not (reset ring) then exit ring
+    else (
+      t.idle <- (ring, t.clock ()) :: t.idle;
+      trim t
+    )
+
+  let idle t = List.length t.idle
+
+  let close t =
+    t.closed <- true;
+    List.iter (fun (ring, _) -> exit ring) t.idle;
+    t.idle <- []
+end
+
 let error_of_errno e =
   Uring.error_of_errno (abs e)
@@ -18,6 +18,15 @@
 
 module Region = Region
 
+module Sched = Sched
+(** Fair sharing of a ring between several sources of requests. *)
+
+module Histogram = Histogram
+(** Latency distributions. *)
+
+module Lanes = Lanes
+(** Priority lanes for submissions. *)
+
 type 'a t
 (** ['a t] is a reference to an Io_uring structure. *)
 
@@ -25,18 +34,152 @@ type 'a job
 (** A handle for a submitted job, which can be used to cancel it.
     If an operation returns [None], this means that submission failed because the ring is full. *)
 
-val create : ?polling_timeout:int -> queue_depth:int -> unit -> 'a t
+(** I/O scheduling priorities, as used by [ioprio_set(2)]. *)
+module Ioprio : sig
+  type t = private int
+
+  val none : t
+  (** Use the priority of the submitting task. *)
+
+  val make : [`Rt | `Be | `Idle] -> int -> t
+  (** [make cls level] is the priority [level] within scheduling class [cls].
+      Levels range from 0 (highest priority) to 7.
+      [`Rt] (real-time) requires privileges.
+      @raise Invalid_argument if [level] is out of range. *)
+end
+
+(** How a ring's requests are carried out. *)
+type backend =
+  | Io_uring            (** By the kernel, using io_uring. *)
+  | Threads of int      (** By a pool of this many system threads, using ordinary system calls. *)
+(** The [Threads] backend is for systems without io_uring (kernels before 5.1, or where it
+    is blocked, e.g. by a container's seccomp policy). It is much slower, and:
+
+    - Linked requests are run in order on a single thread, and each blocking request
+      (e.g. a read from a pipe) occupies a thread until it finishes.
+    - Polling mode and I/O priorities are ignored.
+    - Multishot polls complete after the first event, as on kernels that don't support them.
+    - {!connect} cannot be cancelled.
+    - Unsupported operations complete with [-EINVAL]. *)
+
+val create : ?polling_timeout:int -> ?ioprio:Ioprio.t -> ?backend:backend -> queue_depth:int -> unit -> 'a t
 (** [create ~queue_depth] will return a fresh Io_uring structure [t].
     Initially, [t] has no fixed buffer. Use {!set_fixed_buffer} if you want one.
     @param polling_timeout If given, use polling mode with the given idle timeout (in ms).
-                           This requires privileges. *)
+                           This requires privileges.
+    @param ioprio The default I/O priority for reads and writes submitted to [t]
+                  (can be overridden per operation).
+    @param backend If given, use this backend (raising an exception if it isn't available).
+                   By default, io_uring is used if possible, falling back to [Threads 8]
+                   if the kernel refuses with [ENOSYS], [EPERM] or [EACCES]. *)
+
+val backend : 'a t -> backend
+(** [backend t] is the backend actually being used by [t]. *)
 
 val queue_depth : 'a t -> int
 (** [queue_depth t] returns the total number of submission slots for the uring [t] *)
 
-val exit : 'a t -> unit
+val active_ops : 'a t -> int
+(** [active_ops t] is the number of operations queued or in progress on [t] whose
+    completions have not yet been returned by {!wait} or {!peek}. *)
+
+val exit : ?drain:bool -> ?release:('a -> int -> unit) -> 'a t -> unit
 (** [exit t] will shut down the uring [t]. Any subsequent requests will fail.
-    @raise Invalid_argument if there are any requests in progress *)
+    @param drain If [true], first cancel all requests in progress and wait for them to complete
+                 (jobs that can't be cancelled are waited for). Default [false].
+    @param release Called with the user data and result of each completion collected while draining,
+                   so that any resources attached to the jobs can be freed.
+    @raise Invalid_argument if there are any requests in progress (and [drain] is [false]) *)
+
+(** Reusable rings.
+
+    Creating a ring means setting up the kernel's queues and mapping them into memory,
+    and {!exit} undoes all of that. A pool keeps rings that are no longer needed so that
+    short-lived users can share them instead.
+
+    Pools are not thread-safe. *)
+module Ring_pool : sig
+  type 'a ring := 'a t
+
+  type 'a t
+
+  val create :
+    ?clock:(unit -> float) -> ?max_idle:int -> ?idle_timeout:float ->
+    ?polling_timeout:int -> ?ioprio:Ioprio.t -> ?backend:backend -> ?fixed_buffer_size:int ->
+    queue_depth:int -> unit -> 'a t
+  (** [create ~queue_depth ()] is a new empty pool of rings.
+      New rings are made as needed using {!Uring.create} with the given [polling_timeout],
+      [ioprio], [backend] and [queue_depth].
+      @param fixed_buffer_size If given, each new ring gets a fixed buffer of this size.
+      @param max_idle The maximum number of idle rings to keep (default 16).
+                      Rings released when the pool is full are shut down.
+      @param idle_timeout Shut down rings that have been idle for longer than this many seconds.
+                          Checked on each {!acquire} and {!release} (default: no limit).
+      @param clock The time source for [idle_timeout] (default: [Unix.gettimeofday]). *)
+
+  val acquire : 'a t -> 'a ring
+  (** [acquire t] is an idle ring from [t], or a new one if there are none.
+      The most recently released ring is used first. *)
+
+  val release : ?drain:bool -> ?release:('a -> int -> unit) -> 'a t -> 'a ring -> unit
+  (** [release t ring] returns [ring] to [t] for reuse.
+      Its limits, auto-flush policy and statistics are cleared. Its fixed buffer remains registered;
+      if the caller replaced it, the pool's buffer is registered again (and the caller's is unregistered).
+      If that fails, [ring] is shut down instead.
+      [ring] must not be used by the caller after this.
+      @param drain If [true], first cancel all requests in progress and collect their completions,
+                   as for {!Uring.exit}.
+      @param release Called with each completion collected while draining.
+      @raise Invalid_argument if [ring] still has requests in progress or uncollected completions. *)
+
+  val trim : 'a t -> unit
+  (** [trim t] shuts down all rings that have been idle for longer than the timeout. *)
+
+  val idle : 'a t -> int
+  (** [idle t] is the number of idle rings in [t]. *)
+
+  val close : 'a t -> unit
+  (** [close t] shuts down all idle rings. Rings released later are shut down immediately,
+      and {!acquire} raises [Invalid_argument]. *)
+end
+
+(** {2 Backpressure}
+
+    By default, the only limit on the amount of I/O in progress is the queue depth.
+    Setting limits on the number of bytes being transferred prevents a ring from accepting
+    many large reads or writes at once, which can add a lot of latency for everything queued after them.
+
+    The limits apply to {!readv}, {!writev}, {!read_fixed}, {!write_fixed}, {!read_chunk} and {!write_chunk}. *)
+
+val set_limits :
+  ?soft_bytes:int -> ?hard_bytes:int -> ?max_io:int ->
+  ?cq_headroom:int ->
+  ?on_capacity:(unit -> unit) ->
+  'a t -> unit
+(** [set_limits t] replaces the limits on [t] (any limit not given is removed).
+
+    @param soft_bytes Once this many bytes are in flight, {!backpressure} returns [true].
+                      Requests are still accepted.
+    @param hard_bytes A read or write that would take the total above this returns [None], as if the ring were full.
+                      A request is always accepted if no reads or writes are in flight,
+                      so this does not prevent requests larger than [hard_bytes].
+    @param max_io Reads and writes return [None] once this many are in progress.
+    @param cq_headroom All requests return [None] while the completion queue has fewer than
+                       this many free entries, or while the kernel is holding overflowed
+                       completions (see {!cq_stats}). Collect some completions and try again.
+    @param on_capacity Called (from {!wait} or {!peek}) when a completion takes the ring
+                       from a state of backpressure to below [soft_bytes]. A ring is in
+                       this state once it reaches [soft_bytes], or after refusing a request due to
+                       [hard_bytes] or [max_io]. It is a good place to resume submitting
+                       (e.g. with {!Sched.dispatch}). *)
+
+val bytes_in_flight : 'a t -> int
+(** [bytes_in_flight t] is the total size of all reads and writes on [t] that have not yet been
+    returned by {!wait} or {!peek}. *)
+
+val backpressure : 'a t -> bool
+(** [backpressure t] is [true] if producers should stop submitting reads and writes
+    (see {!set_limits}). *)
 
 (** {2 Fixed buffers}
 
@@ -44,7 +187,7 @@ val exit : 'a t -> unit
     for the "fixed buffer" mode of io_uring to avoid data copying between
     userspace and the kernel. *)
 
-val set_fixed_buffer : 'a t -> Cstruct.buffer -> (unit, [> `ENOMEM]) result
+val set_fixed_buffer : ?dontfork:bool -> 'a t -> Cstruct.buffer -> (unit, [> `ENOMEM]) result
 (** [set_fixed_buffer t buf] sets [buf] as the fixed buffer for [t].
 
     You will normally want to wrap this with {!Region.alloc} or similar
@@ -55,6 +198,16 @@ val set_fixed_buffer : 'a t -> Cstruct.buffer -> (unit, [> `ENOMEM]) result
     Returns [`ENOMEM] if insufficient kernel resources are available
     or the caller's RLIMIT_MEMLOCK resource limit would be exceeded.
 
+    Registered pages are pinned, so when the process forks the kernel must copy them
+    for the child straight away rather than sharing them copy-on-write.
+    For a large buffer, this makes [fork] slow and greatly increases memory use.
+    The ring's own queues are always excluded from child processes.
+
+    @param dontfork If [true], exclude [buf] from child processes ([MADV_DONTFORK]),
+                    which avoids the copy. The child must not access [buf] (it will crash if
+                    it does), so only use this if children will [exec] or otherwise ignore it.
+                    Only whole pages are excluded. The setting is undone when the buffer is
+                    replaced or the ring is shut down. Default [false].
     @raise Invalid_argument if there are any requests in progress *)
 
 val buf : 'a t -> Cstruct.buffer
@@ -63,10 +216,6 @@ val buf : 'a t -> Cstruct.buffer
 
 (** {2 Queueing operations} *)
 
-val noop : 'a t -> 'a -> 'a job option
-(** [noop t d] submits a no-op operation to uring [t]. The user data [d] will be
-    returned by {!wait} or {!peek} upon completion. *)
-
 module type FLAGS = sig
   type t = private int
   (** A set of flags. *)
@@ -80,6 +229,50 @@ module type FLAGS = sig
   (** [mem x flags] is [true] iff [x] is a subset of [flags]. *)
 end
 
+(** Flags that can be set on any submission queue entry, using the optional [?sqe_flags] argument.
+
+    For example, [readv ~sqe_flags:Sqe_flags.async] skips the initial non-blocking
+    attempt for a read that is known to block. *)
+module Sqe_flags : sig
+  include FLAGS
+
+  val empty : t
+
+  val io_drain : t
+  (** Don't start this operation until all previously submitted ones have completed,
+      and don't start any later ones until this one has completed. *)
+
+  val io_link : t
+  (** Don't start the next operation until this one has completed successfully.
+      If this one fails, the rest of the chain is cancelled. *)
+
+  val io_hardlink : t
+  (** Like {!io_link}, but the rest of the chain runs even if this operation fails. *)
+
+  val async : t
+  (** Always perform the operation asynchronously in a worker thread,
+      rather than first trying it inline. *)
+end
+
+(** Per-operation flags for reads and writes, like those of [preadv2(2)] and [pwritev2(2)]. *)
+module Rw_flags : sig
+  include FLAGS
+
+  val empty : t
+  val hipri : t
+  val dsync : t
+  val sync : t
+
+  val nowait : t
+  (** Fail with [EAGAIN] instead of blocking. *)
+
+  val append : t
+end
+
+val noop : ?sqe_flags:Sqe_flags.t -> 'a t -> 'a -> 'a job option
+(** [noop t d] submits a no-op operation to uring [t]. The user data [d] will be
+    returned by {!wait} or {!peek} upon completion. *)
+
 (** Flags that can be passed to openat2. *)
 module Open_flags : sig
   include FLAGS
@@ -116,7 +309,9 @@ module Resolve : sig
   val cached : t
 end
 
-val openat2 : 'a t ->
+val openat2 :
+  ?sqe_flags:Sqe_flags.t ->
+  'a t ->
   access:[`R|`W|`RW] ->
   flags:Open_flags.t ->
   perm:Unix.file_perm ->
@@ -141,52 +336,338 @@ module Poll_mask : sig
   val pollhup : t
 end
 
-val poll_add : 'a t -> Unix.file_descr -> Poll_mask.t -> 'a -> 'a job option
+val poll_add : ?sqe_flags:Sqe_flags.t -> 'a t -> Unix.file_descr -> Poll_mask.t -> 'a -> 'a job option
 (** [poll_add t fd mask d] will submit a [poll(2)] request to uring [t].
     It completes and returns [d] when an event in [mask] is ready on [fd]. *)
 
+val poll_multishot : ?sqe_flags:Sqe_flags.t -> 'a t -> Unix.file_descr -> Poll_mask.t -> 'a -> 'a job option
+(** [poll_multishot t fd mask d] is like {!poll_add}, but stays armed after reporting an event,
+    returning [d] each time one of the events in [mask] becomes ready on [fd].
+    It uses a single slot in [t] until it is cancelled with {!cancel}, or the kernel stops it
+    (e.g. on error). Use {!active} after each completion to find out whether more will follow.
+    Requires Linux 5.13 (older kernels fail with [EINVAL]). *)
+
+val active : 'a job -> bool
+(** [active job] is [true] until the final completion for [job] has been returned by {!wait} or {!peek}. *)
+
+(** Using an epoll set from a ring.
+
+    Arming a {!poll_add} for every connection costs a ring slot and a submission per
+    socket each time it becomes ready. For a large, mostly idle set of sockets, it can be
+    cheaper to keep the interest set in epoll, change it with {!epoll_ctl}, and use a
+    single {!poll_add} on the epoll FD to learn when any of them are ready. *)
+module Epoll : sig
+  type op = Add | Modify | Delete
+
+  module Events : sig
+    include FLAGS
+
+    val epollin : t
+    val epollout : t
+    val epollerr : t
+    val epollhup : t
+    val epollrdhup : t
+    val epolloneshot : t
+    val epollet : t
+  end
+
+  val create : unit -> Unix.file_descr
+  (** [create ()] is a new epoll FD (with close-on-exec set). *)
+
+  val ready : Unix.file_descr -> Unix.file_descr array -> int
+  (** [ready epfd buf] stores FDs that are ready according to [epfd] in [buf], without blocking,
+      and returns how many it stored. Use this when a {!poll_add} on [epfd] completes.
+
+      It makes a single [epoll_wait] call and stores at most 256 FDs, so if it fills [buf]
+      (or returns 256) there may be more. Level-triggered FDs that are still ready are
+      reported again by the next call, so handle (e.g. drain) each batch before calling it again. *)
+end
+
+val epoll_ctl : ?sqe_flags:Sqe_flags.t -> 'a t -> Unix.file_descr -> Unix.file_descr -> Epoll.op -> Epoll.Events.t -> 'a -> 'a job option
+(** [epoll_ctl t epfd fd op events d] adds, modifies or removes [fd] in the epoll set [epfd],
+    as [epoll_ctl(2)]. [events] is ignored for [Delete].
+    Requires Linux 5.6. *)
+
 type offset := Optint.Int63.t
 (** For files, give the absolute offset, or use [Optint.Int63.minus_one] for the current position.
     For sockets, use an offset of [Optint.Int63.zero] ([minus_one] is not allowed here). *)
 
-val readv : 'a t -> file_offset:offset -> Unix.file_descr -> Cstruct.t list -> 'a -> 'a job option
+val readv : ?sqe_flags:Sqe_flags.t -> ?rw_flags:Rw_flags.t -> ?ioprio:Ioprio.t -> 'a t -> file_offset:offset -> Unix.file_descr -> Cstruct.t list -> 'a -> 'a job option
 (** [readv t ~file_offset fd iov d] will submit a [readv(2)] request to uring [t].
     It reads from absolute [file_offset] on the [fd] file descriptor and writes
     the results into the memory pointed to by [iov].  The user data [d] will
     be returned by {!wait} or {!peek} upon completion. *)
 
-val writev : 'a t -> file_offset:offset -> Unix.file_descr -> Cstruct.t list -> 'a -> 'a job option
+val writev : ?sqe_flags:Sqe_flags.t -> ?rw_flags:Rw_flags.t -> ?ioprio:Ioprio.t -> 'a t -> file_offset:offset -> Unix.file_descr -> Cstruct.t list -> 'a -> 'a job option
 (** [writev t ~file_offset fd iov d] will submit a [writev(2)] request to uring [t].
     It writes to absolute [file_offset] on the [fd] file descriptor from the
     the memory pointed to by [iov].  The user data [d] will be returned by
     {!wait} or {!peek} upon completion. *)
 
-val read_fixed : 'a t -> file_offset:offset -> Unix.file_descr -> off:int -> len:int -> 'a -> 'a job option
+val read_fixed : ?sqe_flags:Sqe_flags.t -> ?rw_flags:Rw_flags.t -> ?ioprio:Ioprio.t -> 'a t -> file_offset:offset -> Unix.file_descr -> off:int -> len:int -> 'a -> 'a job option
 (** [read t ~file_offset fd ~off ~len d] will submit a [read(2)] request to uring [t].
     It reads up to [len] bytes from absolute [file_offset] on the [fd] file descriptor and
     writes the results into the fixed memory buffer associated with uring [t] at offset [off].
     The user data [d] will be returned by {!wait} or {!peek} upon completion. *)
 
-val read_chunk : ?len:int -> 'a t -> file_offset:offset -> Unix.file_descr -> Region.chunk -> 'a -> 'a job option
+val read_chunk : ?sqe_flags:Sqe_flags.t -> ?rw_flags:Rw_flags.t -> ?ioprio:Ioprio.t -> ?len:int -> 'a t -> file_offset:offset -> Unix.file_descr -> Region.chunk -> 'a -> 'a job option
 (** [read_chunk] is like [read_fixed], but gets the offset from [chunk].
     @param len Restrict the read to the first [len] bytes of [chunk]. *)
 
-val write_fixed : 'a t -> file_offset:offset -> Unix.file_descr -> off:int -> len:int -> 'a -> 'a job option
+(** A reference-counted chunk, shared by all the callers of {!read_shared} that asked for the same data. *)
+module Shared_chunk : sig
+  type t
+
+  val chunk : t -> Region.chunk
+  (** [chunk t] is the underlying chunk. Do not free it directly; use {!release}. *)
+
+  val to_cstruct : ?len:int -> t -> Cstruct.t
+  (** [to_cstruct t] is a view onto the chunk's memory, as for {!Region.to_cstruct}. *)
+
+  val retain : t -> unit
+  (** [retain t] adds a reference to [t], which must later be released with {!release}. *)
+
+  val release : t -> unit
+  (** [release t] removes a reference. When there are none left, the chunk is returned to its region.
+      @raise Invalid_argument if [t] has already been freed. *)
+end
+
+val read_shared : ?sqe_flags:Sqe_flags.t -> ?ioprio:Ioprio.t -> 'a t -> Region.t -> file_offset:offset -> Unix.file_descr -> len:int -> 'a -> Shared_chunk.t option
+(** [read_shared t region ~file_offset fd ~len d] reads [len] bytes at [file_offset] from [fd]
+    into a chunk allocated from [region] (which must be [t]'s fixed buffer).
+
+    If an identical read (same [fd], [file_offset] and [len]) is already in progress, no new
+    request is made (except when [file_offset] is [-1], meaning the current position,
+    as each such read returns different data). Instead, [d] is attached to the existing one and is returned by {!wait} or {!peek}
+    with the same result (immediately after the original request's completion).
+
+    Either way, the caller gets a reference to the shared chunk holding the data, which can be used
+    once [d] has completed and must be released with {!Shared_chunk.release} when no longer needed.
+    No job is returned, so shared reads cannot be cancelled individually
+    (though {!cancel_all} still cancels them).
+
+    Returns [None] if the ring or [region] is full. *)
+
+(** A cache of file blocks, held in chunks of a ring's fixed buffer.
+
+    Blocks that are already cached are returned immediately, without any system call.
+    Misses are read with {!read_chunk}, and concurrent requests for a block that is being loaded share
+    the same read. When the cache is full, blocks are evicted using the S3-FIFO algorithm,
+    which keeps frequently-used blocks while letting blocks that are only read once (e.g. by a scan)
+    leave quickly.
+
+    To avoid caching the data twice, the files should normally be opened with [O_DIRECT]
+    (in which case the fixed buffer and block size must be suitably aligned). *)
+module Block_cache : sig
+  type 'a ring := 'a t
+
+  type t
+
+  val create : Region.t -> t
+  (** [create region] is a cache that stores blocks in chunks allocated from [region],
+      which must belong to the fixed buffer of the rings used with it.
+      The block size is [region]'s block size, and all of its free chunks may be used. *)
+
+  val block_size : t -> int
+
+  val read :
+    ?ioprio:Ioprio.t ->
+    t -> 'a ring -> file:int -> Unix.file_descr -> int -> 'a ->
+    [ `Hit of Shared_chunk.t * int | `Wait of Shared_chunk.t | `Busy | `Full ]
+  (** [read t ring ~file fd block d] gets block number [block] of the file.
+
+      [file] identifies the file in the cache's keys (e.g. an inode number), and [fd] is used to read it
+      if it is not cached.
+
+      - [`Hit (chunk, len)] means the block was in the cache; [len] is the number of valid bytes
+        (which is less than the block size at the end of the file).
+        No completion will be generated for [d].
+      - [`Wait chunk] means the block is being read; [d] will be returned by {!wait} or {!peek} with the
+        result of the read. If the read fails, the block is not cached.
+      - [`Busy] means that another ring is reading the block. Its completion will come from that
+        ring, so [d] can't wait for it; try again once that ring has reaped it.
+      - [`Full] means that nothing could be evicted (all blocks are in use) or [ring] is full.
+
+      In the first two cases, the caller holds a reference to [chunk] and must {!Shared_chunk.release} it
+      when finished. Blocks with outstanding references are not evicted. *)
+
+  type stats = {
+    hits : int;         (** Requests for blocks that were cached *)
+    coalesced : int;    (** Requests that waited for a read already in progress *)
+    misses : int;       (** Requests that needed a new read *)
+    evictions : int;
+  }
+
+  val stats : t -> stats
+end
+
+(** Sorts reads and writes by file offset before submitting them.
+
+    Requests added to a batch are held until it is flushed, and then submitted ordered by
+    FD and file offset. This helps devices that do little reordering of their own,
+    such as rotational disks and some network block devices. *)
+module Batch : sig
+  type 'a ring := 'a t
+
+  type 'a t
+
+  val create : ?clock:(unit -> float) -> ?max_pending:int -> ?window:float -> ?max_merge:int -> 'a ring -> 'a t
+  (** [create ring] is a new empty batch for [ring].
+      @param max_merge If greater than 0, reads of the same FD that are adjacent in the file are
+                       merged into a single {!Uring.readv} of up to this many bytes, using all the
+                       requests' buffers (so no data is copied).
+                       Each request still gets its own completion, with its share of the result
+                       (e.g. a read near the end of the file may get [0]). However, only the first
+                       request in a merged group can be cancelled (which cancels the group).
+      @param max_pending Flush automatically when this many requests are pending.
+      @param window Requests are due to be flushed this many seconds after the oldest pending one was added
+                    (see {!flush_if_due}). By default, there is no time limit.
+      @param clock The time source for [window] (default: [Unix.gettimeofday]). *)
+
+  val readv : 'a t -> file_offset:offset -> Unix.file_descr -> Cstruct.t list -> 'a -> unit
+  (** [readv t ~file_offset fd buffers d] adds a {!Uring.readv} request to the batch. *)
+
+  val writev : 'a t -> file_offset:offset -> Unix.file_descr -> Cstruct.t list -> 'a -> unit
+  (** [writev t ~file_offset fd buffers d] adds a {!Uring.writev} request to the batch. *)
+
+  val flush : 'a t -> int
+  (** [flush t] submits the pending requests in order, until they have all been submitted or
+      the ring is full. It returns the number submitted. You still need to call {!Uring.submit}.
+      Any requests that did not fit are due immediately. *)
+
+  val flush_if_due : 'a t -> int
+  (** [flush_if_due t] is [flush t] if the window has expired, or [0] otherwise. *)
+
+  val deadline : 'a t -> float option
+  (** [deadline t] is the time at which the pending requests are due, or [None] if there are none. *)
+
+  val pending : 'a t -> int
+  (** [pending t] is the number of requests not yet submitted. *)
+
+  val sqes_saved : 'a t -> int
+  (** [sqes_saved t] is the number of requests that were merged into others (see [max_merge]). *)
+end
+
+(** Hedged reads, for data that is available from more than one place (e.g. replicas).
+
+    A hedged read is sent to the primary source first. If that hasn't completed after a delay,
+    the same read is also sent to the secondary source, and whichever succeeds first is reported.
+    The other one is then cancelled. This cuts the tail latency caused by a slow primary,
+    at the cost of a few extra reads.
+
+    The delay is a percentile of the reads' own latencies (the 95th by default),
+    so that only unusually slow reads get a second attempt. *)
+module Hedge : sig
+  type 'a ring := 'a t
+
+  type t
+  (** A hedging policy, with the latency history used to pick the delay.
+      A policy can be shared by any number of rings. *)
+
+  type read
+  (** A hedged read in progress. *)
+
+  val create :
+    ?clock:(unit -> float) -> ?percentile:float -> ?min_delay:float -> ?max_delay:float -> ?min_samples:int ->
+    unit -> t
+  (** [create ()] is a new policy with no latency history.
+      @param percentile Hedge reads that take longer than this percentile of previous reads (default 95).
+      @param min_delay Never hedge sooner than this many seconds (default 0).
+      @param max_delay Always hedge after this many seconds (default 1).
+      @param min_samples Use [max_delay] until this many reads have been timed (default 20).
+      @param clock The time source for measuring latency (default: [Unix.gettimeofday]). *)
+
+  val read :
+    ?ioprio:Ioprio.t -> t -> 'a ring -> Region.t -> len:int ->
+    primary:(Unix.file_descr * offset) -> secondary:(Unix.file_descr * offset) -> 'a -> read option
+  (** [read t ring region ~len ~primary:(fd1, off1) ~secondary:(fd2, off2) d] starts
+      reading [len] bytes at [off1] in [fd1], using a chunk of [region] (which must be the ring's fixed buffer).
+
+      A single completion is reported with user data [d], once one of the reads has succeeded
+      or both have failed. The result is that of the winning read, whose data is in {!chunk}.
+      If the primary fails before the delay is up, the secondary is tried at once.
+
+      Internally, the timer and the second read use extra ring slots (and a second chunk);
+      these remain in use until the losing read has been cancelled.
+      If there is no room for them, the read simply isn't hedged.
+      The cancellations are queued when the winner is reaped, or by the next {!Uring.submit}
+      if the submission queue is full at that point.
+
+      Returns [None] if [region] or [ring] is full. *)
+
+  val chunk : read -> Region.chunk
+  (** [chunk r] is the chunk containing the result of the winning read.
+      Once [r]'s completion has been reported, the caller owns this chunk and must free it.
+      @raise Invalid_argument if [r] is still in progress. *)
+
+  val winner : read -> [`Pending | `Primary | `Secondary]
+  (** [winner r] is the source whose result was reported, or [`Pending] if [r] is still in progress. *)
+
+  val delay : t -> float
+  (** [delay t] is how long new reads will wait before hedging. *)
+
+  val latency : t -> Histogram.t
+  (** [latency t] is the distribution of the times taken by successful reads
+      (including any that lost the race). *)
+
+  type stats = {
+    reads : int;                (** Reads started *)
+    hedged : int;               (** Reads that were also sent to the secondary *)
+    secondary_wins : int;       (** Reads where the secondary's result was reported *)
+  }
+
+  val stats : t -> stats
+end
+
+val write_fixed : ?sqe_flags:Sqe_flags.t -> ?rw_flags:Rw_flags.t -> ?ioprio:Ioprio.t -> 'a t -> file_offset:offset -> Unix.file_descr -> off:int -> len:int -> 'a -> 'a job option
 (** [write t ~file_offset fd off d] will submit a [write(2)] request to uring [t].
     It writes up to [len] bytes into absolute [file_offset] on the [fd] file descriptor
     from the fixed memory buffer associated with uring [t] at offset [off].
     The user data [d] will be returned by {!wait} or {!peek} upon completion. *)
 
-val write_chunk : ?len:int -> 'a t -> file_offset:offset -> Unix.file_descr -> Region.chunk -> 'a -> 'a job option
+val write_chunk : ?sqe_flags:Sqe_flags.t -> ?rw_flags:Rw_flags.t -> ?ioprio:Ioprio.t -> ?len:int -> 'a t -> file_offset:offset -> Unix.file_descr -> Region.chunk -> 'a -> 'a job option
 (** [write_chunk] is like [write_fixed], but gets the offset from [chunk].
     @param len Restrict the write to the first [len] bytes of [chunk]. *)
 
-val splice : 'a t -> src:Unix.file_descr -> dst:Unix.file_descr -> len:int -> 'a -> 'a job option
+(** Prepared requests, for loops that repeat the same operation.
+
+    A template holds a complete submission queue entry, built and checked once.
+    Submitting it just copies the entry into the ring with a new file offset and user data,
+    which is cheaper than {!read_chunk} or {!write_chunk} and allocates nothing apart from
+    the ring's own record of the job. *)
+module Template : sig
+  type 'a ring := 'a t
+
+  type 'a t
+  (** A template for requests on an ['a ring]. *)
+
+  val read_chunk : ?sqe_flags:Sqe_flags.t -> ?rw_flags:Rw_flags.t -> ?ioprio:Ioprio.t -> ?len:int -> 'a ring -> Unix.file_descr -> Region.chunk -> 'a t
+  (** [read_chunk ring fd chunk] is a template for {!Uring.read_chunk} requests with these arguments.
+      The flags and priority are fixed when the template is made.
+      The template doesn't own [chunk], so the caller must make sure that
+      only one request using it is in progress at a time. *)
+
+  val write_chunk : ?sqe_flags:Sqe_flags.t -> ?rw_flags:Rw_flags.t -> ?ioprio:Ioprio.t -> ?len:int -> 'a ring -> Unix.file_descr -> Region.chunk -> 'a t
+  (** [write_chunk ring fd chunk] is a template for {!Uring.write_chunk} requests. *)
+
+  val submit : 'a t -> file_offset:offset -> 'a -> 'a job option
+  (** [submit t ~file_offset d] queues a request made from [t], at [file_offset] and with user data [d].
+      Returns [None] if the ring is full (or over its limits).
+      @raise Invalid_argument if the ring's fixed buffer has been replaced since [t] was made. *)
+end
+
+val fsync : ?sqe_flags:Sqe_flags.t -> ?datasync:bool -> 'a t -> Unix.file_descr -> 'a -> 'a job option
+(** [fsync t fd d] will submit an [fsync(2)] request to uring [t].
+    Use [~sqe_flags:Sqe_flags.io_drain] to make it wait for previously submitted writes.
+    Note that Linux does not support setting an I/O priority for fsync requests.
+    @param datasync Use [fdatasync(2)] instead. *)
+
+val splice : ?sqe_flags:Sqe_flags.t -> 'a t -> src:Unix.file_descr -> dst:Unix.file_descr -> len:int -> 'a -> 'a job option
 (** [splice t ~src ~dst ~len d] will submit a request to copy [len] bytes from [src] to [dst].
     The operation returns the number of bytes transferred, or 0 for end-of-input.
     The result is [EINVAL] if the file descriptors don't support splicing. *)
 
-val connect : 'a t -> Unix.file_descr -> Unix.sockaddr -> 'a -> 'a job option
+val connect : ?sqe_flags:Sqe_flags.t -> 'a t -> Unix.file_descr -> Unix.sockaddr -> 'a -> 'a job option
 (** [connect t fd addr d] will submit a request to connect [fd] to [addr]. *)
 
 (** Holder for the peer's address in {!accept}. *)
@@ -197,12 +678,36 @@ module Sockaddr : sig
   val get : t -> Unix.sockaddr
 end
 
-val accept : 'a t -> Unix.file_descr -> Sockaddr.t -> 'a -> 'a job option
+val accept : ?sqe_flags:Sqe_flags.t -> 'a t -> Unix.file_descr -> Sockaddr.t -> 'a -> 'a job option
 (** [accept t fd addr d] will submit a request to accept a new connection on [fd].
     The new FD will be configured with [SOCK_CLOEXEC].
     The remote address will be stored in [addr]. *)
 
-val close : 'a t -> Unix.file_descr -> 'a -> 'a job option
+val close : ?sqe_flags:Sqe_flags.t -> 'a t -> Unix.file_descr -> 'a -> 'a job option
+
+val shutdown : ?sqe_flags:Sqe_flags.t -> 'a t -> Unix.file_descr -> Unix.shutdown_command -> 'a -> 'a job option
+(** [shutdown t fd cmd d] will submit a [shutdown(2)] request to uring [t]. *)
+
+val teardown : ?drain:Cstruct.t -> ?timeout:float -> 'a t -> Unix.file_descr -> 'a -> 'a job option
+(** [teardown t fd d] closes the connection [fd] gracefully, without blocking.
+
+    It queues [shutdown(fd, SHUT_WR)], an optional [recv] and then [close(fd)]
+    as a chain of hard-linked requests, so [fd] is closed even if the earlier steps fail.
+    Only the close is reported, with user data [d] and the result of the [close(2)].
+    Returns [None] if the ring doesn't have space for the whole chain.
+    The intermediate steps still use completion queue entries while they run.
+
+    @param drain If given, do one [recv] into [drain] before closing, giving the peer a chance
+                 to finish sending and see our end-of-file first.
+                 This is a single read, not a loop until end-of-file, so if the peer sends more
+                 than fits in [drain] it may still see a reset.
+    @param timeout Stop waiting for the [drain] read after this many seconds (default [5.0]).
+                   With [infinity], a peer that never sends or closes keeps [fd] open, and
+                   the job active, forever. *)
+
+val timeout : 'a t -> float -> 'a -> 'a job option
+(** [timeout t delay d] submits a timer that completes with [-ETIME] after [delay] seconds,
+    or with [-ECANCELED] if it is cancelled first. *)
 
 val cancel : 'a t -> 'a job -> 'a -> 'a job option
 (** [cancel t job d] submits a request to cancel [job].
@@ -210,6 +715,26 @@ val cancel : 'a t -> 'a job -> 'a -> 'a job option
     if [job] had already completed by the time the kernel processed the cancellation request.
     @raise Invalid_argument if the job has already been returned by e.g. {!wait}. *)
 
+val on_complete : 'a t -> 'a job -> (int -> unit) -> unit
+(** [on_complete t job fn] arranges for [fn result] to be called when [job] finishes,
+    just before its completion is returned by {!wait} or {!peek}.
+    For a multishot job, this is its last completion.
+    @raise Invalid_argument if the job has already been returned by e.g. {!wait}. *)
+
+val cancel_fd : 'a t -> Unix.file_descr -> 'a -> int option
+(** [cancel_fd t fd d] submits requests to cancel every active job on [t] that is operating on [fd]
+    (for {!splice}, this is the source FD).
+
+    Each cancelled job still returns its own completion as usual.
+    Once they have all completed, {!wait} or {!peek} will return user data [d],
+    with the number of jobs affected as the result.
+
+    Returns [Some n] if [n] jobs are being cancelled,
+    or [None] if the submission queue doesn't have space for all the cancellation requests. *)
+
+val cancel_all : 'a t -> 'a -> int option
+(** [cancel_all t d] is like {!cancel_fd}, but cancels every active job on [t]. *)
+
 module Msghdr : sig
   type t
 
@@ -221,17 +746,69 @@ module Msghdr : sig
       @param n_fds Reserve space to receive this many FDs (default 0) *)
 
   val get_fds : t -> Unix.file_descr list
+  (** [get_fds t] is the list of FDs received in [t]. *)
+
+  val get_fds_array : t -> Unix.file_descr array
+  (** [get_fds_array t] is like {!get_fds}, but returns an array.
+      This avoids building a list when receiving many FDs per message. *)
+
+  val set_fds : t -> Unix.file_descr array -> unit
+  (** [set_fds t fds] sets the FDs to be sent with [t], using the space reserved by [create ~n_fds].
+      This allows a single [t] to be reused with {!send_msghdr} without re-encoding the whole message.
+      [t] must not be in use by a job when this is called.
+      @raise Invalid_argument if [fds] has more than [n_fds] elements. *)
 end 
 
-val send_msg : ?fds:Unix.file_descr list -> ?dst:Unix.sockaddr -> 'a t -> Unix.file_descr -> Cstruct.t list -> 'a -> 'a job option
+val send_msg : ?sqe_flags:Sqe_flags.t -> ?fds:Unix.file_descr list -> ?dst:Unix.sockaddr -> 'a t -> Unix.file_descr -> Cstruct.t list -> 'a -> 'a job option
 (** [send_msg t fd buffs d] will submit a [sendmsg(2)] request. The [Msghdr] will be constructed
     from the FDs ([fds]), address ([dst]) and buffers ([buffs]).
     @param dst Destination address.
     @param fds Extra file descriptors to attach to the message. *)
 
-val recv_msg : 'a t -> Unix.file_descr -> Msghdr.t -> 'a -> 'a job option
+val send_msghdr : ?sqe_flags:Sqe_flags.t -> 'a t -> Unix.file_descr -> Msghdr.t -> 'a -> 'a job option
+(** [send_msghdr t fd msghdr d] will submit a [sendmsg(2)] request using an existing [msghdr].
+    Use {!Msghdr.set_fds} to attach FDs to it. *)
+
+val recv_msg : ?sqe_flags:Sqe_flags.t -> 'a t -> Unix.file_descr -> Msghdr.t -> 'a -> 'a job option
 (** [recv_msg t fd msghdr d] will submit a [recvmsg(2)] request. If the request is 
-    successful then the [msghdr] will contain the sender address and the data received. *)
+    successful then the [msghdr] will contain the sender address and the data received.
+    [msghdr] can be reused for further requests once this one has completed. *)
+
+(** {2 Trying synchronous operations first}
+
+    When the data is already available (in the page cache or a socket's receive buffer),
+    reading it directly is much cheaper than going through the ring. These functions first
+    try the operation inline without blocking, and only submit a request if that fails. *)
+
+val try_readv :
+  ?sqe_flags:Sqe_flags.t -> ?rw_flags:Rw_flags.t -> ?ioprio:Ioprio.t ->
+  'a t -> file_offset:offset -> Unix.file_descr -> Cstruct.t list -> 'a ->
+  [ `Done of int | `Submitted of 'a job | `Full ]
+(** [try_readv t ~file_offset fd buffers d] tries to fill [buffers] using [preadv2(RWF_NOWAIT)].
+    If that succeeds, or fails with anything other than [EAGAIN], it returns [`Done r]
+    and [d] will not be returned by {!wait}. As with a completion, [r] is the number of bytes read
+    (which may be less than requested, e.g. at end-of-file or if only part of the data was cached)
+    or a negative error code.
+    If the read would block, it submits a {!readv} request instead, returning [`Submitted job] or,
+    if the ring is full, [`Full].
+    If the filesystem doesn't support [RWF_NOWAIT] ([EOPNOTSUPP]), the request is submitted too,
+    and later calls for the same [fd] on [t] go straight to the ring. *)
+
+val try_recv_msg :
+  ?sqe_flags:Sqe_flags.t ->
+  'a t -> Unix.file_descr -> Msghdr.t -> 'a ->
+  [ `Done of int | `Submitted of 'a job | `Full ]
+(** [try_recv_msg t fd msghdr d] is like {!try_readv}, but for {!recv_msg}.
+    It tries [recvmsg(MSG_DONTWAIT)] first, returning [`Done n] if it received [n] bytes
+    (0 for end-of-file), or [`Done (-e)] if it failed with error [e] other than [EAGAIN]. *)
+
+type try_stats = {
+  inline : int;         (** Operations that completed without using the ring *)
+  fallback : int;       (** Operations that had to be submitted (not counting [`Full]) *)
+}
+
+val try_stats : 'a t -> try_stats
+(** [try_stats t] counts the results of the [try_*] functions on [t]. *)
 
 (** {2 Submitting operations} *)
 
@@ -240,6 +817,25 @@ val submit : 'a t -> int
     to the kernel. Their results can subsequently be retrieved using {!wait}
     or {!peek}. *)
 
+val set_auto_flush : ?max_pending:int -> ?fill:float -> ?delay:float -> 'a t -> unit
+(** [set_auto_flush t] makes [t] call {!submit} automatically, so that several requests
+    can be submitted with one system call without the application having to decide when.
+
+    When a request is queued, [t] submits if any of these is true:
+
+    - at least [max_pending] requests are waiting to be submitted;
+    - the waiting requests fill at least the fraction [fill] of the queue depth (default [1.0]);
+    - at least [delay] seconds have passed since the oldest waiting request was queued.
+
+    The delay is also checked by {!peek}, and {!wait} always submits before blocking.
+    By default, there is no limit on [max_pending] or [delay].
+    Automatic submission never splits a chain: while the last request queued has
+    {!Sqe_flags.io_link} set, it waits for the request that follows it.
+    However, {!submit} and {!wait} submit everything queued, including an unfinished chain. *)
+
+val clear_auto_flush : 'a t -> unit
+(** [clear_auto_flush t] turns off automatic submission (the default). *)
+
 type 'a completion_option =
   | None
   | Some of { result: int; data: 'a } (**)
@@ -251,11 +847,103 @@ type 'a completion_option =
 val wait : ?timeout:float -> 'a t -> 'a completion_option
 (** [wait ?timeout t] will block indefinitely (the default) or for [timeout]
     seconds for any outstanding events to complete on uring [t]. Events should
-    have been queued via {!submit} previously to this call. *)
+    have been queued via {!submit} previously to this call.
+    It may also return [None] early if the only event was internal (e.g. the losing half of a {!Hedge.read}). *)
 
 val peek : 'a t -> 'a completion_option
 (** [peek t] looks for completed requests on the uring [t] without blocking. *)
 
+type ring = Ring : 'a t -> ring
+(** A ring of any type, for {!wait_any}. *)
+
+val wait_any : ?timeout:float -> ring list -> ring list
+(** [wait_any rings] submits any outstanding requests on each of [rings] and then
+    blocks until at least one of them has a completion waiting.
+    It returns the rings with completions, which can then be collected with {!peek}.
+
+    This allows one thread to serve several rings (e.g. one for storage and one with
+    a different queue depth or polling mode for networking) without busy-polling.
+
+    Returns an empty list if [timeout] seconds pass first, or if interrupted by a signal.
+    Occasionally, {!peek} may find nothing on a returned ring
+    (e.g. if the completion was for an internal request). *)
+
+(** A simple event loop, where each request's user data is the function to call with its result.
+
+    {[
+      let loop = Uring.Loop.create (Uring.create ~queue_depth:64 ()) in
+      let ring = Uring.Loop.ring loop in
+      ignore (Uring.readv ring fd [buf] ~file_offset (fun result -> ...));
+      ignore (Uring.Loop.after loop 1.0 (fun () -> ...));
+      Uring.Loop.run loop
+    ]}
+
+    Callbacks may submit more requests and add or cancel timers.
+    Completions are collected and dispatched in batches, without allocating a
+    {!completion_option} for each one. The ring's auto-flush policy (see {!set_auto_flush})
+    is applied on each iteration, and everything is submitted before the loop sleeps.
+    Timers are kept by the loop rather than the kernel, so they don't use ring slots. *)
+module Loop : sig
+  type 'a ring := 'a t
+
+  type callback = int -> unit
+
+  type t
+
+  type timer
+
+  val create : ?clock:(unit -> float) -> ?max_batch:int -> callback ring -> t
+  (** [create ring] is a loop that dispatches [ring]'s completions.
+      Once the loop is in use, completions should not be collected from [ring] by other means.
+      @param max_batch Dispatch at most this many completions before checking timers again (default 64).
+      @param clock The time source for timers (default: [Unix.gettimeofday]). *)
+
+  val ring : t -> callback ring
+  (** [ring t] is the ring passed to {!create}. *)
+
+  val after : t -> float -> (unit -> unit) -> timer
+  (** [after t delay fn] arranges for [fn ()] to be called once, [delay] seconds from now. *)
+
+  val cancel_timer : t -> timer -> unit
+  (** [cancel_timer t timer] stops [timer] from firing. Does nothing if it has already fired or been cancelled. *)
+
+  val run_once : ?block:bool -> t -> int
+  (** [run_once t] runs any due timers and the callbacks of waiting completions.
+      If there were none, it submits all requests and waits until a completion arrives or a timer
+      is due, and then runs those. It returns the number of callbacks and timers run
+      (which may be 0, e.g. if interrupted by a signal, or if [t] is idle).
+      @param block If [false], submit any queued requests and return immediately
+                   rather than waiting (default [true]). *)
+
+  val run : t -> unit
+  (** [run t] calls {!run_once} until [t] is idle (no requests in progress and no pending timers)
+      or {!stop} is called. Exceptions from callbacks are passed on to the caller. *)
+
+  val stop : t -> unit
+  (** [stop t] makes {!run} return after the current iteration.
+      If called from a callback, the current {!run_once} also won't block.
+      Later calls to {!run_once} or {!run} are not affected. *)
+
+  val is_idle : t -> bool
+  (** [is_idle t] is [true] if there are no requests in progress and no pending timers. *)
+end
+
+type cq_stats = {
+  overflows : int;      (** Number of times {!wait} or {!peek} found the completion queue had overflowed *)
+  lost : int;           (** Completions discarded by the kernel *)
+}
+
+val cq_stats : 'a t -> cq_stats
+(** [cq_stats t] reports problems with [t]'s completion queue.
+
+    If completions arrive faster than they are collected, the kernel's completion queue
+    fills up. Kernels with [IORING_FEAT_NODROP] (Linux 5.5+) keep the extra completions
+    and {!wait} and {!peek} move them back into the queue as space becomes available.
+    Older kernels discard them: the requests they belong to will never complete.
+    Such requests don't prevent {!exit}, which also stops waiting for them when draining,
+    but their slots in the ring are never freed, so it will eventually fill up.
+    See [?cq_headroom] in {!set_limits} to avoid this. *)
+
 val error_of_errno : int -> Unix.error
 (** [error_of_errno e] converts the error code [abs e] to a Unix error type. *)
 
@@ -30,8 +30,16 @@
 #include <sys/socket.h>
 #include <errno.h>
 #include <string.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <poll.h>
 #include <sys/uio.h>
+#include <sys/syscall.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "fallback.h"
 
 #undef URING_DEBUG
 #ifdef URING_DEBUG
@@ -47,7 +55,18 @@
 #define Int63_val(v) (Int64_val(v)) >> 1
 #endif
 
-#define Ring_val(v) *((struct io_uring**)Data_custom_val(v))
+// The contents of a ring's custom block.
+struct ring_block {
+  struct io_uring *ring;
+  struct io_uring_sqe *last_sqe;  // The SQE most recently returned by [get_sqe]
+};
+
+#define Ring_block_val(v) ((struct ring_block*)Data_custom_val(v))
+#define Ring_val(v) (Ring_block_val(v)->ring)
+
+// SQEs tagged with this are internal to the library (e.g. the intermediate steps of a linked chain).
+// Their completions are consumed by the stubs and never reported to OCaml.
+#define IGNORED_USER_DATA ((void *) -1)
 
 // Note that this does not free the ring data. You must not allow this to be
 // GC'd until the ring has been released by calling ocaml_uring_exit.
@@ -67,8 +86,9 @@ value ocaml_uring_setup(value entries, value polling_timeout) {
   CAMLlocal1(v_uring);
   struct io_uring_params params;
 
-  v_uring = caml_alloc_custom_mem(&ring_ops, sizeof(struct io_uring*), sizeof(struct io_uring));
+  v_uring = caml_alloc_custom_mem(&ring_ops, sizeof(struct ring_block), sizeof(struct io_uring));
   Ring_val(v_uring) = NULL;
+  Ring_block_val(v_uring)->last_sqe = NULL;
 
   // On OOM, this raises. [v_uring] will be freed by the GC.
   struct io_uring* ring = (struct io_uring*)caml_stat_alloc(sizeof(struct io_uring));
@@ -82,6 +102,10 @@ value ocaml_uring_setup(value entries, value polling_timeout) {
   int status = io_uring_queue_init_params(Long_val(entries), ring, &params);
 
   if (status == 0) {
+    // Don't let forked children share (and copy-on-write) the ring's mappings.
+    // This is only an optimisation, so errors are ignored.
+    int ret = io_uring_ring_dontfork(ring);
+    if (ret < 0) dprintf("uring %p: io_uring_ring_dontfork: %s\n", ring, strerror(-ret));
     CAMLreturn(v_uring);
   } else {
     caml_stat_free(ring);
@@ -90,6 +114,20 @@ value ocaml_uring_setup(value entries, value polling_timeout) {
   }
 }
 
+// Like [ocaml_uring_setup], but runs the requests on [threads] system threads instead.
+value ocaml_uring_setup_threads(value entries, value threads) {
+  CAMLparam2(entries, threads);
+  CAMLlocal1(v_uring);
+  v_uring = caml_alloc_custom_mem(&ring_ops, sizeof(struct ring_block), sizeof(struct io_uring));
+  Ring_val(v_uring) = NULL;
+  Ring_block_val(v_uring)->last_sqe = NULL;
+  struct io_uring *ring = fallback_init(Long_val(entries), Int_val(threads));
+  if (!ring)
+    unix_error(errno, "fallback_init", Nothing);
+  Ring_val(v_uring) = ring;
+  CAMLreturn(v_uring);
+}
+
 // Note that the ring must be idle when calling this.
 value ocaml_uring_register_ba(value v_uring, value v_ba) {
   CAMLparam2(v_uring, v_ba);
@@ -98,6 +136,7 @@ value ocaml_uring_register_ba(value v_uring, value v_ba) {
   iov[0].iov_base = Caml_ba_data_val(v_ba);
   iov[0].iov_len = Caml_ba_array_val(v_ba)->dim[0];
   dprintf("uring %p: registering iobuf base %p len %lu\n", ring, iov[0].iov_base, iov[0].iov_len);
+  if (Is_fallback(ring)) CAMLreturn(Val_unit);    // Fixed buffers are ordinary memory for threads
   int ret = io_uring_register_buffers(ring, iov, 1);
   if (ret)
     unix_error(-ret, "io_uring_register_buffers", Nothing);
@@ -109,12 +148,27 @@ value ocaml_uring_unregister_buffers(value v_uring) {
   CAMLparam1(v_uring);
   struct io_uring *ring = Ring_val(v_uring);
   dprintf("uring %p: unregistering buffers");
+  if (Is_fallback(ring)) CAMLreturn(Val_unit);
   int ret = io_uring_unregister_buffers(ring);
   if (ret)
     unix_error(-ret, "io_uring_register_buffers", Nothing);
   CAMLreturn(Val_unit);
 }
 
+// Set whether [v_ba] is inherited by child processes.
+// Only whole pages within the buffer are affected, as the partial pages at either end
+// may be shared with other allocations.
+value ocaml_uring_ba_dontfork(value v_ba, value v_dontfork) {
+  uintptr_t page = sysconf(_SC_PAGESIZE);
+  uintptr_t start = (uintptr_t) Caml_ba_data_val(v_ba);
+  uintptr_t end = start + Caml_ba_array_val(v_ba)->dim[0];
+  start = (start + page - 1) & ~(page - 1);
+  end &= ~(page - 1);
+  if (end > start && madvise((void *) start, end - start, Bool_val(v_dontfork) ? MADV_DONTFORK : MADV_DOFORK))
+    uerror("madvise", Nothing);
+  return Val_unit;
+}
+
 #define Iovec_val(v) (*((struct iovec **) Data_custom_val(v)))
 
 static void finalize_iovec(value v) {
@@ -164,7 +218,10 @@ value ocaml_uring_exit(value v_uring) {
   CAMLparam1(v_uring);
   struct io_uring *ring = Ring_val(v_uring);
   dprintf("uring %p: exit\n", ring);
-  if (ring) {
+  if (ring && Is_fallback(ring)) {
+    fallback_exit(ring);
+    Ring_val(v_uring) = NULL;
+  } else if (ring) {
     io_uring_queue_exit(ring);
     caml_stat_free(ring);
     Ring_val(v_uring) = NULL;
@@ -173,11 +230,47 @@ value ocaml_uring_exit(value v_uring) {
   CAMLreturn(Val_unit);
 }
 
+// Like io_uring_get_sqe, but remembers the SQE so that [last_sqe] can find it.
+static struct io_uring_sqe *get_sqe(value v_uring) {
+  struct io_uring_sqe *sqe = io_uring_get_sqe(Ring_val(v_uring));
+  if (sqe) Ring_block_val(v_uring)->last_sqe = sqe;
+  return sqe;
+}
+
+// The SQE most recently returned by [get_sqe].
+// Only valid immediately after a successful ocaml_uring_submit_* call, before submitting.
+static struct io_uring_sqe *last_sqe(value v_uring) {
+  return Ring_block_val(v_uring)->last_sqe;
+}
+
+// Noalloc
+value
+ocaml_uring_set_sqe_flags(value v_uring, value v_flags) {
+  struct io_uring_sqe *sqe = last_sqe(v_uring);
+  sqe->flags |= Int_val(v_flags);
+  return Val_unit;
+}
+
+// Noalloc
+value
+ocaml_uring_set_rw_flags(value v_uring, value v_flags) {
+  struct io_uring_sqe *sqe = last_sqe(v_uring);
+  sqe->rw_flags = Int_val(v_flags);
+  return Val_unit;
+}
+
+// Noalloc
+value
+ocaml_uring_set_ioprio(value v_uring, value v_ioprio) {
+  struct io_uring_sqe *sqe = last_sqe(v_uring);
+  sqe->ioprio = Int_val(v_ioprio);
+  return Val_unit;
+}
+
 value
 ocaml_uring_submit_nop(value v_uring, value v_id) {
   CAMLparam1(v_uring);
-  struct io_uring *ring = Ring_val(v_uring);
-  struct io_uring_sqe *sqe = io_uring_get_sqe(ring);
+  struct io_uring_sqe *sqe = get_sqe(v_uring);
   if (!sqe) CAMLreturn(Val_false);
   io_uring_prep_nop(sqe);
   io_uring_sqe_set_data(sqe, (void *)Long_val(v_id));
@@ -231,8 +324,7 @@ ocaml_uring_make_open_how(value v_flags, value v_mode, value v_resolve, value v_
 value
 ocaml_uring_submit_openat2(value v_uring, value v_id, value v_fd, value v_open_how) {
   CAMLparam2(v_uring, v_open_how);
-  struct io_uring *ring = Ring_val(v_uring);
-  struct io_uring_sqe *sqe = io_uring_get_sqe(ring);
+  struct io_uring_sqe *sqe = get_sqe(v_uring);
   if (!sqe) CAMLreturn(Val_false);
   struct open_how_data *data = Open_how_val(v_open_how);
   io_uring_prep_openat2(sqe, Int_val(v_fd), data->path, &data->how);
@@ -243,8 +335,7 @@ ocaml_uring_submit_openat2(value v_uring, value v_id, value v_fd, value v_open_h
 value
 ocaml_uring_submit_close(value v_uring, value v_fd, value v_id) {
   CAMLparam1(v_uring);
-  struct io_uring *ring = Ring_val(v_uring);
-  struct io_uring_sqe *sqe = io_uring_get_sqe(ring);
+  struct io_uring_sqe *sqe = get_sqe(v_uring);
   if (!sqe) CAMLreturn(Val_false);
   dprintf("submit_close: fd:%d\n", Int_val(v_fd));
   io_uring_prep_close(sqe, Int_val(v_fd));
@@ -252,12 +343,22 @@ ocaml_uring_submit_close(value v_uring, value v_fd, value v_id) {
   CAMLreturn(Val_true);
 }
 
+value
+ocaml_uring_submit_fsync(value v_uring, value v_id, value v_fd, value v_datasync) {
+  CAMLparam1(v_uring);
+  struct io_uring_sqe *sqe = get_sqe(v_uring);
+  if (!sqe) CAMLreturn(Val_false);
+  dprintf("submit_fsync: fd:%d datasync:%d\n", Int_val(v_fd), Bool_val(v_datasync));
+  io_uring_prep_fsync(sqe, Int_val(v_fd), Bool_val(v_datasync) ? IORING_FSYNC_DATASYNC : 0);
+  io_uring_sqe_set_data(sqe, (void *)Long_val(v_id));
+  CAMLreturn(Val_true);
+}
+
 value
 ocaml_uring_submit_poll_add(value v_uring, value v_fd, value v_id, value v_poll_mask) {
   CAMLparam1(v_uring);
   int poll_mask = Int_val(v_poll_mask);
-  struct io_uring *ring = Ring_val(v_uring);
-  struct io_uring_sqe *sqe = io_uring_get_sqe(ring);
+  struct io_uring_sqe *sqe = get_sqe(v_uring);
   if (!sqe) CAMLreturn(Val_false);
   dprintf("submit_poll_add: fd:%d mask:%x\n", Int_val(v_fd), poll_mask);
   io_uring_prep_poll_add(sqe, Int_val(v_fd), poll_mask);
@@ -265,14 +366,25 @@ ocaml_uring_submit_poll_add(value v_uring, value v_fd, value v_id, value v_poll_
   CAMLreturn(Val_true);
 }
 
+value
+ocaml_uring_submit_poll_multishot(value v_uring, value v_fd, value v_id, value v_poll_mask) {
+  CAMLparam1(v_uring);
+  int poll_mask = Int_val(v_poll_mask);
+  struct io_uring_sqe *sqe = get_sqe(v_uring);
+  if (!sqe) CAMLreturn(Val_false);
+  dprintf("submit_poll_multishot: fd:%d mask:%x\n", Int_val(v_fd), poll_mask);
+  io_uring_prep_poll_multishot(sqe, Int_val(v_fd), poll_mask);
+  io_uring_sqe_set_data(sqe, (void *)Long_val(v_id));
+  CAMLreturn(Val_true);
+}
+
 // Caller must ensure v_iov is not GC'd until the job is finished.
 value
 ocaml_uring_submit_readv(value v_uring, value v_fd, value v_id, value v_iov, value v_off) {
   CAMLparam2(v_uring, v_iov);
-  struct io_uring *ring = Ring_val(v_uring);
   struct iovec *iovs = Iovec_val(Field(v_iov, 0));
   int len = Int_val(Field(v_iov, 1));
-  struct io_uring_sqe *sqe = io_uring_get_sqe(ring);
+  struct io_uring_sqe *sqe = get_sqe(v_uring);
   if (!sqe) CAMLreturn(Val_false);
   dprintf("submit_readv: %d ents len[0] %lu off %d\n", len, iovs[0].iov_len, Int63_val(v_off));
   io_uring_prep_readv(sqe, Int_val(v_fd), iovs, len, Int63_val(v_off));
@@ -284,10 +396,9 @@ ocaml_uring_submit_readv(value v_uring, value v_fd, value v_id, value v_iov, val
 value
 ocaml_uring_submit_writev(value v_uring, value v_fd, value v_id, value v_iov, value v_off) {
   CAMLparam2(v_uring, v_iov);
-  struct io_uring *ring = Ring_val(v_uring);
   struct iovec *iovs = Iovec_val(Field(v_iov, 0));
   int len = Int_val(Field(v_iov, 1));
-  struct io_uring_sqe *sqe = io_uring_get_sqe(ring);
+  struct io_uring_sqe *sqe = get_sqe(v_uring);
   if (!sqe) CAMLreturn(Val_false);
   dprintf("submit_writev: %d ents len[0] %lu off %d\n", len, iovs[0].iov_len, Int63_val(v_off));
   io_uring_prep_writev(sqe, Int_val(v_fd), iovs, len, Int63_val(v_off));
@@ -298,8 +409,7 @@ ocaml_uring_submit_writev(value v_uring, value v_fd, value v_id, value v_iov, va
 // Caller must ensure the buffers are not released until this job completes.
 value
 ocaml_uring_submit_readv_fixed_native(value v_uring, value v_fd, value v_id, value v_ba, value v_off, value v_len, value v_fileoff) {
-  struct io_uring *ring = Ring_val(v_uring);
-  struct io_uring_sqe *sqe = io_uring_get_sqe(ring);
+  struct io_uring_sqe *sqe = get_sqe(v_uring);
   void *buf = Caml_ba_data_val(v_ba) + Long_val(v_off);
   if (!sqe) return Val_false;
   dprintf("submit_readv_fixed: buf %p off %d len %d fileoff %d", buf, Int_val(v_off), Int_val(v_len), Int63_val(v_fileoff));
@@ -323,8 +433,7 @@ ocaml_uring_submit_readv_fixed_byte(value* values, int argc) {
 // Caller must ensure the buffers are not released until this job completes.
 value
 ocaml_uring_submit_writev_fixed_native(value v_uring, value v_fd, value v_id, value v_ba, value v_off, value v_len, value v_fileoff) {
-  struct io_uring *ring = Ring_val(v_uring);
-  struct io_uring_sqe *sqe = io_uring_get_sqe(ring);
+  struct io_uring_sqe *sqe = get_sqe(v_uring);
   void *buf = Caml_ba_data_val(v_ba) + Long_val(v_off);
   if (!sqe)
     return Val_false;
@@ -346,11 +455,71 @@ ocaml_uring_submit_writev_fixed_byte(value* values, int argc) {
 			  values[6]);
 }
 
+// A prepared SQE, copied into the ring by ocaml_uring_submit_template.
+// It is stored inline in the custom block, as it has no pointers to OCaml values
+// (the caller must keep the buffer alive).
+#define Sqe_template_val(v) ((struct io_uring_sqe *) Data_custom_val(v))
+
+static struct custom_operations sqe_template_ops = {
+  "uring.sqe_template",
+  custom_finalize_default,
+  custom_compare_default,
+  custom_hash_default,
+  custom_serialize_default,
+  custom_deserialize_default,
+  custom_compare_ext_default,
+  custom_fixed_length_default
+};
+
+value
+ocaml_uring_make_rw_template_native(value v_write, value v_fd, value v_ba, value v_off, value v_len,
+                                    value v_sqe_flags, value v_rw_flags, value v_ioprio) {
+  CAMLparam1(v_ba);
+  CAMLlocal1(v);
+  struct io_uring_sqe *sqe;
+  void *buf = Caml_ba_data_val(v_ba) + Long_val(v_off);
+  v = caml_alloc_custom_mem(&sqe_template_ops, sizeof(struct io_uring_sqe), sizeof(struct io_uring_sqe));
+  sqe = Sqe_template_val(v);
+  memset(sqe, 0, sizeof(*sqe));
+  if (Bool_val(v_write))
+    io_uring_prep_write_fixed(sqe, Int_val(v_fd), buf, Int_val(v_len), 0, 0);
+  else
+    io_uring_prep_read_fixed(sqe, Int_val(v_fd), buf, Int_val(v_len), 0, 0);
+  sqe->flags = Int_val(v_sqe_flags);
+  sqe->rw_flags = Int_val(v_rw_flags);
+  sqe->ioprio = Int_val(v_ioprio);
+  CAMLreturn(v);
+}
+
+value
+ocaml_uring_make_rw_template_byte(value* values, int argc) {
+  return ocaml_uring_make_rw_template_native(
+			  values[0],
+			  values[1],
+			  values[2],
+			  values[3],
+			  values[4],
+			  values[5],
+			  values[6],
+			  values[7]);
+}
+
+// Queue a copy of [v_template] with the given file offset and user data.
+// Noalloc
+value
+ocaml_uring_submit_template(value v_uring, value v_id, value v_template, value v_fileoff) {
+  struct io_uring_sqe *sqe = get_sqe(v_uring);
+  if (!sqe) return Val_false;
+  memcpy(sqe, Sqe_template_val(v_template), sizeof(*sqe));
+  sqe->off = Int63_val(v_fileoff);
+  io_uring_sqe_set_data(sqe, (void *)Long_val(v_id));
+  return Val_true;
+}
+
 value
 ocaml_uring_submit_splice(value v_uring, value v_id, value v_fd_in, value v_fd_out, value v_nbytes) {
   CAMLparam1(v_uring);
-  struct io_uring *ring = Ring_val(v_uring);
-  struct io_uring_sqe *sqe = io_uring_get_sqe(ring);
+  struct io_uring_sqe *sqe = get_sqe(v_uring);
   if (!sqe) CAMLreturn(Val_false);
   io_uring_prep_splice(sqe,
 		       Int_val(v_fd_in), (int64_t) -1,
@@ -426,9 +595,23 @@ static struct custom_operations msghdr_ops = {
 
 struct msghdr_with_cmsg {
   struct msghdr msg;
+  int n_fds;			/* Number of FD slots reserved after [cmsg] */
   struct cmsghdr cmsg;
 };
 
+#define Msghdr_n_fds(msg) (((struct msghdr_with_cmsg *) (msg))->n_fds)
+
+static void msghdr_reset_control(struct msghdr *msg) {
+  int n_fds = Msghdr_n_fds(msg);
+  if (n_fds > 0) {
+    msg->msg_control = &(((struct msghdr_with_cmsg *) msg)->cmsg);
+    msg->msg_controllen = CMSG_SPACE(sizeof(int) * n_fds);
+  } else {
+    msg->msg_control = NULL;
+    msg->msg_controllen = 0;
+  }
+}
+
 // v_sockaddr and v_iov must not be freed before the msghdr as it contains pointers to them
 value
 ocaml_uring_make_msghdr(value v_n_fds, value v_fds, value v_sockaddr_opt, value v_iov) {
@@ -439,7 +622,7 @@ ocaml_uring_make_msghdr(value v_n_fds, value v_fds, value v_sockaddr_opt, value
   int iovs_len = Int_val(Field(v_iov, 1));
   int n_fds = Int_val(v_n_fds);
   int cmsg_offset, controllen, total_size;
-  cmsg_offset = sizeof(struct msghdr_with_cmsg) - sizeof(struct cmsghdr);
+  cmsg_offset = offsetof(struct msghdr_with_cmsg, cmsg);
   controllen = n_fds > 0 ? CMSG_SPACE(sizeof(int) * n_fds) : 0;
   total_size = cmsg_offset + controllen;
   //dprintf("using %d bytes to hold %d FDs\n", total_size, n_fds);
@@ -450,6 +633,7 @@ ocaml_uring_make_msghdr(value v_n_fds, value v_fds, value v_sockaddr_opt, value
   // The msghdr and cmsghdr must zero-ed to avoid unwanted errors
   memset(msg, 0, total_size);
   Msghdr_val(v) = msg;
+  Msghdr_n_fds(msg) = n_fds;
   if (Is_some(v_sockaddr_opt)) {
     struct sock_addr_data *addr = Sock_addr_val(Some_val(v_sockaddr_opt));
     // Store the address and iovec data in the message
@@ -464,8 +648,7 @@ ocaml_uring_make_msghdr(value v_n_fds, value v_fds, value v_sockaddr_opt, value
   if (n_fds > 0) {
     int i;
     struct cmsghdr *cm;
-    msg->msg_control = &(((struct msghdr_with_cmsg *) msg)->cmsg);
-    msg->msg_controllen = controllen;
+    msghdr_reset_control(msg);
     if (Is_block(v_fds)) {
       cm = CMSG_FIRSTHDR(msg);
       cm->cmsg_level = SOL_SOCKET;
@@ -508,14 +691,67 @@ ocaml_uring_get_msghdr_fds(value v_msghdr) {
   CAMLreturn(v_list);
 }
 
+value
+ocaml_uring_get_msghdr_fds_array(value v_msghdr) {
+  CAMLparam1(v_msghdr);
+  CAMLlocal1(v_array);
+  struct msghdr *msg = Msghdr_val(v_msghdr);
+  struct cmsghdr *cm;
+  int n = 0;
+  for (cm = CMSG_FIRSTHDR(msg); cm; cm = CMSG_NXTHDR(msg, cm)) {
+    if (cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SCM_RIGHTS)
+      n += (cm->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+  }
+  if (n == 0)
+    CAMLreturn(Atom(0));
+  // FDs are immediate values, so they can be stored without going through caml_modify.
+  v_array = caml_alloc(n, 0);
+  n = 0;
+  for (cm = CMSG_FIRSTHDR(msg); cm; cm = CMSG_NXTHDR(msg, cm)) {
+    if (cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SCM_RIGHTS) {
+      int *fds = (int *) CMSG_DATA(cm);
+      int n_fds = (cm->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+      int i;
+      for (i = 0; i < n_fds; i++)
+	Field(v_array, n++) = Val_int(fds[i]);
+    }
+  }
+  CAMLreturn(v_array);
+}
+
+// Replace the FDs to be sent with [v_fds], reusing the control space reserved by [make_msghdr].
+// The msghdr must not be in use by a job while this is called.
+value
+ocaml_uring_set_msghdr_fds(value v_msghdr, value v_fds) {
+  struct msghdr *msg = Msghdr_val(v_msghdr);
+  int n_fds = Wosize_val(v_fds);
+  int i;
+  struct cmsghdr *cm;
+  if (n_fds > Msghdr_n_fds(msg))
+    caml_invalid_argument("Msghdr.set_fds: too many FDs for this msghdr");
+  if (n_fds == 0) {
+    msg->msg_control = NULL;
+    msg->msg_controllen = 0;
+    return Val_unit;
+  }
+  msg->msg_control = &(((struct msghdr_with_cmsg *) msg)->cmsg);
+  msg->msg_controllen = CMSG_SPACE(sizeof(int) * n_fds);
+  cm = CMSG_FIRSTHDR(msg);
+  cm->cmsg_level = SOL_SOCKET;
+  cm->cmsg_type = SCM_RIGHTS;
+  cm->cmsg_len = CMSG_LEN(n_fds * sizeof(int));
+  for (i = 0; i < n_fds; i++)
+    ((int *)CMSG_DATA(cm))[i] = Int_val(Field(v_fds, i));
+  return Val_unit;
+}
+
 // v_sockaddr must not be GC'd while the call is in progress
 value
 ocaml_uring_submit_connect(value v_uring, value v_id, value v_fd, value v_sockaddr) {
   CAMLparam2(v_uring, v_sockaddr);
-  struct io_uring *ring = Ring_val(v_uring);
   struct io_uring_sqe *sqe;
   struct sock_addr_data *addr = Sock_addr_val(v_sockaddr);
-  sqe = io_uring_get_sqe(ring);
+  sqe = get_sqe(v_uring);
   if (!sqe) CAMLreturn(Val_false);
   io_uring_prep_connect(sqe, Int_val(v_fd), &(addr->sock_addr_addr.s_gen), addr->sock_addr_len);
   io_uring_sqe_set_data(sqe, (void *)Long_val(v_id));
@@ -526,9 +762,8 @@ ocaml_uring_submit_connect(value v_uring, value v_id, value v_fd, value v_sockad
 value
 ocaml_uring_submit_send_msg(value v_uring, value v_id, value v_fd, value v_msghdr) {
   CAMLparam2(v_uring, v_msghdr);
-  struct io_uring *ring = Ring_val(v_uring);
   struct msghdr *msg = Msghdr_val(Field(v_msghdr, 0));
-  struct io_uring_sqe *sqe = io_uring_get_sqe(ring);
+  struct io_uring_sqe *sqe = get_sqe(v_uring);
   if (!sqe) CAMLreturn(Val_false);
   dprintf("submit_sendmsg\n");
   io_uring_prep_sendmsg(sqe, Int_val(v_fd), msg, 0);
@@ -540,25 +775,49 @@ ocaml_uring_submit_send_msg(value v_uring, value v_id, value v_fd, value v_msghd
 value
 ocaml_uring_submit_recv_msg(value v_uring, value v_id, value v_fd, value v_msghdr) {
   CAMLparam2(v_uring, v_msghdr);
-  struct io_uring *ring = Ring_val(v_uring);
   struct msghdr *msg = Msghdr_val(Field(v_msghdr, 0));
-  struct io_uring_sqe *sqe = io_uring_get_sqe(ring);
+  struct io_uring_sqe *sqe = get_sqe(v_uring);
   if (!sqe) CAMLreturn(Val_false);
   dprintf("submit_recvmsg:msghdr %p: registering iobuf base %p len %lu\n", msg, msg->msg_iov[0].iov_base, msg->msg_iov[0].iov_len);
+  // The kernel overwrites msg_controllen with the amount used, so restore it to allow reuse.
+  msghdr_reset_control(msg);
   io_uring_prep_recvmsg(sqe, Int_val(v_fd), msg, 0);
   io_uring_sqe_set_data(sqe, (void *)Long_val(v_id));
   CAMLreturn(Val_true);
 }
 
+#ifndef RWF_NOWAIT
+#define RWF_NOWAIT 0x00000008
+#endif
+
+// Noalloc. Try to read without blocking (e.g. from the page cache).
+// Returns the number of bytes read, or -errno (-EAGAIN if the read would block).
+value
+ocaml_uring_preadv_nowait(value v_fd, value v_iov, value v_off, value v_rw_flags) {
+  struct iovec *iovs = Iovec_val(Field(v_iov, 0));
+  int len = Int_val(Field(v_iov, 1));
+  ssize_t r = preadv2(Int_val(v_fd), iovs, len, Int63_val(v_off), RWF_NOWAIT | Int_val(v_rw_flags));
+  return Val_long(r < 0 ? -errno : r);
+}
+
+// Noalloc. As for ocaml_uring_preadv_nowait, but for recvmsg.
+value
+ocaml_uring_recvmsg_nowait(value v_fd, value v_msghdr) {
+  struct msghdr *msg = Msghdr_val(Field(v_msghdr, 0));
+  ssize_t r;
+  msghdr_reset_control(msg);
+  r = recvmsg(Int_val(v_fd), msg, MSG_DONTWAIT);
+  return Val_long(r < 0 ? -errno : r);
+}
+
 // v_sockaddr must not be GC'd while the call is in progress
 value
 ocaml_uring_submit_accept(value v_uring, value v_id, value v_fd, value v_sockaddr) {
   CAMLparam2(v_uring, v_sockaddr);
-  struct io_uring *ring = Ring_val(v_uring);
   struct io_uring_sqe *sqe;
   struct sock_addr_data *addr = Sock_addr_val(v_sockaddr);
   addr->sock_addr_len = sizeof(union sock_addr_union);
-  sqe = io_uring_get_sqe(ring);
+  sqe = get_sqe(v_uring);
   if (!sqe) CAMLreturn(Val_false);
   io_uring_prep_accept(sqe, Int_val(v_fd), &(addr->sock_addr_addr.s_gen), &addr->sock_addr_len, SOCK_CLOEXEC);
   io_uring_sqe_set_data(sqe, (void *)Long_val(v_id));
@@ -568,34 +827,343 @@ ocaml_uring_submit_accept(value v_uring, value v_id, value v_fd, value v_sockadd
 value
 ocaml_uring_submit_cancel(value v_uring, value v_id, value v_target) {
   CAMLparam1(v_uring);
-  struct io_uring *ring = Ring_val(v_uring);
   struct io_uring_sqe *sqe;
-  sqe = io_uring_get_sqe(ring);
+  sqe = get_sqe(v_uring);
   if (!sqe) CAMLreturn(Val_false);
   io_uring_prep_cancel(sqe, (void *)Long_val(v_target), 0);
   io_uring_sqe_set_data(sqe, (void *)Long_val(v_id));
   CAMLreturn(Val_true);
 }
 
+static int shutdown_command(value v_how) {
+  switch (Int_val(v_how)) {
+    case 0: return SHUT_RD;
+    case 1: return SHUT_WR;
+    default: return SHUT_RDWR;
+  }
+}
+
+value
+ocaml_uring_submit_shutdown(value v_uring, value v_id, value v_fd, value v_how) {
+  CAMLparam1(v_uring);
+  struct io_uring_sqe *sqe = get_sqe(v_uring);
+  if (!sqe) CAMLreturn(Val_false);
+  io_uring_prep_shutdown(sqe, Int_val(v_fd), shutdown_command(v_how));
+  io_uring_sqe_set_data(sqe, (void *)Long_val(v_id));
+  CAMLreturn(Val_true);
+}
+
+#define Timespec_val(v) (*((struct __kernel_timespec **) Data_custom_val(v)))
+
+static void finalize_timespec(value v) {
+  caml_stat_free(Timespec_val(v));
+  Timespec_val(v) = NULL;
+}
+
+static struct custom_operations timespec_ops = {
+  "uring.timespec",
+  finalize_timespec,
+  custom_compare_default,
+  custom_hash_default,
+  custom_serialize_default,
+  custom_deserialize_default,
+  custom_compare_ext_default,
+  custom_fixed_length_default
+};
+
+value
+ocaml_uring_make_timespec(value v_timeout) {
+  CAMLparam1(v_timeout);
+  CAMLlocal1(v);
+  double timeout = Double_val(v_timeout);
+  struct __kernel_timespec *ts;
+  v = caml_alloc_custom_mem(&timespec_ops, sizeof(struct __kernel_timespec *), sizeof(struct __kernel_timespec));
+  Timespec_val(v) = NULL;
+  ts = (struct __kernel_timespec *) caml_stat_alloc(sizeof(struct __kernel_timespec));
+  ts->tv_sec = (time_t) timeout;
+  ts->tv_nsec = (timeout - ts->tv_sec) * 1e9;
+  Timespec_val(v) = ts;
+  CAMLreturn(v);
+}
+
+// v_timespec must not be GC'd until the job is finished.
+// Noalloc
+value
+ocaml_uring_submit_timeout(value v_uring, value v_id, value v_timespec) {
+  struct io_uring_sqe *sqe = get_sqe(v_uring);
+  if (!sqe) return Val_false;
+  io_uring_prep_timeout(sqe, Timespec_val(v_timespec), 0, 0);
+  io_uring_sqe_set_data(sqe, (void *)Long_val(v_id));
+  return Val_true;
+}
+
+#define Epoll_event_val(v) (*((struct epoll_event **) Data_custom_val(v)))
+
+static void finalize_epoll_event(value v) {
+  caml_stat_free(Epoll_event_val(v));
+  Epoll_event_val(v) = NULL;
+}
+
+static struct custom_operations epoll_event_ops = {
+  "uring.epoll_event",
+  finalize_epoll_event,
+  custom_compare_default,
+  custom_hash_default,
+  custom_serialize_default,
+  custom_deserialize_default,
+  custom_compare_ext_default,
+  custom_fixed_length_default
+};
+
+// An event for [epoll_ctl], with the FD as its data.
+value
+ocaml_uring_make_epoll_event(value v_events, value v_fd) {
+  CAMLparam0();
+  CAMLlocal1(v);
+  struct epoll_event *ev;
+  v = caml_alloc_custom_mem(&epoll_event_ops, sizeof(struct epoll_event *), sizeof(struct epoll_event));
+  Epoll_event_val(v) = NULL;
+  ev = (struct epoll_event *) caml_stat_alloc(sizeof(struct epoll_event));
+  ev->events = (uint32_t) Long_val(v_events);
+  ev->data.u64 = 0;
+  ev->data.fd = Int_val(v_fd);
+  Epoll_event_val(v) = ev;
+  CAMLreturn(v);
+}
+
+value
+ocaml_uring_epoll_create(value v_unit) {
+  CAMLparam1(v_unit);
+  int fd = epoll_create1(EPOLL_CLOEXEC);
+  if (fd < 0)
+    unix_error(errno, "epoll_create1", Nothing);
+  CAMLreturn(Val_int(fd));
+}
+
+#define EPOLL_READY_MAX 256
+
+// Collect up to EPOLL_READY_MAX FDs that [v_epfd] reports as ready into the array [v_fds],
+// without blocking. Returns the number of FDs stored.
+// This must be a single epoll_wait: level-triggered FDs are put back on the ready list
+// as they are returned, so a second call would report them again.
+value
+ocaml_uring_epoll_ready(value v_epfd, value v_fds) {
+  CAMLparam1(v_fds);
+  struct epoll_event evs[EPOLL_READY_MAX];
+  int len = Wosize_val(v_fds);
+  int max = len < EPOLL_READY_MAX ? len : EPOLL_READY_MAX;
+  int got = max == 0 ? 0 : epoll_wait(Int_val(v_epfd), evs, max, 0);
+  if (got < 0) {
+    if (errno != EINTR) unix_error(errno, "epoll_wait", Nothing);
+    got = 0;
+  }
+  for (int i = 0; i < got; i++)
+    Field(v_fds, i) = Val_int(evs[i].data.fd);   // Immediate values need no write barrier
+  CAMLreturn(Val_int(got));
+}
+
+static int epoll_op(value v_op) {
+  switch (Int_val(v_op)) {
+    case 0: return EPOLL_CTL_ADD;
+    case 1: return EPOLL_CTL_MOD;
+    default: return EPOLL_CTL_DEL;
+  }
+}
+
+// v_event must not be GC'd while the call is in progress
+value
+ocaml_uring_submit_epoll_ctl_native(value v_uring, value v_id, value v_epfd, value v_fd, value v_op, value v_event) {
+  CAMLparam2(v_uring, v_event);
+  struct io_uring_sqe *sqe;
+  int op = epoll_op(v_op);
+  sqe = get_sqe(v_uring);
+  if (!sqe) CAMLreturn(Val_false);
+  dprintf("submit_epoll_ctl: epfd:%d fd:%d op:%d\n", Int_val(v_epfd), Int_val(v_fd), op);
+  io_uring_prep_epoll_ctl(sqe, Int_val(v_epfd), Int_val(v_fd), op, Epoll_event_val(v_event));
+  io_uring_sqe_set_data(sqe, (void *)Long_val(v_id));
+  CAMLreturn(Val_true);
+}
+
+value
+ocaml_uring_submit_epoll_ctl_byte(value *values, int argc) {
+  return ocaml_uring_submit_epoll_ctl_native(values[0], values[1], values[2], values[3], values[4], values[5]);
+}
+
+// Queues shutdown(SHUT_WR) -> recv(drain buffer) -> close as a hard-linked chain,
+// so that the close happens even if the earlier steps fail.
+// If v_timeout_opt is given, the recv is cancelled if it hasn't finished by then.
+// Only the final close is reported to OCaml, with id [v_id].
+// Either all of the SQEs are queued, or none of them are.
+// v_drain_opt (a Cstruct.t option) and v_timeout_opt must not be GC'd until the job is finished.
+value
+ocaml_uring_submit_teardown(value v_uring, value v_id, value v_fd, value v_drain_opt, value v_timeout_opt) {
+  CAMLparam3(v_uring, v_drain_opt, v_timeout_opt);
+  struct io_uring *ring = Ring_val(v_uring);
+  struct io_uring_sqe *sqe;
+  int fd = Int_val(v_fd);
+  int with_timeout = Is_some(v_drain_opt) && Is_some(v_timeout_opt);
+  unsigned needed = 2 + Is_some(v_drain_opt) + with_timeout;
+  if (io_uring_sq_space_left(ring) < needed) CAMLreturn(Val_false);
+  sqe = get_sqe(v_uring);
+  io_uring_prep_shutdown(sqe, fd, SHUT_WR);
+  io_uring_sqe_set_flags(sqe, IOSQE_IO_HARDLINK);
+  io_uring_sqe_set_data(sqe, IGNORED_USER_DATA);
+  if (Is_some(v_drain_opt)) {
+    value v_cs = Some_val(v_drain_opt);
+    void *buf = Caml_ba_data_val(Field(v_cs, 0)) + Long_val(Field(v_cs, 1));
+    sqe = get_sqe(v_uring);
+    io_uring_prep_recv(sqe, fd, buf, Long_val(Field(v_cs, 2)), 0);
+    io_uring_sqe_set_flags(sqe, IOSQE_IO_HARDLINK);
+    io_uring_sqe_set_data(sqe, IGNORED_USER_DATA);
+    if (with_timeout) {
+      sqe = get_sqe(v_uring);
+      io_uring_prep_link_timeout(sqe, Timespec_val(Some_val(v_timeout_opt)), 0);
+      io_uring_sqe_set_flags(sqe, IOSQE_IO_HARDLINK);
+      io_uring_sqe_set_data(sqe, IGNORED_USER_DATA);
+    }
+  }
+  sqe = get_sqe(v_uring);
+  io_uring_prep_close(sqe, fd);
+  io_uring_sqe_set_data(sqe, (void *)Long_val(v_id));
+  dprintf("submit_teardown: fd:%d drain:%d\n", fd, Is_some(v_drain_opt));
+  CAMLreturn(Val_true);
+}
+
+// Noalloc
+value ocaml_uring_sq_space_left(value v_uring) {
+  return Val_int(io_uring_sq_space_left(Ring_val(v_uring)));
+}
+
+// Noalloc
+value ocaml_uring_sq_ready(value v_uring) {
+  return Val_int(io_uring_sq_ready(Ring_val(v_uring)));
+}
+
+// Noalloc
+// True if the kernel is holding completions that didn't fit in the CQ ring.
+value ocaml_uring_cq_overflow(value v_uring) {
+  struct io_uring *ring = Ring_val(v_uring);
+  return Val_bool(IO_URING_READ_ONCE(*ring->sq.kflags) & IORING_SQ_CQ_OVERFLOW);
+}
+
+// Noalloc
+// The number of completions the kernel has discarded because the CQ ring was full.
+value ocaml_uring_cq_dropped(value v_uring) {
+  struct io_uring *ring = Ring_val(v_uring);
+  return Val_int(IO_URING_READ_ONCE(*ring->cq.koverflow));
+}
+
+// Noalloc
+value ocaml_uring_cq_space_left(value v_uring) {
+  struct io_uring *ring = Ring_val(v_uring);
+  return Val_int(*ring->cq.kring_entries - io_uring_cq_ready(ring));
+}
+
+// Noalloc
+// Ask the kernel to move overflowed completions into the CQ ring, as far as they fit.
+// Returns 0 on success or a negative errno.
+value ocaml_uring_flush_cq(value v_uring) {
+#ifdef __NR_io_uring_enter
+  struct io_uring *ring = Ring_val(v_uring);
+  dprintf("uring %p: flushing CQ overflow\n", ring);
+  if (syscall(__NR_io_uring_enter, ring->ring_fd, 0, 0, IORING_ENTER_GETEVENTS, NULL, 0) < 0)
+    return Val_int(-errno);
+  return Val_int(0);
+#else
+  return Val_int(-ENOSYS);
+#endif
+}
+
+// Noalloc
+value ocaml_uring_cq_ready(value v_uring) {
+  return Val_int(io_uring_cq_ready(Ring_val(v_uring)));
+}
+
+// Block until at least one of the rings in the array [v_rings] has a completion waiting,
+// or until [v_timeout_ms] milliseconds have passed (-1 to wait forever).
+// A ring's FD is readable whenever its completion queue isn't empty.
+value ocaml_uring_poll_rings(value v_rings, value v_timeout_ms) {
+  CAMLparam1(v_rings);
+  int n = Wosize_val(v_rings);
+  int timeout_ms = Int_val(v_timeout_ms);
+  struct pollfd *fds = caml_stat_alloc(n * sizeof(struct pollfd));
+  for (int i = 0; i < n; i++) {
+    struct io_uring *ring = Ring_val(Field(v_rings, i));
+    fds[i].fd = ring->ring_fd;
+    fds[i].events = POLLIN;
+    fds[i].revents = 0;
+  }
+  dprintf("poll_rings: waiting on %d rings, timeout %dms\n", n, timeout_ms);
+  caml_enter_blocking_section();
+  int res = poll(fds, n, timeout_ms);
+  int err = errno;
+  caml_leave_blocking_section();
+  caml_stat_free(fds);
+  if (res < 0 && err != EINTR)
+    unix_error(err, "poll", Nothing);
+  CAMLreturn(Val_unit);
+}
+
 value ocaml_uring_submit(value v_uring)
 {
   CAMLparam1(v_uring);
   struct io_uring *ring = Ring_val(v_uring);
-  int num = io_uring_submit(ring);
+  int num = Is_fallback(ring) ? fallback_submit(ring) : io_uring_submit(ring);
   CAMLreturn(Val_int(num));
 }
 
 #define Val_cqe_none Val_int(0)
 
-static value Val_cqe_some(value id, value res) {
-  CAMLparam2(id, res);
+// If [cqe] is for an internal request, mark it as seen and return 1.
+// Does not access the OCaml heap, so can be used in a blocking section.
+static int cqe_ignored(struct io_uring *ring, struct io_uring_cqe *cqe) {
+  if (io_uring_cqe_get_data(cqe) != IGNORED_USER_DATA)
+    return 0;
+  dprintf("cqe: ignoring internal completion (res %d)\n", cqe->res);
+  io_uring_cqe_seen(ring, cqe);
+  return 1;
+}
+
+// [more] is set for a multishot request that will produce further completions.
+static value Val_cqe_some(value id, value res, value more) {
+  CAMLparam3(id, res, more);
   CAMLlocal1(some);
-  some = caml_alloc(2, 0);
+  some = caml_alloc(3, 0);
   Store_field(some, 0, id);
   Store_field(some, 1, res);
+  Store_field(some, 2, more);
   CAMLreturn(some);
 }
 
+// Reap a completion from a fallback ring. If [wait] is set, submit any queued
+// requests first and wait up to [timeout] seconds (forever if negative).
+static value fallback_cqe(struct io_uring *ring, int wait, double timeout) {
+  struct io_uring_cqe cqe;
+  struct timespec deadline, *dl = NULL;
+  int res;
+  if (wait && timeout >= 0) {
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += (time_t) timeout;
+    deadline.tv_nsec += (timeout - (time_t) timeout) * 1e9;
+    if (deadline.tv_nsec >= 1000000000) {
+      deadline.tv_sec++;
+      deadline.tv_nsec -= 1000000000;
+    }
+    dl = &deadline;
+  }
+  if (wait) {
+    caml_enter_blocking_section();
+    fallback_submit(ring);
+    res = fallback_get_cqe(ring, 1, dl, &cqe);
+    caml_leave_blocking_section();
+  } else {
+    res = fallback_get_cqe(ring, 0, NULL, &cqe);
+  }
+  if (res < 0)
+    return Val_cqe_none;
+  return Val_cqe_some(Val_long((long) cqe.user_data), Val_int(cqe.res), Val_bool(cqe.flags & IORING_CQE_F_MORE));
+}
+
 value ocaml_uring_wait_cqe_timeout(value v_timeout, value v_uring)
 {
   CAMLparam2(v_uring, v_timeout);
@@ -606,11 +1174,14 @@ value ocaml_uring_wait_cqe_timeout(value v_timeout, value v_uring)
   long id;
   struct io_uring *ring = Ring_val(v_uring);
   struct io_uring_cqe *cqe;
-  int res;
+  int res, more;
+  if (Is_fallback(ring)) CAMLreturn(fallback_cqe(ring, 1, timeout));
   dprintf("cqe: waiting, timeout %fs\n", timeout);
   caml_enter_blocking_section();
   io_uring_submit(ring);
-  res = io_uring_wait_cqe_timeout(ring, &cqe, &t);
+  do {
+    res = io_uring_wait_cqe_timeout(ring, &cqe, &t);
+  } while (res == 0 && cqe_ignored(ring, cqe));
   caml_leave_blocking_section();
   if (res < 0) {
     if (res == -EAGAIN || res == -EINTR || res == -ETIME) {
@@ -620,8 +1191,10 @@ value ocaml_uring_wait_cqe_timeout(value v_timeout, value v_uring)
     }
   } else {
     id = (long)io_uring_cqe_get_data(cqe);
+    res = cqe->res;
+    more = cqe->flags & IORING_CQE_F_MORE;
     io_uring_cqe_seen(ring, cqe);
-    CAMLreturn(Val_cqe_some(Val_int(id), Val_int(cqe->res)));
+    CAMLreturn(Val_cqe_some(Val_int(id), Val_int(res), Val_bool(more)));
   }
 }
 
@@ -631,11 +1204,14 @@ value ocaml_uring_wait_cqe(value v_uring)
   long id;
   struct io_uring *ring = Ring_val(v_uring);
   struct io_uring_cqe *cqe;
-  int res;
+  int res, more;
+  if (Is_fallback(ring)) CAMLreturn(fallback_cqe(ring, 1, -1.0));
   dprintf("cqe: waiting\n");
   caml_enter_blocking_section();
   io_uring_submit(ring);
-  res = io_uring_wait_cqe(ring, &cqe);
+  do {
+    res = io_uring_wait_cqe(ring, &cqe);
+  } while (res == 0 && cqe_ignored(ring, cqe));
   caml_leave_blocking_section();
   if (res < 0) {
     if (res == -EAGAIN || res == -EINTR) {
@@ -645,8 +1221,10 @@ value ocaml_uring_wait_cqe(value v_uring)
     }
   } else {
     id = (long)io_uring_cqe_get_data(cqe);
+    res = cqe->res;
+    more = cqe->flags & IORING_CQE_F_MORE;
     io_uring_cqe_seen(ring, cqe);
-    CAMLreturn(Val_cqe_some(Val_int(id), Val_int(cqe->res)));
+    CAMLreturn(Val_cqe_some(Val_int(id), Val_int(res), Val_bool(more)));
   }
 }
 
@@ -656,9 +1234,12 @@ value ocaml_uring_peek_cqe(value v_uring)
   long id;
   struct io_uring *ring = Ring_val(v_uring);
   struct io_uring_cqe *cqe;
-  int res;
+  int res, more;
+  if (Is_fallback(ring)) CAMLreturn(fallback_cqe(ring, 0, 0.0));
   dprintf("cqe: peeking\n");
-  res = io_uring_peek_cqe(ring, &cqe);
+  do {
+    res = io_uring_peek_cqe(ring, &cqe);
+  } while (res == 0 && cqe_ignored(ring, cqe));
   if (res < 0) {
     if (res == -EAGAIN || res == -EINTR) {
       CAMLreturn(Val_cqe_none);
@@ -667,8 +1248,10 @@ value ocaml_uring_peek_cqe(value v_uring)
     }
   } else {
     id = (long)io_uring_cqe_get_data(cqe);
+    res = cqe->res;
+    more = cqe->flags & IORING_CQE_F_MORE;
     io_uring_cqe_seen(ring, cqe);
-    CAMLreturn(Val_cqe_some(Val_int(id), Val_int(cqe->res)));
+    CAMLreturn(Val_cqe_some(Val_int(id), Val_int(res), Val_bool(more)));
   }
 }
 
@@ -51,13 +51,16 @@ let test_block_size impl =
   (fun block_size -> run_test impl ~block_size ~queue_depth count)
 
 let urcp_test =
-  Test.make_grouped ~name:"urcp_alloc" (List.map (fun l -> l Urcp_lib.run_cp) [test_size; test_queue_depth; test_block_size])
+  Test.make_grouped ~name:"urcp_alloc" (List.map (fun l -> l (Urcp_lib.run_cp ?backend:None)) [test_size; test_queue_depth; test_block_size])
 let urcp_fixed_test =
     Test.make_grouped ~name:"urcp_fixed" (List.map (fun l -> l Urcp_fixed_lib.run_cp) [test_size; test_queue_depth; test_block_size])
+let urcp_threads_test =
+  let run_cp = Urcp_lib.run_cp ~backend:(Uring.Threads 8) in
+  Test.make_grouped ~name:"urcp_threads" (List.map (fun l -> l run_cp) [test_size; test_queue_depth; test_block_size])
 let lwt_bytes_test =
   Test.make_grouped ~name:"lwt_bytes" (List.map (fun l -> l Lwtcp_lib.run_cp) [test_size; test_queue_depth; test_block_size])
 
-let test = Test.make_grouped ~name:"cp" [  lwt_bytes_test; urcp_test; urcp_fixed_test ]
+let test = Test.make_grouped ~name:"cp" [  lwt_bytes_test; urcp_test; urcp_fixed_test; urcp_threads_test ]
 
 let benchmark () =
   let ols = Analyze.ols ~bootstrap:0 ~r_square:true ~predictors:Measure.[| run |] in
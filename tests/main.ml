@@ -265,6 +265,749 @@ let test_readv2 () =
   check_int    ~__POS__ ~expected:7 read;
   check_string ~__POS__ ~expected:"Gathered [A te] and [st ]" (Cstruct.to_string b)
 
+let test_flags () =
+  with_uring ~queue_depth:3 @@ fun t ->
+  let path = Filename.temp_file "uring" "test-flags" in
+  let fd = Unix.openfile path Unix.[O_RDWR; O_TRUNC] 0o600 in
+  Fun.protect ~finally:(fun () -> Unix.close fd; Unix.unlink path) @@ fun () ->
+  assert_some ~__POS__ (Uring.writev t fd [Cstruct.of_string "hello"] `Write
+                          ~file_offset:Int63.zero
+                          ~sqe_flags:Uring.Sqe_flags.io_link
+                          ~rw_flags:Uring.Rw_flags.dsync);
+  assert_some ~__POS__ (Uring.fsync t fd `Fsync ~datasync:true);
+  assert_some ~__POS__ (Uring.noop t `Barrier ~sqe_flags:Uring.Sqe_flags.io_drain);
+  check_int ~__POS__ (Uring.submit t) ~expected:3;
+  (* Linked and drained, so these must complete in order. *)
+  assert_ ~__POS__ (consume t = (`Write, 5));
+  assert_ ~__POS__ (consume t = (`Fsync, 0));
+  assert_ ~__POS__ (consume t = (`Barrier, 0));
+  (* The data is now in the page cache, so a non-blocking read succeeds. *)
+  let buf = Cstruct.create 5 in
+  assert_some ~__POS__ (Uring.readv t fd [buf] `Read
+                          ~file_offset:Int63.zero
+                          ~sqe_flags:Uring.Sqe_flags.async
+                          ~rw_flags:Uring.Rw_flags.nowait);
+  let token, read = consume t in
+  assert_ ~__POS__ (token = `Read);
+  if read <> -95 then ( (* EOPNOTSUPP if the filesystem doesn't support RWF_NOWAIT *)
+    check_int ~__POS__ ~expected:5 read;
+    check_string ~__POS__ ~expected:"hello" (Cstruct.to_string buf)
+  )
+
+let test_ioprio () =
+  check_raises ~__POS__ (Invalid_argument "Ioprio.make: level 8 not in range 0-7")
+    (fun () -> ignore (Uring.Ioprio.make `Be 8));
+  let t = Uring.create ~queue_depth:2 ~ioprio:(Uring.Ioprio.make `Be 7) () in
+  Test_data.with_fd @@ fun fd ->
+  let buf = Cstruct.create 6 in
+  (* Uses the ring's default priority. *)
+  assert_some ~__POS__ (Uring.readv t fd [buf] `Default ~file_offset:Int63.zero);
+  assert_ ~__POS__ (consume t = (`Default, 6));
+  (* Overridden for this request. *)
+  assert_some ~__POS__ (Uring.readv t fd [buf] `Idle ~file_offset:Int63.zero
+                          ~ioprio:(Uring.Ioprio.make `Idle 0));
+  assert_ ~__POS__ (consume t = (`Idle, 6));
+  check_string ~__POS__ ~expected:"A test" (Cstruct.to_string buf);
+  Uring.exit t
+
+let test_sched () =
+  with_uring ~queue_depth:4 @@ fun t ->
+  let s = Uring.Sched.create ~op_cost:0 () in
+  let a = Uring.Sched.tenant s "a" in
+  let b = Uring.Sched.tenant s "b" ~weight:4 in
+  let log = ref [] in
+  let enqueue tenant x =
+    Uring.Sched.enqueue s tenant ~bytes:100 (fun () ->
+        let job = Uring.noop t x in
+        if job <> None then log := x :: !log;
+        job
+      )
+  in
+  for i = 1 to 4 do enqueue a (`A i); enqueue b (`B i) done;
+  (* Only room for 4 in the ring. [b] gets four times the share of [a]. *)
+  check_int ~__POS__ (Uring.Sched.dispatch s) ~expected:4;
+  assert_ ~__POS__ (List.rev !log = [`B 1; `B 2; `B 3; `A 1]);
+  check_int ~__POS__ (Uring.Sched.pending s) ~expected:4;
+  check_int ~__POS__ (Uring.submit t) ~expected:4;
+  for _ = 1 to 4 do ignore (consume t) done;
+  check_int ~__POS__ (Uring.Sched.dispatch s) ~expected:4;
+  assert_ ~__POS__ (List.rev !log = [`B 1; `B 2; `B 3; `A 1; `B 4; `A 2; `A 3; `A 4]);
+  let { Uring.Sched.ops; bytes; _ } = Uring.Sched.stats b in
+  check_int ~__POS__ ops ~expected:4;
+  check_int ~__POS__ bytes ~expected:400;
+  check_int ~__POS__ (Uring.submit t) ~expected:4;
+  for _ = 1 to 4 do ignore (consume t) done
+
+let test_sched_limits () =
+  let now = ref 0.0 in
+  let s = Uring.Sched.create ~clock:(fun () -> !now) () in
+  let slow = Uring.Sched.tenant s "slow" ~ops_per_sec:2.0 ~ops_burst:1 in
+  for _ = 1 to 3 do Uring.Sched.enqueue s slow ~bytes:0 (fun () -> Some ()) done;
+  check_int ~__POS__ (Uring.Sched.dispatch s) ~expected:1;
+  assert_ ~__POS__ (Uring.Sched.next_ready s = Some 0.5);
+  (* Trying again too soon doesn't count as another throttling. *)
+  check_int ~__POS__ (Uring.Sched.dispatch s) ~expected:0;
+  now := 0.5;
+  check_int ~__POS__ (Uring.Sched.dispatch s) ~expected:1;
+  now := 1.0;
+  check_int ~__POS__ (Uring.Sched.dispatch s) ~expected:1;
+  assert_ ~__POS__ (Uring.Sched.next_ready s = None);
+  let { Uring.Sched.ops; queued; throttled; _ } = Uring.Sched.stats slow in
+  check_int ~__POS__ ops ~expected:3;
+  check_int ~__POS__ queued ~expected:0;
+  check_int ~__POS__ throttled ~expected:2
+
+let test_limits () =
+  with_uring ~queue_depth:4 @@ fun t ->
+  let capacity = ref 0 in
+  Uring.set_limits t ~soft_bytes:10 ~hard_bytes:20 ~on_capacity:(fun () -> incr capacity);
+  Test_data.with_fd @@ fun fd ->
+  let read d len = Uring.readv t fd [Cstruct.create len] d ~file_offset:Int63.zero in
+  assert_some ~__POS__ (read `A 8);
+  assert_ ~__POS__ (not (Uring.backpressure t));
+  assert_some ~__POS__ (read `B 8);
+  assert_ ~__POS__ (Uring.backpressure t);
+  assert_ ~__POS__ (read `C 8 = None);         (* Would exceed the hard limit *)
+  check_int ~__POS__ (Uring.bytes_in_flight t) ~expected:16;
+  check_int ~__POS__ (Uring.submit t) ~expected:2;
+  ignore (consume t);
+  check_int ~__POS__ !capacity ~expected:1;
+  assert_ ~__POS__ (not (Uring.backpressure t));
+  ignore (consume t);
+  check_int ~__POS__ (Uring.bytes_in_flight t) ~expected:0;
+  (* A request bigger than the hard limit can still run on its own. *)
+  assert_some ~__POS__ (read `D 30);
+  assert_ ~__POS__ (consume t = (`D, 11));
+  check_int ~__POS__ !capacity ~expected:2
+
+let test_lanes () =
+  with_uring ~queue_depth:4 @@ fun t ->
+  let on_complete job fn = Uring.on_complete t job (fun _ -> fn ()) in
+  let lanes = Uring.Lanes.create 2 ~reserve:0.25 ~on_complete ~queue_depth:4 ~in_flight:(fun () -> Uring.active_ops t) in
+  let log = ref [] in
+  let enqueue lane x =
+    Uring.Lanes.enqueue lanes lane (fun () ->
+        let job = Uring.noop t x in
+        if job <> None then log := x :: !log;
+        job
+      )
+  in
+  for i = 1 to 4 do enqueue 1 (`Bulk i) done;
+  (* One slot is reserved for the express lane. *)
+  check_int ~__POS__ (Uring.Lanes.dispatch lanes) ~expected:3;
+  enqueue 0 `Express;
+  check_int ~__POS__ (Uring.Lanes.dispatch lanes) ~expected:1;
+  check_int ~__POS__ (Uring.submit t) ~expected:4;
+  for _ = 1 to 4 do ignore (consume t) done;
+  enqueue 1 (`Bulk 5);
+  enqueue 0 `Express2;
+  check_int ~__POS__ (Uring.Lanes.dispatch lanes) ~expected:3;
+  assert_ ~__POS__ (List.rev !log = [`Bulk 1; `Bulk 2; `Bulk 3; `Express; `Express2; `Bulk 4; `Bulk 5]);
+  check_int ~__POS__ (Uring.Lanes.pending lanes 1) ~expected:0;
+  check_int ~__POS__ (Uring.Histogram.count (Uring.Lanes.delays lanes 0)) ~expected:2;
+  check_int ~__POS__ (Uring.Histogram.count (Uring.Lanes.delays lanes 1)) ~expected:5;
+  check_int ~__POS__ (Uring.submit t) ~expected:3;
+  for _ = 1 to 3 do ignore (consume t) done;
+  (* Latencies are recorded as the requests complete. *)
+  check_int ~__POS__ (Uring.Histogram.count (Uring.Lanes.latencies lanes 0)) ~expected:2;
+  check_int ~__POS__ (Uring.Histogram.count (Uring.Lanes.latencies lanes 1)) ~expected:5
+
+let test_histogram () =
+  let h = Uring.Histogram.create () in
+  check_bool ~__POS__ (Uring.Histogram.percentile h 50.0 = 0.0) ~expected:true;
+  for i = 1 to 100 do Uring.Histogram.add h (float i *. 1e-3) done;
+  check_int ~__POS__ (Uring.Histogram.count h) ~expected:100;
+  let p50 = Uring.Histogram.percentile h 50.0 in
+  assert_ ~__POS__ (p50 >= 0.050 && p50 < 0.050 *. 1.19);
+  let p99 = Uring.Histogram.percentile h 99.0 in
+  assert_ ~__POS__ (p99 >= 0.099 && p99 <= 0.100);
+  check_bool ~__POS__ (Uring.Histogram.percentile h 100.0 = 0.1) ~expected:true;
+  Uring.Histogram.reset h;
+  check_int ~__POS__ (Uring.Histogram.count h) ~expected:0
+
+let test_read_shared () =
+  with_uring ~queue_depth:2 @@ fun t ->
+  let fbuf = set_fixed_buffer t 32 in
+  let region = Uring.Region.init fbuf 2 ~block_size:16 in
+  Test_data.with_fd @@ fun fd ->
+  let read d = Option.get (Uring.read_shared t region fd d ~file_offset:Int63.zero ~len:6) in
+  let a = read `A in
+  let b = read `B in
+  let c = read `C in
+  check_int ~__POS__ (Uring.Region.avail region) ~expected:1;
+  check_int ~__POS__ (Uring.submit t) ~expected:1;
+  assert_ ~__POS__ (consume t = (`A, 6));
+  assert_ ~__POS__ (consume t = (`B, 6));
+  assert_ ~__POS__ (consume t = (`C, 6));
+  check_string ~__POS__ ~expected:"A test" (Cstruct.to_string (Uring.Shared_chunk.to_cstruct ~len:6 b));
+  List.iter Uring.Shared_chunk.release [a; b; c];
+  check_int ~__POS__ (Uring.Region.avail region) ~expected:2;
+  (* Once complete, a new read is needed. *)
+  let d = read `D in
+  check_int ~__POS__ (Uring.submit t) ~expected:1;
+  assert_ ~__POS__ (consume t = (`D, 6));
+  Uring.Shared_chunk.release d;
+  check_raises ~__POS__ (Invalid_argument "Shared_chunk.release: chunk already released")
+    (fun () -> Uring.Shared_chunk.release d);
+  (* Reads at the current position are never shared. *)
+  let read d = Option.get (Uring.read_shared t region fd d ~file_offset:Int63.minus_one ~len:6) in
+  let e = read `E in
+  let f = read `F in
+  check_int ~__POS__ (Uring.Region.avail region) ~expected:0;
+  check_int ~__POS__ (Uring.submit t) ~expected:2;
+  let results = List.sort compare [consume t; consume t] in
+  assert_ ~__POS__ (List.map fst results = [`E; `F]);
+  List.iter (fun (_, r) -> assert_ ~__POS__ (r > 0)) results;
+  List.iter Uring.Shared_chunk.release [e; f]
+
+let test_block_cache () =
+  with_uring ~queue_depth:2 @@ fun t ->
+  let fbuf = set_fixed_buffer t 8 in
+  let cache = Uring.Block_cache.create (Uring.Region.init fbuf 2 ~block_size:4) in
+  Test_data.with_fd @@ fun fd ->
+  let read block d = Uring.Block_cache.read cache t ~file:0 fd block d in
+  let wait block d ~expected =
+    match read block d with
+    | `Wait chunk ->
+      ignore (Uring.submit t : int);
+      assert_ ~__POS__ (consume t = (d, String.length expected));
+      check_string ~__POS__ ~expected (Cstruct.to_string (Uring.Shared_chunk.to_cstruct ~len:(String.length expected) chunk));
+      chunk
+    | _ -> Alcotest.fail "Expected a miss"
+  in
+  let c0 = wait 0 `R0 ~expected:"A te" in
+  begin match read 0 `R0 with
+    | `Hit (chunk, len) ->
+      check_string ~__POS__ ~expected:"A te" (Cstruct.to_string (Uring.Shared_chunk.to_cstruct ~len chunk));
+      Uring.Shared_chunk.release chunk
+    | _ -> Alcotest.fail "Expected a hit"
+  end;
+  let c1 = wait 1 `R1 ~expected:"st f" in
+  (* Both blocks are in use, so neither can be evicted. *)
+  assert_ ~__POS__ (read 2 `R2 = `Full);
+  Uring.Shared_chunk.release c0;
+  Uring.Shared_chunk.release c1;
+  (* Two requests for the same block share a read. *)
+  let c2 = read 2 `R2 in
+  let c2' = read 2 `R2' in
+  (* Only the ring doing the read can wait for it. *)
+  with_uring ~queue_depth:1 (fun t2 ->
+      assert_ ~__POS__ (Uring.Block_cache.read cache t2 ~file:0 fd 2 `R2'' = `Busy));
+  check_int ~__POS__ (Uring.submit t) ~expected:1;
+  assert_ ~__POS__ (consume t = (`R2, 3));
+  assert_ ~__POS__ (consume t = (`R2', 3));
+  List.iter (function
+      | `Wait c -> Uring.Shared_chunk.release c
+      | _ -> Alcotest.fail "Expected to wait"
+    ) [c2; c2'];
+  let { Uring.Block_cache.hits; coalesced; misses; evictions } = Uring.Block_cache.stats cache in
+  check_int ~__POS__ hits ~expected:1;
+  check_int ~__POS__ coalesced ~expected:1;
+  check_int ~__POS__ misses ~expected:3;
+  check_int ~__POS__ evictions ~expected:1
+
+let test_batch () =
+  with_uring ~queue_depth:3 @@ fun t ->
+  let now = ref 0.0 in
+  let batch = Uring.Batch.create t ~clock:(fun () -> !now) ~window:0.01 ~max_pending:4 in
+  Test_data.with_fd @@ fun fd ->
+  let read off =
+    let buf = Cstruct.create 1 in
+    Uring.Batch.readv batch fd [buf] (off, buf) ~file_offset:(Int63.of_int off)
+  in
+  read 5; read 2; read 9;
+  check_int ~__POS__ (Uring.Batch.pending batch) ~expected:3;
+  check_int ~__POS__ (Uring.Batch.flush_if_due batch) ~expected:0;
+  assert_ ~__POS__ (Uring.Batch.deadline batch = Some 0.01);
+  now := 0.02;
+  check_int ~__POS__ (Uring.Batch.flush_if_due batch) ~expected:3;
+  assert_ ~__POS__ (Uring.Batch.deadline batch = None);
+  check_int ~__POS__ (Uring.submit t) ~expected:3;
+  let check_next ~expected =
+    let (off, buf), res = consume t in
+    check_int ~__POS__ res ~expected:1;
+    check_int ~__POS__ off ~expected;
+    check_string ~__POS__ (Cstruct.to_string buf) ~expected:(String.sub "A test file" off 1)
+  in
+  (* Submitted in offset order, so (for regular files) they complete in that order too. *)
+  check_next ~expected:2;
+  check_next ~expected:5;
+  check_next ~expected:9;
+  (* Reaching [max_pending] flushes as much as will fit. *)
+  read 3; read 1; read 4; read 0;
+  check_int ~__POS__ (Uring.Batch.pending batch) ~expected:1;
+  check_int ~__POS__ (Uring.submit t) ~expected:3;
+  check_next ~expected:0;
+  check_next ~expected:1;
+  check_next ~expected:3;
+  check_int ~__POS__ (Uring.Batch.flush_if_due batch) ~expected:1;
+  check_int ~__POS__ (Uring.submit t) ~expected:1;
+  check_next ~expected:4
+
+let test_batch_merge () =
+  with_uring ~queue_depth:4 @@ fun t ->
+  let batch = Uring.Batch.create t ~max_merge:5 in
+  Test_data.with_fd @@ fun fd ->
+  let read off len =
+    let buf = Cstruct.create len in
+    Uring.Batch.readv batch fd [buf] (off, buf) ~file_offset:(Int63.of_int off)
+  in
+  (* "A test file": [0-2], [2-4] and [4-6] are adjacent, but only two fit within [max_merge].
+     [9-12] is adjacent to [7-9], but runs off the end of the file. *)
+  read 4 2; read 0 2; read 2 2; read 9 3; read 7 2;
+  check_int ~__POS__ (Uring.Batch.flush batch) ~expected:5;
+  check_int ~__POS__ (Uring.Batch.sqes_saved batch) ~expected:2;
+  check_int ~__POS__ (Uring.submit t) ~expected:3;
+  let results = List.init 5 (fun _ ->
+      let (off, buf), res = consume t in
+      off, res, Cstruct.to_string (Cstruct.sub buf 0 (max res 0))
+    ) in
+  let results = List.sort compare results in
+  assert_ ~__POS__ (results = [
+      0, 2, "A ";
+      2, 2, "te";
+      4, 2, "st";
+      7, 2, "fi";
+      9, 2, "le";
+    ])
+
+let test_try_sync () =
+  with_uring ~queue_depth:1 @@ fun t ->
+  Test_data.with_fd @@ fun fd ->
+  (* The test file was just written, so it's in the page cache. *)
+  let buf = Cstruct.create 6 in
+  begin match Uring.try_readv t fd [buf] `Read ~file_offset:Int63.zero with
+    | `Done n ->
+      check_int ~__POS__ n ~expected:6;
+      check_string ~__POS__ (Cstruct.to_string buf) ~expected:"A test"
+    | `Submitted _ ->
+      (* The filesystem may not support RWF_NOWAIT *)
+      check_int ~__POS__ (Uring.submit t) ~expected:1;
+      assert_ ~__POS__ (consume t = (`Read, 6))
+    | `Full -> Alcotest.fail "Ring full"
+  end;
+  (* A short read returns what there was, like read(2). *)
+  let buf = Cstruct.create 20 in
+  begin match Uring.try_readv t fd [buf] `Short ~file_offset:Int63.zero with
+    | `Done n -> check_int ~__POS__ n ~expected:11
+    | `Submitted _ ->
+      check_int ~__POS__ (Uring.submit t) ~expected:1;
+      assert_ ~__POS__ (consume t = (`Short, 11))
+    | `Full -> Alcotest.fail "Ring full"
+  end;
+  (* Errors other than EAGAIN are returned directly, as retrying on the ring wouldn't help. *)
+  let r, w = Unix.pipe () in
+  begin match Uring.try_readv t w [buf] `Bad ~file_offset:Int63.minus_one with
+    | `Done n -> assert_ ~__POS__ (n < 0)
+    | _ -> Alcotest.fail "Expected an error"
+  end;
+  List.iter Unix.close [r; w];
+  (* At the current position, a short read has consumed the data, so it is returned directly. *)
+  ignore (Unix.lseek fd 5 Unix.SEEK_SET : int);
+  let buf = Cstruct.create 20 in
+  begin match Uring.try_readv t fd [buf] `Short ~file_offset:Int63.minus_one with
+    | `Done n ->
+      check_int ~__POS__ n ~expected:6;
+      check_string ~__POS__ (Cstruct.to_string ~len:6 buf) ~expected:"t file"
+    | `Submitted _ ->
+      (* The filesystem may not support RWF_NOWAIT, in which case nothing was consumed. *)
+      check_int ~__POS__ (Uring.submit t) ~expected:1;
+      assert_ ~__POS__ (consume t = (`Short, 6));
+      check_string ~__POS__ (Cstruct.to_string ~len:6 buf) ~expected:"t file"
+    | `Full -> Alcotest.fail "Ring full"
+  end;
+  (* Nothing to receive yet, so we must wait. *)
+  let r, w = Unix.socketpair Unix.PF_UNIX Unix.SOCK_STREAM 0 in
+  Fun.protect ~finally:(fun () -> Unix.close r; Unix.close w) @@ fun () ->
+  let msg = Uring.Msghdr.create [Cstruct.create 5] in
+  begin match Uring.try_recv_msg t r msg `Recv with
+    | `Submitted _ ->
+      check_int ~__POS__ (Uring.submit t) ~expected:1;
+      check_int ~__POS__ (Unix.write_substring w "hello" 0 5) ~expected:5;
+      assert_ ~__POS__ (consume t = (`Recv, 5))
+    | _ -> Alcotest.fail "Expected submission"
+  end;
+  (* Data already waiting is received inline. *)
+  check_int ~__POS__ (Unix.write_substring w "again" 0 5) ~expected:5;
+  assert_ ~__POS__ (Uring.try_recv_msg t r msg `Recv = `Done 5);
+  let { Uring.inline; fallback } = Uring.try_stats t in
+  check_int ~__POS__ (inline + fallback) ~expected:6;
+  assert_ ~__POS__ (inline >= 2)
+
+let test_auto_flush () =
+  with_uring ~queue_depth:8 @@ fun t ->
+  Uring.set_auto_flush t ~max_pending:3;
+  assert_some ~__POS__ (Uring.noop t 1);
+  assert_some ~__POS__ (Uring.noop t 2);
+  assert_ ~__POS__ (Uring.peek t = None);
+  assert_some ~__POS__ (Uring.noop t 3);
+  (* Already submitted. *)
+  check_int ~__POS__ (Uring.submit t) ~expected:0;
+  for i = 1 to 3 do check_int ~__POS__ (fst (consume t)) ~expected:i done;
+  (* A linked request waits for the one after it. *)
+  Uring.set_auto_flush t ~fill:0.25;
+  assert_some ~__POS__ (Uring.noop t 4);
+  assert_some ~__POS__ (Uring.noop t 5 ~sqe_flags:Uring.Sqe_flags.io_link);
+  assert_ ~__POS__ (Uring.peek t = None);
+  assert_some ~__POS__ (Uring.noop t 6);
+  check_int ~__POS__ (Uring.submit t) ~expected:0;
+  for i = 4 to 6 do check_int ~__POS__ (fst (consume t)) ~expected:i done;
+  (* Any request without the flag ends the chain, even one queued without [~sqe_flags]. *)
+  Uring.set_auto_flush t ~max_pending:1;
+  assert_some ~__POS__ (Uring.noop t 10 ~sqe_flags:Uring.Sqe_flags.io_link);
+  assert_some ~__POS__ (Uring.timeout t 0.0 11);
+  check_int ~__POS__ (Uring.submit t) ~expected:0;
+  assert_ ~__POS__ (consume t = (10, 0));
+  check_int ~__POS__ (fst (consume t)) ~expected:11;
+  (* [wait] submits anything pending before blocking. *)
+  Uring.set_auto_flush t;
+  assert_some ~__POS__ (Uring.noop t 7);
+  check_int ~__POS__ (fst (consume t)) ~expected:7;
+  (* A zero delay submits on the next check. *)
+  Uring.set_auto_flush t ~delay:0.0;
+  assert_some ~__POS__ (Uring.noop t 8);
+  check_int ~__POS__ (Uring.submit t) ~expected:0;
+  check_int ~__POS__ (fst (consume t)) ~expected:8;
+  Uring.clear_auto_flush t;
+  assert_some ~__POS__ (Uring.noop t 9);
+  check_int ~__POS__ (Uring.submit t) ~expected:1;
+  check_int ~__POS__ (fst (consume t)) ~expected:9
+
+let test_cq_headroom () =
+  (* A queue depth of 2 gives a completion queue with 4 entries. *)
+  with_uring ~queue_depth:2 @@ fun t ->
+  Uring.set_limits t ~cq_headroom:4;
+  assert_some ~__POS__ (Uring.noop t 1);
+  check_int ~__POS__ (Uring.submit t) ~expected:1;
+  (* The completion is waiting in the CQ, so there's no longer room for 4 more. *)
+  assert_ ~__POS__ (Uring.noop t 2 = None);
+  check_int ~__POS__ (fst (consume t)) ~expected:1;
+  assert_some ~__POS__ (Uring.noop t 2);
+  check_int ~__POS__ (Uring.submit t) ~expected:1;
+  check_int ~__POS__ (fst (consume t)) ~expected:2;
+  let { Uring.overflows; lost } = Uring.cq_stats t in
+  check_int ~__POS__ overflows ~expected:0;
+  check_int ~__POS__ lost ~expected:0
+
+let test_cq_overflow () =
+  (* A queue depth of 1 gives a completion queue with 2 entries. *)
+  let t = Uring.create ~queue_depth:1 () in
+  for i = 1 to 3 do
+    assert_some ~__POS__ (Uring.noop t i);
+    check_int ~__POS__ (Uring.submit t) ~expected:1
+  done;
+  (* The third completion didn't fit. It is either held by the kernel until there is
+     room, or (on old kernels) discarded. *)
+  check_int ~__POS__ (fst (consume t)) ~expected:1;
+  check_int ~__POS__ (fst (consume t)) ~expected:2;
+  let { Uring.overflows; lost } = Uring.cq_stats t in
+  assert_ ~__POS__ (overflows > 0 || lost > 0);
+  if lost = 0 then check_int ~__POS__ (fst (consume t)) ~expected:3
+  else check_int ~__POS__ lost ~expected:1;
+  (* Draining doesn't wait for lost completions. *)
+  Uring.exit ~drain:true t
+
+let test_wait_any () =
+  with_uring ~queue_depth:2 @@ fun t1 ->
+  with_uring ~queue_depth:4 @@ fun t2 ->
+  let rings = Uring.[Ring t1; Ring t2] in
+  assert_ ~__POS__ (Uring.wait_any ~timeout:0.01 rings = []);
+  let r, w = Unix.pipe () in
+  assert_some ~__POS__ (Uring.poll_add t2 r Uring.Poll_mask.(pollin) `Poll);
+  assert_some ~__POS__ (Uring.noop t1 1);
+  (* [wait_any] submits the noop, which completes at once. *)
+  begin match Uring.wait_any rings with
+    | [Uring.Ring ready] -> check_int ~__POS__ (Uring.queue_depth ready) ~expected:2
+    | _ -> Alcotest.fail "Expected just t1 to be ready"
+  end;
+  check_int ~__POS__ (fst (consume t1)) ~expected:1;
+  assert_ ~__POS__ (Uring.wait_any ~timeout:0.01 rings = []);
+  ignore (Unix.write_substring w "!" 0 1 : int);
+  check_int ~__POS__ (List.length (Uring.wait_any rings)) ~expected:1;
+  assert_ ~__POS__ (fst (consume t2) = `Poll);
+  Unix.close r;
+  Unix.close w
+
+let test_epoll () =
+  with_uring ~queue_depth:2 @@ fun t ->
+  let epfd = Uring.Epoll.create () in
+  let r1, w1 = Unix.pipe () in
+  let r2, w2 = Unix.pipe () in
+  List.iter (fun fd ->
+      assert_some ~__POS__ (Uring.epoll_ctl t epfd fd Uring.Epoll.Add Uring.Epoll.Events.epollin `Ctl);
+      check_int ~__POS__ (Uring.submit t) ~expected:1;
+      assert_ ~__POS__ (consume t = (`Ctl, 0))
+    ) [r1; r2];
+  let buf = Array.make 4 Unix.stdin in
+  check_int ~__POS__ (Uring.Epoll.ready epfd buf) ~expected:0;
+  assert_some ~__POS__ (Uring.poll_add t epfd Uring.Poll_mask.pollin `Poll);
+  check_int ~__POS__ (Uring.submit t) ~expected:1;
+  ignore (Unix.write_substring w2 "!" 0 1 : int);
+  assert_ ~__POS__ (fst (consume t) = `Poll);
+  check_int ~__POS__ (Uring.Epoll.ready epfd buf) ~expected:1;
+  assert_ ~__POS__ (buf.(0) = r2);
+  List.iter Unix.close [epfd; r1; w1; r2; w2]
+
+let test_poll_multishot () =
+  with_uring ~queue_depth:2 @@ fun t ->
+  let r, w = Unix.pipe () in
+  let job = Option.get (Uring.poll_multishot t r Uring.Poll_mask.pollin `Poll) in
+  check_int ~__POS__ (Uring.submit t) ~expected:1;
+  ignore (Unix.write_substring w "!" 0 1 : int);
+  let token, res = consume t in
+  assert_ ~__POS__ (token = `Poll);
+  if res < 0 then (
+    (* Not supported by this kernel *)
+    assert_ ~__POS__ (not (Uring.active job))
+  ) else (
+    assert_ ~__POS__ (Uring.active job);
+    check_int ~__POS__ (Unix.read r (Bytes.create 1) 0 1) ~expected:1;
+    ignore (Unix.write_substring w "!" 0 1 : int);
+    assert_ ~__POS__ (fst (consume t) = `Poll);
+    assert_ ~__POS__ (Uring.active job);
+    assert_some ~__POS__ (Uring.cancel t job `Cancel);
+    check_int ~__POS__ (Uring.submit t) ~expected:1;
+    let a = fst (consume t) in
+    let b = fst (consume t) in
+    assert_ ~__POS__ (List.sort compare [a; b] = List.sort compare [`Poll; `Cancel]);
+    assert_ ~__POS__ (not (Uring.active job))
+  );
+  Unix.close r;
+  Unix.close w
+
+let test_fallback () =
+  let t = Uring.create ~backend:(Uring.Threads 2) ~queue_depth:4 () in
+  assert_ ~__POS__ (Uring.backend t = Uring.Threads 2);
+  assert_some ~__POS__ (Uring.noop t `Noop);
+  check_int ~__POS__ (Uring.submit t) ~expected:1;
+  assert_ ~__POS__ (consume t = (`Noop, 0));
+  Test_data.with_fd (fun fd ->
+      let buf = Cstruct.create 6 in
+      assert_some ~__POS__ (Uring.readv t fd [buf] `Read ~file_offset:(Int63.of_int 2));
+      assert_ ~__POS__ (consume t = (`Read, 6));
+      check_string ~__POS__ (Cstruct.to_string buf) ~expected:"test f"
+    );
+  (* A blocked read can be cancelled. *)
+  let r, w = Unix.pipe () in
+  let read = Option.get (Uring.readv t r [Cstruct.create 1] `Read ~file_offset:Int63.minus_one) in
+  check_int ~__POS__ (Uring.submit t) ~expected:1;
+  assert_ ~__POS__ (Uring.wait ~timeout:0.01 t = None);
+  assert_some ~__POS__ (Uring.cancel t read `Cancel);
+  begin match List.sort compare [consume t; consume t] with
+    | [`Cancel, cancel; `Read, res] ->
+      (* The worker is waiting for the pipe, so it can be interrupted. *)
+      check_int ~__POS__ cancel ~expected:0;
+      assert_ ~__POS__ (res < 0)
+    | _ -> Alcotest.fail "Expected cancel and read completions"
+  end;
+  (* Polls complete once the FD is ready. *)
+  assert_some ~__POS__ (Uring.poll_add t r Uring.Poll_mask.pollin `Poll);
+  check_int ~__POS__ (Uring.submit t) ~expected:1;
+  ignore (Unix.write_substring w "!" 0 1 : int);
+  assert_ ~__POS__ (fst (consume t) = `Poll);
+  (* Draining cancels anything still running. *)
+  assert_some ~__POS__ (Uring.poll_add t w Uring.Poll_mask.pollhup `Poll);
+  Uring.exit ~drain:true t;
+  Unix.close r;
+  Unix.close w
+
+let test_dontfork () =
+  with_uring ~queue_depth:1 @@ fun t ->
+  let fbuf = Bigarray.(Array1.create char c_layout (64 * 1024)) in
+  assert_ ~__POS__ (Uring.set_fixed_buffer ~dontfork:true t fbuf = Ok ());
+  (* The child doesn't touch the buffer, so it can exit normally. *)
+  begin match Unix.fork () with
+    | 0 -> Unix._exit 0
+    | pid -> assert_ ~__POS__ (snd (Unix.waitpid [] pid) = Unix.WEXITED 0)
+  end;
+  (* The parent can still use the buffer. *)
+  Test_data.with_fd (fun fd ->
+      assert_some ~__POS__ (Uring.read_fixed t ~file_offset:Int63.zero fd ~off:0 ~len:6 `Read);
+      assert_ ~__POS__ (consume t = (`Read, 6));
+      check_string ~__POS__ (Cstruct.to_string (Cstruct.of_bigarray fbuf ~len:6)) ~expected:"A test"
+    );
+  assert_ ~__POS__ (Uring.set_fixed_buffer t Cstruct.empty.buffer = Ok ())
+
+let test_ring_pool () =
+  let now = ref 0.0 in
+  let pool = Uring.Ring_pool.create ~clock:(fun () -> !now) ~max_idle:1 ~idle_timeout:10.0
+      ~fixed_buffer_size:64 ~queue_depth:2 () in
+  let t1 = Uring.Ring_pool.acquire pool in
+  let buf1 = Uring.buf t1 in
+  check_int ~__POS__ (Bigarray.Array1.dim buf1) ~expected:64;
+  Uring.set_limits t1 ~max_io:1;
+  assert_some ~__POS__ (Uring.noop t1 1);
+  check_raises ~__POS__ (Invalid_argument "Ring_pool.release: 1 request(s) still active!")
+    (fun () -> Uring.Ring_pool.release pool t1);
+  check_int ~__POS__ (fst (consume t1)) ~expected:1;
+  ignore (set_fixed_buffer t1 32 : Cstruct.buffer);
+  let t2 = Uring.Ring_pool.acquire pool in
+  Uring.Ring_pool.release pool t1;
+  (* The pool is full, so [t2] is shut down. *)
+  Uring.Ring_pool.release pool t2;
+  check_int ~__POS__ (Uring.Ring_pool.idle pool) ~expected:1;
+  (* [t1] is reused, with its limits cleared and the pool's buffer back. *)
+  let t = Uring.Ring_pool.acquire pool in
+  assert_ ~__POS__ (t == t1);
+  assert_ ~__POS__ (Uring.buf t == buf1);
+  check_int ~__POS__ (Uring.Ring_pool.idle pool) ~expected:0;
+  let r, w = Unix.pipe () in
+  assert_some ~__POS__ (Uring.poll_add t r Uring.Poll_mask.pollin 2);
+  assert_some ~__POS__ (Uring.noop t 3);
+  Uring.Ring_pool.release ~drain:true pool t;
+  (* Idle rings expire. *)
+  now := 11.0;
+  Uring.Ring_pool.trim pool;
+  check_int ~__POS__ (Uring.Ring_pool.idle pool) ~expected:0;
+  Uring.Ring_pool.close pool;
+  check_raises ~__POS__ (Invalid_argument "Ring_pool.acquire: pool is closed")
+    (fun () -> ignore (Uring.Ring_pool.acquire pool));
+  Unix.close r;
+  Unix.close w
+
+let test_loop () =
+  let loop = Uring.Loop.create (Uring.create ~queue_depth:4 ()) in
+  let ring = Uring.Loop.ring loop in
+  let log = ref [] in
+  let note x = log := x :: !log in
+  assert_ ~__POS__ (Uring.Loop.is_idle loop);
+  check_int ~__POS__ (Uring.Loop.run_once loop) ~expected:0;
+  assert_some ~__POS__ (Uring.noop ring (fun r -> note (Printf.sprintf "noop %d" r)));
+  let r, w = Unix.pipe () in
+  assert_some ~__POS__ (Uring.poll_add ring r Uring.Poll_mask.pollin (fun _ -> note "readable"));
+  ignore (Uring.Loop.after loop 0.02 (fun () ->
+      note "timer";
+      ignore (Unix.write_substring w "!" 0 1 : int)
+    ) : Uring.Loop.timer);
+  let cancelled = Uring.Loop.after loop 0.01 (fun () -> note "cancelled") in
+  ignore (Uring.Loop.after loop 0.0 (fun () -> note "now"; Uring.Loop.cancel_timer loop cancelled) : Uring.Loop.timer);
+  assert_ ~__POS__ (not (Uring.Loop.is_idle loop));
+  Uring.Loop.run loop;
+  assert_ ~__POS__ (Uring.Loop.is_idle loop);
+  assert_ ~__POS__ (List.rev !log = ["now"; "noop 0"; "timer"; "readable"]);
+  (* [stop] ends [run] early. *)
+  log := [];
+  ignore (Uring.Loop.after loop 0.0 (fun () -> note "first"; Uring.Loop.stop loop) : Uring.Loop.timer);
+  ignore (Uring.Loop.after loop 0.01 (fun () -> note "second") : Uring.Loop.timer);
+  Uring.Loop.run loop;
+  assert_ ~__POS__ (List.rev !log = ["first"]);
+  Uring.Loop.run loop;
+  assert_ ~__POS__ (List.rev !log = ["first"; "second"]);
+  (* A non-blocking call still submits, and an earlier [stop] doesn't stop later calls blocking. *)
+  log := [];
+  assert_some ~__POS__ (Uring.noop ring (fun _ -> note "noop"));
+  ignore (Uring.Loop.run_once ~block:false loop : int);
+  check_int ~__POS__ (Uring.submit ring) ~expected:0;
+  check_int ~__POS__ (Uring.Loop.run_once loop) ~expected:1;
+  Uring.Loop.stop loop;
+  ignore (Uring.Loop.after loop 0.01 (fun () -> note "later") : Uring.Loop.timer);
+  check_int ~__POS__ (Uring.Loop.run_once loop) ~expected:1;
+  assert_ ~__POS__ (List.rev !log = ["noop"; "later"]);
+  Uring.exit ring;
+  Unix.close r;
+  Unix.close w
+
+let test_template () =
+  with_uring ~queue_depth:2 @@ fun t ->
+  let fbuf = set_fixed_buffer t 64 in
+  let region = Uring.Region.init fbuf 4 ~block_size:16 in
+  let chunk = Uring.Region.alloc region in
+  Test_data.with_fd @@ fun fd ->
+  let tmpl = Uring.Template.read_chunk ~len:4 t fd chunk in
+  let read file_offset =
+    assert_some ~__POS__ (Uring.Template.submit tmpl ~file_offset:(Int63.of_int file_offset) file_offset);
+    let data, result = consume t in
+    check_int ~__POS__ data ~expected:file_offset;
+    Uring.Region.to_string ~len:result chunk
+  in
+  check_string ~__POS__ (read 0) ~expected:"A te";
+  check_string ~__POS__ (read 7) ~expected:"file";
+  check_string ~__POS__ (read 9) ~expected:"le";
+  ignore (set_fixed_buffer t 64 : Cstruct.buffer);
+  check_raises ~__POS__ (Invalid_argument "Template.submit: the ring's fixed buffer has changed")
+    (fun () -> ignore (Uring.Template.submit tmpl ~file_offset:Int63.zero 0))
+
+let test_hedge () =
+  with_uring ~queue_depth:8 @@ fun t ->
+  let fbuf = set_fixed_buffer t 64 in
+  let region = Uring.Region.init fbuf 4 ~block_size:16 in
+  let policy = Uring.Hedge.create ~max_delay:0.01 () in
+  Test_data.with_fd @@ fun file ->
+  let r, w = Unix.pipe () in
+  let pipe = (r, Int63.minus_one) and file = (file, Int63.zero) in
+  let rec drain () = if Uring.active_ops t > 0 then (ignore (Uring.wait t); drain ()) in
+  let check_read ~primary ~secondary ~expected =
+    let read = Option.get (Uring.Hedge.read policy t region ~len:16 ~primary ~secondary `Hedged) in
+    assert_ ~__POS__ (Uring.Hedge.winner read = `Pending);
+    assert_ ~__POS__ (consume t = (`Hedged, 11));
+    assert_ ~__POS__ (Uring.Hedge.winner read = expected);
+    let chunk = Uring.Hedge.chunk read in
+    check_string ~__POS__ (Uring.Region.to_string ~len:11 chunk) ~expected:"A test file";
+    Uring.Region.free chunk;
+    (* The loser (or the timer) is cancelled and not reported. *)
+    drain ()
+  in
+  (* The pipe never becomes readable, so the secondary wins. *)
+  check_read ~primary:pipe ~secondary:file ~expected:`Secondary;
+  check_read ~primary:file ~secondary:pipe ~expected:`Primary;
+  let { Uring.Hedge.reads; hedged; secondary_wins } = Uring.Hedge.stats policy in
+  check_int ~__POS__ reads ~expected:2;
+  check_int ~__POS__ hedged ~expected:1;
+  check_int ~__POS__ secondary_wins ~expected:1;
+  (* Cancelling everything (as [exit ~drain] does) doesn't start the secondary. *)
+  let slow = Uring.Hedge.create ~max_delay:10.0 () in
+  let read = Option.get (Uring.Hedge.read slow t region ~len:16 ~primary:pipe ~secondary:pipe `Hedged) in
+  check_int ~__POS__ (Uring.submit t) ~expected:2;
+  assert_some ~__POS__ (Uring.cancel_all t `All);
+  let results = [consume t; consume t] in
+  assert_ ~__POS__ (List.assoc `Hedged results < 0);
+  assert_ ~__POS__ (List.mem_assoc `All results);
+  drain ();
+  assert_ ~__POS__ (Uring.Hedge.winner read = `Primary);
+  Uring.Region.free (Uring.Hedge.chunk read);
+  check_int ~__POS__ (Uring.Hedge.stats slow).hedged ~expected:0;
+  (* All chunks have been returned. *)
+  check_int ~__POS__ (Uring.Region.avail region) ~expected:4;
+  Unix.close r;
+  Unix.close w
+
+(* A hook that needs to cancel something when the SQ is full leaves it for the next submit. *)
+let test_hedge_sq_full () =
+  with_uring ~queue_depth:4 @@ fun t ->
+  let fbuf = set_fixed_buffer t 32 in
+  let region = Uring.Region.init fbuf 2 ~block_size:16 in
+  let policy = Uring.Hedge.create ~max_delay:10.0 () in
+  Test_data.with_fd @@ fun file ->
+  let r, w = Unix.pipe () in
+  let read = Option.get (Uring.Hedge.read policy t region ~len:16 ~primary:(file, Int63.zero) ~secondary:(r, Int63.minus_one) `Hedged) in
+  let pipe_read () = assert_some ~__POS__ (Uring.readv t r [Cstruct.create 1] `Pipe ~file_offset:Int63.minus_one) in
+  pipe_read ();
+  pipe_read ();
+  check_int ~__POS__ (Uring.submit t) ~expected:4;
+  Unix.sleepf 0.05;
+  (* Fill the SQ without submitting. *)
+  assert_some ~__POS__ (Uring.cancel_fd t r `Cancelled);
+  assert_some ~__POS__ (Uring.cancel_fd t r `Cancelled);
+  begin match Uring.peek t with
+    | Some { data = `Hedged; result } -> check_int ~__POS__ result ~expected:11
+    | _ -> Alcotest.fail "Expected the file read to have finished"
+  end;
+  assert_ ~__POS__ (Uring.Hedge.winner read = `Primary);
+  Uring.Region.free (Uring.Hedge.chunk read);
+  (* The timer's cancel is sent after the ones that filled the SQ. *)
+  check_int ~__POS__ (Uring.submit t) ~expected:5;
+  let rec drain () =
+    if Uring.active_ops t > 0 then
+      match Uring.wait ~timeout:1.0 t with
+      | Some { data = `Pipe | `Cancelled; _ } -> drain ()
+      | Some _ -> Alcotest.fail "Unexpected completion"
+      | None -> Alcotest.fail "Timed out (was the timer cancelled?)"
+  in
+  drain ();
+  check_int ~__POS__ (Uring.Hedge.stats policy).hedged ~expected:0;
+  Unix.close r;
+  Unix.close w
+
 let test_region () =
   with_uring ~queue_depth:1 @@ fun t ->
   let fbuf = set_fixed_buffer t 64 in
@@ -360,6 +1103,37 @@ let test_cancel_invalid () =
     (Invalid_argument "Entry has already been freed!")
     (fun () -> ignore (Uring.cancel t read `Cancel))
 
+(* Cancel all the reads waiting on a pipe, leaving other jobs alone. *)
+let test_cancel_fd () =
+  with_uring ~queue_depth:5 @@ fun t ->
+  let _fbuf = set_fixed_buffer t 1024 in
+  let r, w = Unix.pipe () in
+  let r2, w2 = Unix.pipe () in
+  assert_some ~__POS__ (Uring.read_fixed t ~file_offset:Int63.zero r ~off:0 ~len:1 `Read);
+  assert_some ~__POS__ (Uring.read_fixed t ~file_offset:Int63.zero r ~off:1 ~len:1 `Read);
+  assert_some ~__POS__ (Uring.read_fixed t ~file_offset:Int63.zero r2 ~off:2 ~len:1 `Other);
+  check_int ~__POS__ ~expected:3 (Uring.submit t);
+  Alcotest.(check ~pos:__POS__ (option int)) "" (Some 2) (Uring.cancel_fd t r `Done);
+  let rec collect reads =
+    match consume t with
+    | `Read, res ->
+      (* EINTR if the read was already running, as in [test_cancel]. *)
+      assert_ ~__POS__ (res = -125 || res = -4);
+      collect (reads + 1)
+    | `Done, n ->
+      check_int ~__POS__ ~expected:2 n;
+      check_int ~__POS__ ~expected:2 reads
+    | `Other, _ -> Alcotest.fail "Wrong job cancelled"
+  in
+  collect 0;
+  (* Nothing left to cancel on [r], so we get the result immediately. *)
+  Alcotest.(check ~pos:__POS__ (option int)) "" (Some 0) (Uring.cancel_fd t r `Done);
+  assert_ ~__POS__ (consume t = (`Done, 0));
+  Alcotest.(check ~pos:__POS__ (option int)) "" (Some 1) (Uring.cancel_all t `Done);
+  assert_ ~__POS__ (fst (consume t) = `Other);
+  assert_ ~__POS__ (consume t = (`Done, 1));
+  List.iter Unix.close [r; w; r2; w2]
+
 let test_free_busy () =
   let t = Uring.create ~queue_depth:1 () in
   let _fbuf = set_fixed_buffer t 1024 in
@@ -376,6 +1150,23 @@ let test_free_busy () =
   check_int ~__POS__ ~expected:0    r_read;
   Uring.exit t
 
+let test_exit_drain () =
+  let t = Uring.create ~queue_depth:4 () in
+  let _fbuf = set_fixed_buffer t 1024 in
+  let r, w = Unix.pipe () in
+  assert_some ~__POS__ (Uring.read_fixed t ~file_offset:Int63.minus_one r ~off:0 ~len:1 `Read);
+  assert_some ~__POS__ (Uring.noop t `Noop);
+  check_int   ~__POS__ (Uring.submit t) ~expected:2;
+  assert_some ~__POS__ (Uring.noop t `Unsubmitted);
+  let released = ref [] in
+  Uring.exit t ~drain:true ~release:(fun d res -> released := (d, res) :: !released);
+  let released = !released in
+  check_int ~__POS__ ~expected:3 (List.length released);
+  assert_ ~__POS__ (List.mem (`Noop, 0) released);
+  assert_ ~__POS__ (List.mem (`Unsubmitted, 0) released);
+  assert_ ~__POS__ (List.mem (`Read, -125) released || List.mem (`Read, -4) released);
+  List.iter Unix.close [r; w]
+
 let test_send_msg () =
   let r, w = Unix.pipe () in
   let t = Uring.create ~queue_depth:2 () in
@@ -404,6 +1195,56 @@ let test_send_msg () =
   check_string ~__POS__ ~expected:"to-w" (really_input_string (Unix.in_channel_of_descr r2) 4);
   List.iter Unix.close [r; w; r2; w2]
 
+(* Reuse a single msghdr at each end to pass FDs as arrays. *)
+let test_send_msg_fds_array () =
+  let r, w = Unix.pipe () in
+  let t = Uring.create ~queue_depth:2 () in
+  let a, b = Unix.(socketpair PF_UNIX SOCK_SEQPACKET 0) in
+  let send = Uring.Msghdr.create ~n_fds:2 [Cstruct.of_string "!"] in
+  let recv = Uring.Msghdr.create ~n_fds:2 [Cstruct.create 1] in
+  check_raises ~__POS__ (Invalid_argument "Msghdr.set_fds: too many FDs for this msghdr")
+    (fun () -> Uring.Msghdr.set_fds send [| r; w; r |]);
+  let transfer fds =
+    Uring.Msghdr.set_fds send fds;
+    assert_some ~__POS__ (Uring.send_msghdr t a send `Send);
+    let _, r_send = consume t in
+    check_int ~__POS__ ~expected:1 r_send;
+    assert_some ~__POS__ (Uring.recv_msg t b recv `Recv);
+    let _, r_recv = consume t in
+    check_int ~__POS__ ~expected:1 r_recv;
+    Uring.Msghdr.get_fds_array recv
+  in
+  let got = transfer [| r; w |] in
+  check_int ~__POS__ ~expected:2 (Array.length got);
+  check_int ~__POS__ ~expected:3 (Unix.write_substring got.(1) "abc" 0 3);
+  check_string ~__POS__ ~expected:"abc" (really_input_string (Unix.in_channel_of_descr r) 3);
+  Array.iter Unix.close got;
+  let got = transfer [| w |] in
+  check_int ~__POS__ ~expected:1 (Array.length got);
+  Array.iter Unix.close got;
+  check_int ~__POS__ ~expected:0 (Array.length (transfer [| |]));
+  List.iter Unix.close [r; w; a; b];
+  Uring.exit t
+
+let test_teardown () =
+  with_uring ~queue_depth:4 @@ fun t ->
+  let teardown ?timeout ~peer_msg () =
+    let a, b = Unix.(socketpair PF_UNIX SOCK_STREAM 0) in
+    Option.iter (fun msg -> ignore (Unix.write_substring b msg 0 (String.length msg))) peer_msg;
+    let drain = Cstruct.create 16 in
+    assert_some ~__POS__ (Uring.teardown t a ~drain ?timeout `Teardown);
+    let token, r_close = consume t in
+    assert_   ~__POS__ (token = `Teardown);
+    check_int ~__POS__ ~expected:0 r_close;
+    (* [a] sent end-of-file before being closed. *)
+    check_int ~__POS__ ~expected:0 (Unix.read b (Bytes.create 1) 0 1);
+    Unix.close b;
+    Cstruct.to_string drain
+  in
+  check_string ~__POS__ ~expected:"bye" (String.sub (teardown ~peer_msg:(Some "bye") ()) 0 3);
+  (* The peer doesn't send anything, so the drain read times out. *)
+  ignore (teardown ~timeout:0.01 ~peer_msg:None () : string)
+
 let () =
   Test_data.setup ();
   Random.self_init ();
@@ -423,11 +1264,40 @@ let () =
       tc "read" test_read;
       tc "readv" test_readv;
       tc "readv2" test_readv2;
+      tc "flags" test_flags;
+      tc "ioprio" test_ioprio;
+      tc "sched" test_sched;
+      tc "sched_limits" test_sched_limits;
+      tc "limits" test_limits;
+      tc "lanes" test_lanes;
+      tc "histogram" test_histogram;
+      tc "read_shared" test_read_shared;
+      tc "block_cache" test_block_cache;
+      tc "batch" test_batch;
+      tc "batch_merge" test_batch_merge;
+      tc "try_sync" test_try_sync;
+      tc "auto_flush" test_auto_flush;
+      tc "cq_headroom" test_cq_headroom;
+      tc "cq_overflow" test_cq_overflow;
+      tc "wait_any" test_wait_any;
+      tc "epoll" test_epoll;
+      tc "poll_multishot" test_poll_multishot;
+      tc "fallback" test_fallback;
+      tc "dontfork" test_dontfork;
+      tc "ring_pool" test_ring_pool;
+      tc "loop" test_loop;
+      tc "template" test_template;
+      tc "hedge" test_hedge;
+      tc "hedge_sq_full" test_hedge_sq_full;
       tc "region" test_region;
       tc "cancel" test_cancel;
       tc "cancel_late" test_cancel_late;
       tc "cancel_invalid" test_cancel_invalid;
+      tc "cancel_fd" test_cancel_fd;
       tc "send_msg" test_send_msg;
+      tc "send_msg_fds_array" test_send_msg_fds_array;
+      tc "teardown" test_teardown;
       tc "free_busy" test_free_busy;
+      tc "exit_drain" test_exit_drain;
     ];
   ]
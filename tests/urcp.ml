@@ -6,8 +6,9 @@ let setup_log style_renderer level =
 open Cmdliner
 
 
-let run fixed block_size queue_depth infile outfile () =
-  let fn = if fixed then Urcp_fixed_lib.run_cp else Urcp_lib.run_cp in
+let run fixed threads block_size queue_depth infile outfile () =
+  let backend = Option.map (fun n -> Uring.Threads n) threads in
+  let fn = if fixed then Urcp_fixed_lib.run_cp else Urcp_lib.run_cp ?backend in
   fn block_size queue_depth infile outfile ()
 
 let cmd =
@@ -28,6 +29,9 @@ let cmd =
   let fixed =
     let doc = "Use fixed buffers mode instead of dynamic allocation" in
     Arg.(value & flag & info ["fixed"] ~docv:"FIXED" ~doc) in
+  let threads =
+    let doc = "Use a pool of $(docv) threads instead of io_uring (dynamic allocation mode only)" in
+    Arg.(value & opt (some int) None & info ["threads"] ~docv:"THREADS" ~doc) in
   let doc = "copy a file using async io_uring" in
   let man =
       [
@@ -36,7 +40,7 @@ let cmd =
       ]
     in
   let info = Cmd.info "urcp" ~version:"1.0.0" ~doc ~man in
-    Cmd.v info Term.(const run $ fixed $ block_size $ queue_depth $ infile $ outfile $ setup_log)
+    Cmd.v info Term.(const run $ fixed $ threads $ block_size $ queue_depth $ infile $ outfile $ setup_log)
   
 let () =
   match Cmd.eval cmd with
@@ -154,13 +154,13 @@ let copy_file uring t =
     Logs.debug (fun l -> l "%a: %d" Fmt.(styled `Yellow string) "submit" num);
   done
 
-let run_cp block_size queue_depth infile outfile () =
+let run_cp ?backend block_size queue_depth infile outfile () =
    let infd = Unix.(handle_unix_error (openfile infile [O_RDONLY]) 0) in
    let outfd = Unix.(handle_unix_error (openfile outfile [O_WRONLY; O_CREAT; O_TRUNC]) 0o644) in
    let insize = get_file_size infd in
    let t = { block_size; insize; offset=Int63.zero; reads=0; writes=0; write_left=insize; read_left=insize; infd; outfd } in
    Logs.debug (fun l -> l "starting: %a bs=%d qd=%d" pp t block_size queue_depth);
-   let uring = Uring.create ~queue_depth () in
+   let uring = Uring.create ?backend ~queue_depth () in
    copy_file uring t;
    Unix.close infd;
    Unix.close outfd;